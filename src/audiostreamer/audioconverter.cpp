@@ -0,0 +1,188 @@
+/*
+ * Copyright (C) 2022 LibreMobileOS Foundation
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#define LOG_TAG "audiostreamer-converter"
+
+#include "audioconverter.h"
+#include <cutils/log.h>
+#include <math.h>
+#include <stdlib.h>
+#include <string.h>
+
+#if defined(__ARM_NEON)
+#include <arm_neon.h>
+#elif defined(__SSE__)
+#include <xmmintrin.h>
+#endif
+
+// filter length per unit of decimation, the transition band gets
+// narrower as this grows
+#define TAPS_PER_FACTOR 24
+
+static float dotProduct(const float *a, const float *b, int n) {
+    int i = 0;
+    float sum = 0.0f;
+
+#if defined(__ARM_NEON)
+    float32x4_t acc0 = vdupq_n_f32(0.0f);
+    float32x4_t acc1 = vdupq_n_f32(0.0f);
+    for (; i + 8 <= n; i += 8) {
+        acc0 = vmlaq_f32(acc0, vld1q_f32(a + i), vld1q_f32(b + i));
+        acc1 = vmlaq_f32(acc1, vld1q_f32(a + i + 4), vld1q_f32(b + i + 4));
+    }
+    acc0 = vaddq_f32(acc0, acc1);
+    float32x2_t half = vadd_f32(vget_low_f32(acc0), vget_high_f32(acc0));
+    sum = vget_lane_f32(vpadd_f32(half, half), 0);
+#elif defined(__SSE__)
+    __m128 acc0 = _mm_setzero_ps();
+    __m128 acc1 = _mm_setzero_ps();
+    for (; i + 8 <= n; i += 8) {
+        acc0 = _mm_add_ps(acc0, _mm_mul_ps(_mm_loadu_ps(a + i), _mm_loadu_ps(b + i)));
+        acc1 = _mm_add_ps(acc1, _mm_mul_ps(_mm_loadu_ps(a + i + 4), _mm_loadu_ps(b + i + 4)));
+    }
+    float lanes[4];
+    _mm_storeu_ps(lanes, _mm_add_ps(acc0, acc1));
+    sum = lanes[0] + lanes[1] + lanes[2] + lanes[3];
+#endif
+
+    for (; i < n; i++)
+        sum += a[i] * b[i];
+
+    return sum;
+}
+
+bool initAudioConverter(AudioConverter *conv, int inRate, int inChannels, int outRate,
+                        int outChannels, int maxFrames) {
+    memset(conv, 0, sizeof(*conv));
+
+    if (outRate <= 0 || inRate % outRate != 0 || inRate / outRate > MAX_DECIMATION_FACTOR) {
+        ALOGE("%s: unsupported rate %d -> %d", __FUNCTION__, inRate, outRate);
+        return false;
+    }
+    if (outChannels != inChannels && outChannels != 1) {
+        ALOGE("%s: unsupported channels %d -> %d", __FUNCTION__, inChannels, outChannels);
+        return false;
+    }
+
+    conv->inChannels = inChannels;
+    conv->outChannels = outChannels;
+    conv->outRate = outRate;
+    conv->factor = inRate / outRate;
+    conv->maxFrames = maxFrames;
+    conv->phase = 0;
+
+    if (conv->factor == 1) {
+        conv->numTaps = 1;
+    } else {
+        conv->numTaps = TAPS_PER_FACTOR * conv->factor + 1;
+    }
+
+    conv->taps = (float *)malloc(conv->numTaps * sizeof(float));
+    conv->lines = (float *)calloc(outChannels * (conv->numTaps - 1 + maxFrames), sizeof(float));
+    if (conv->taps == NULL || conv->lines == NULL) {
+        releaseAudioConverter(conv);
+        return false;
+    }
+
+    if (conv->numTaps == 1) {
+        conv->taps[0] = 1.0f;
+    } else {
+        // Blackman windowed sinc, cut off a little below the new Nyquist
+        double cutoff = 0.45 / conv->factor;
+        double center = (conv->numTaps - 1) / 2.0;
+        double sum = 0.0;
+        for (int k = 0; k < conv->numTaps; k++) {
+            double x = k - center;
+            double sinc = x == 0.0 ? 2.0 * cutoff : sin(2.0 * M_PI * cutoff * x) / (M_PI * x);
+            double w = 0.42 - 0.5 * cos(2.0 * M_PI * k / (conv->numTaps - 1)) +
+                       0.08 * cos(4.0 * M_PI * k / (conv->numTaps - 1));
+            conv->taps[k] = (float)(sinc * w);
+            sum += sinc * w;
+        }
+        for (int k = 0; k < conv->numTaps; k++)
+            conv->taps[k] = (float)(conv->taps[k] / sum);
+    }
+
+    ALOGI("%s: %dHz/%dch -> %dHz/%dch, %d taps", __FUNCTION__, inRate, inChannels, outRate,
+          outChannels, conv->numTaps);
+    return true;
+}
+
+void releaseAudioConverter(AudioConverter *conv) {
+    free(conv->taps);
+    free(conv->lines);
+    conv->taps = NULL;
+    conv->lines = NULL;
+}
+
+static bool isPassthroughConverter(const AudioConverter *conv) {
+    return conv->factor == 1 && conv->inChannels == conv->outChannels;
+}
+
+int convertAudio(AudioConverter *conv, const int16_t *in, int frames, int16_t *out) {
+    if (frames > conv->maxFrames)
+        frames = conv->maxFrames;
+
+    if (isPassthroughConverter(conv)) {
+        memcpy(out, in, frames * conv->inChannels * sizeof(int16_t));
+        return frames;
+    }
+
+    const int hist = conv->numTaps - 1;
+    const int stride = hist + conv->maxFrames;
+    const float scale = 1.0f / conv->inChannels;
+
+    // de-interleave into the filter lines, down-mixing to mono by averaging
+    for (int c = 0; c < conv->outChannels; c++) {
+        float *line = conv->lines + c * stride + hist;
+        if (conv->outChannels == conv->inChannels) {
+            for (int i = 0; i < frames; i++)
+                line[i] = in[i * conv->inChannels + c];
+        } else {
+            for (int i = 0; i < frames; i++) {
+                int acc = 0;
+                for (int j = 0; j < conv->inChannels; j++)
+                    acc += in[i * conv->inChannels + j];
+                line[i] = acc * scale;
+            }
+        }
+    }
+
+    int outFrames = 0;
+    int n = conv->phase;
+    for (; n < frames; n += conv->factor) {
+        for (int c = 0; c < conv->outChannels; c++) {
+            // the newest sample for output n sits at line[hist + n]
+            float v = dotProduct(conv->taps, conv->lines + c * stride + n, conv->numTaps);
+            int s = (int)lrintf(v);
+            if (s > 32767)
+                s = 32767;
+            else if (s < -32768)
+                s = -32768;
+            out[outFrames * conv->outChannels + c] = (int16_t)s;
+        }
+        outFrames++;
+    }
+    conv->phase = n - frames;
+
+    // keep the tail as history for the next period
+    for (int c = 0; c < conv->outChannels; c++) {
+        float *line = conv->lines + c * stride;
+        memmove(line, line + frames, hist * sizeof(float));
+    }
+
+    return outFrames;
+}
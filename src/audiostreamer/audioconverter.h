@@ -0,0 +1,51 @@
+/*
+ * Copyright (C) 2022 LibreMobileOS Foundation
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef AUDIO_CONVERTER_H
+#define AUDIO_CONVERTER_H
+
+#include <stdint.h>
+
+#define MAX_DECIMATION_FACTOR 8
+
+// Converts the shared 16-bit capture into one client's output format.
+// Only integer decimation (48k -> 24k, 16k, 12k, 8k ...) and stereo to
+// mono down-mix are supported, both done in a single FIR pass.
+struct AudioConverter {
+    int inChannels;
+    int outChannels;
+    int outRate;
+    int factor;
+    int numTaps;
+    int maxFrames;
+
+    // low pass filter, numTaps long
+    float *taps;
+    // per output channel: numTaps - 1 samples of history followed by
+    // up to maxFrames new samples
+    float *lines;
+    // input frames to skip before the next output frame
+    int phase;
+};
+
+bool initAudioConverter(AudioConverter *conv, int inRate, int inChannels, int outRate,
+                        int outChannels, int maxFrames);
+void releaseAudioConverter(AudioConverter *conv);
+
+// Returns the number of frames written to |out|, at most |frames|.
+int convertAudio(AudioConverter *conv, const int16_t *in, int frames, int16_t *out);
+
+#endif // AUDIO_CONVERTER_H
@@ -0,0 +1,92 @@
+/*
+ * Copyright (C) 2022 LibreMobileOS Foundation
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#define LOG_TAG "audiostreamer-record"
+
+#include "audiorecordsource.h"
+#include <android/content/AttributionSourceState.h>
+#include <cutils/log.h>
+#include <media/AudioRecord.h>
+
+using namespace android;
+using android::content::AttributionSourceState;
+
+class AudioRecordSource : public AudioSource {
+  public:
+    AudioRecordSource(uint32_t sampleRate, int channel)
+        : mSampleRate(sampleRate), mChannel(channel) {
+    }
+
+    virtual bool start() {
+        if (mAudioRecord == NULL && !init())
+            return false;
+        return mAudioRecord->start() == OK;
+    }
+
+    virtual void stop() {
+        if (mAudioRecord == NULL)
+            return;
+        ALOGI("%s: pAudioRecord->stop", __FUNCTION__);
+        mAudioRecord->stop();
+        if (mAudioRecord->stopped()) {
+            ALOGI("%s: pAudioRecord->stop end", __FUNCTION__);
+        }
+    }
+
+    virtual int read(void *buffer, size_t size) {
+        return mAudioRecord->read(buffer, size);
+    }
+
+    virtual uint32_t framesLost() {
+        return mAudioRecord != NULL ? mAudioRecord->getInputFramesLost() : 0;
+    }
+
+  private:
+    bool init() {
+        size_t framecount = 0;
+
+        AudioRecord::getMinFrameCount(&framecount, mSampleRate, AUDIO_FORMAT_PCM_16_BIT, audio_channel_in_mask_from_count(mChannel));
+        ALOGI("%s: sampleRate: %d, channel: %d framecount: %d", __FUNCTION__, mSampleRate, mChannel, (int)framecount);
+
+        AttributionSourceState attributionSource;
+        attributionSource.packageName = "com.libremobileos.vncflinger";
+        attributionSource.token = sp<BBinder>::make();
+
+        sp<AudioRecord> record = new AudioRecord(AUDIO_SOURCE_REMOTE_SUBMIX, mSampleRate, AUDIO_FORMAT_PCM_16_BIT,
+                                                 audio_channel_in_mask_from_count(mChannel), attributionSource, framecount);
+
+        if (record == NULL) {
+            ALOGE("%s: create AudioRecord failed", __FUNCTION__);
+            return false;
+        }
+
+        if (record->initCheck() != OK) {
+            ALOGE("%s: init AudioRecord failed", __FUNCTION__);
+            return false;
+        }
+
+        mAudioRecord = record;
+        return true;
+    }
+
+    uint32_t mSampleRate;
+    int mChannel;
+    sp<AudioRecord> mAudioRecord;
+};
+
+AudioSource *createAudioRecordSource(uint32_t sampleRate, int channel) {
+    return new AudioRecordSource(sampleRate, channel);
+}
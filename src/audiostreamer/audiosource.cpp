@@ -0,0 +1,114 @@
+/*
+ * Copyright (C) 2022 LibreMobileOS Foundation
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#define LOG_TAG "audiostreamer-source"
+
+#include "audiosource.h"
+#include <cutils/log.h>
+#include <errno.h>
+#include <math.h>
+#include <stdlib.h>
+#include <string.h>
+
+SyntheticAudioSource::SyntheticAudioSource(uint32_t sampleRate, int channel, int toneHz,
+                                           const char *path)
+    : mSampleRate(sampleRate), mChannel(channel), mToneHz(toneHz),
+      mPath(path != NULL ? strdup(path) : NULL), mFile(NULL), mFramesRead(0), mPhase(0.0) {
+    memset(&mStartTime, 0, sizeof(mStartTime));
+}
+
+SyntheticAudioSource::~SyntheticAudioSource() {
+    stop();
+    free(mPath);
+}
+
+bool SyntheticAudioSource::start() {
+    if (mPath != NULL) {
+        mFile = fopen(mPath, "rb");
+        if (mFile == NULL) {
+            ALOGE("%s: cannot open %s: %d", __FUNCTION__, mPath, errno);
+            return false;
+        }
+        // read() loops the file, which needs at least one frame in it
+        fseek(mFile, 0, SEEK_END);
+        long size = ftell(mFile);
+        rewind(mFile);
+        if (size < (long)(mChannel * sizeof(int16_t))) {
+            ALOGE("%s: %s holds no audio", __FUNCTION__, mPath);
+            fclose(mFile);
+            mFile = NULL;
+            return false;
+        }
+    }
+
+    mFramesRead = 0;
+    clock_gettime(CLOCK_MONOTONIC, &mStartTime);
+    ALOGI("%s: %s at %uHz/%dch", __FUNCTION__, mPath != NULL ? mPath : "tone", mSampleRate,
+          mChannel);
+    return true;
+}
+
+void SyntheticAudioSource::stop() {
+    if (mFile != NULL) {
+        fclose(mFile);
+        mFile = NULL;
+    }
+}
+
+int SyntheticAudioSource::read(void *buffer, size_t size) {
+    size_t frameSize = mChannel * sizeof(int16_t);
+    size_t frames = size / frameSize;
+    if (frames == 0)
+        return 0;
+
+    if (mFile != NULL) {
+        size_t got = fread(buffer, frameSize, frames, mFile);
+        if (got < frames) {
+            // loop the file
+            rewind(mFile);
+            got += fread((char *)buffer + got * frameSize, frameSize, frames - got, mFile);
+        }
+        if (got == 0)
+            return -1;
+        frames = got;
+    } else {
+        int16_t *out = (int16_t *)buffer;
+        double step = 2.0 * M_PI * mToneHz / mSampleRate;
+        for (size_t i = 0; i < frames; i++) {
+            int16_t v = (int16_t)(8192.0 * sin(mPhase));
+            for (int c = 0; c < mChannel; c++)
+                out[i * mChannel + c] = v;
+            mPhase += step;
+            if (mPhase > 2.0 * M_PI)
+                mPhase -= 2.0 * M_PI;
+        }
+    }
+
+    // block until the period would have been captured in real time
+    mFramesRead += frames;
+    uint64_t ns = mFramesRead * 1000000000ULL / mSampleRate;
+    timespec deadline = mStartTime;
+    deadline.tv_sec += ns / 1000000000ULL;
+    deadline.tv_nsec += ns % 1000000000ULL;
+    if (deadline.tv_nsec >= 1000000000L) {
+        deadline.tv_sec++;
+        deadline.tv_nsec -= 1000000000L;
+    }
+    while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &deadline, NULL) == EINTR) {
+    }
+
+    return frames * frameSize;
+}
@@ -0,0 +1,65 @@
+/*
+ * Copyright (C) 2022 LibreMobileOS Foundation
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef AUDIO_SOURCE_H
+#define AUDIO_SOURCE_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <time.h>
+
+// Where captured 16-bit PCM comes from. read() blocks like
+// AudioRecord::read() until a period is available.
+class AudioSource {
+  public:
+    virtual ~AudioSource() {
+    }
+
+    virtual bool start() = 0;
+    virtual void stop() = 0;
+    virtual int read(void *buffer, size_t size) = 0;
+
+    // frames the source had to throw away because nobody read them
+    virtual uint32_t framesLost() {
+        return 0;
+    }
+};
+
+// Generates a sine tone, or plays back a raw PCM file in a loop, paced
+// in real time. Lets the pipeline run without AudioFlinger.
+class SyntheticAudioSource : public AudioSource {
+  public:
+    SyntheticAudioSource(uint32_t sampleRate, int channel, int toneHz, const char *path);
+    virtual ~SyntheticAudioSource();
+
+    virtual bool start();
+    virtual void stop();
+    virtual int read(void *buffer, size_t size);
+
+  private:
+    uint32_t mSampleRate;
+    int mChannel;
+    int mToneHz;
+    char *mPath;
+    FILE *mFile;
+
+    uint64_t mFramesRead;
+    double mPhase;
+    timespec mStartTime;
+};
+
+#endif // AUDIO_SOURCE_H
@@ -16,70 +16,246 @@
 
 #define LOG_TAG "audiostreamer"
 
+#include "audiostreamer.h"
+#include "audioconverter.h"
+#include "audiosource.h"
+#include "silencedetector.h"
 #include "socketmanager.h"
-#include <android/content/AttributionSourceState.h>
 #include <cutils/log.h>
+#include <endian.h>
 #include <errno.h>
-#include <media/AudioRecord.h>
+#include <poll.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <sys/select.h>
+#include <sys/socket.h>
 #include <sys/types.h>
+#include <time.h>
 #include <unistd.h>
-#include <jni.h>
-
-using namespace android;
 
 #define kBufferOutputSize (1452)
 #define READ_AUDIO_MAX 2048
 #define DEFAULT_SOCKET_TCP_PORT (9200)
 #define DEFAULT_SOCKET_UNIX_NAME "audiostreamer"
+#define DEFAULT_SILENCE_THRESHOLD (0)
+#define DEFAULT_SILENCE_HANGOVER (16)
+#define DEFAULT_SEND_QUEUE_PACKETS (32)
+#define DEFAULT_SYNTHETIC_TONE_HZ (440)
+#define STATS_INTERVAL_SECONDS (10)
+#define FORMAT_REQUEST_TIMEOUT_MS (200)
+#define READ_RETRY_DELAY_MS (10)
+#define READ_MAX_FAILURES (100)
 
 static char *gProgramName;
 static int gSocketTCPPort = DEFAULT_SOCKET_TCP_PORT;
 static bool gUsingSocketAndroid = false;
 static bool gUsingSocketUnix = false;
 static bool gRunning = false;
+static int gSilenceThreshold = DEFAULT_SILENCE_THRESHOLD;
+static int gSendQueuePackets = DEFAULT_SEND_QUEUE_PACKETS;
 static char *gSocketName;
-sp<AudioRecord> pAudioRecord = NULL;
+static char *gSourcePath;
+static int gSyntheticToneHz = 0;
+static AudioSource *pAudioSource = NULL;
+static AudioSourceFactory gDeviceSource = NULL;
 
 uint32_t sampleRate = 48000;
 int channel = 2;
 
-using android::content::AttributionSourceState;
+// what clients get unless they ask for something else
+static uint32_t gOutputSampleRate = 48000;
+static int gOutputChannel = 2;
+
+// Optional client request for its output format, sent right after
+// connecting: two little endian 32-bit words, sample rate and channel
+// count. It is looked for once, when the first period is captured, and
+// answered with a FormatReply before that period. Clients that send
+// nothing by then get the default format without a reply.
+struct FormatRequest {
+    uint32_t sampleRate;
+    uint32_t channel;
+};
+
+#define FORMAT_ACCEPTED (0)
+#define FORMAT_REJECTED (1)
+
+// Three little endian 32-bit words: status, then the format of all of
+// the PCM that follows. A rejected request gets the default format.
+struct FormatReply {
+    uint32_t status;
+    uint32_t sampleRate;
+    uint32_t channel;
+};
 
 static int audiostreamer_init() {
-    size_t framecount = 0;
+    if (gSourcePath != NULL || gSyntheticToneHz > 0)
+        pAudioSource = new SyntheticAudioSource(sampleRate, channel, gSyntheticToneHz, gSourcePath);
+    else if (gDeviceSource != NULL)
+        pAudioSource = gDeviceSource(sampleRate, channel);
+
+    return pAudioSource != NULL ? 0 : -1;
+}
 
-    AudioRecord::getMinFrameCount(&framecount, sampleRate, AUDIO_FORMAT_PCM_16_BIT, audio_channel_in_mask_from_count(channel));
-    ALOGI("%s: sampleRate: %d, channel: %d framecount: %d", __FUNCTION__, sampleRate, channel, (int)framecount);
+// Capture side health of the pipeline, per client
+struct PipelineStats {
+    timespec start;
+    timespec lastRead;
+    timespec cpuStart;
+    uint64_t periods;
+    uint64_t capturedBytes;
+    uint64_t queuedBytes;
+    // deviation of period arrival from its nominal duration
+    double jitterSum;
+    double jitterMax;
+    double nextReport;
+};
+
+static double audiostreamer_seconds(const timespec &a, const timespec &b) {
+    return (b.tv_sec - a.tv_sec) + (b.tv_nsec - a.tv_nsec) / 1e9;
+}
 
-    AttributionSourceState attributionSource;
-    attributionSource.packageName = "com.libremobileos.vncflinger";
-    attributionSource.token = sp<BBinder>::make();
+static void audiostreamer_report_stats(PipelineStats *st) {
+    timespec now, cpu;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    clock_gettime(CLOCK_THREAD_CPUTIME_ID, &cpu);
 
-    pAudioRecord = new AudioRecord(AUDIO_SOURCE_REMOTE_SUBMIX, sampleRate, AUDIO_FORMAT_PCM_16_BIT,
-                                   audio_channel_in_mask_from_count(channel), attributionSource, framecount);
+    double wall = audiostreamer_seconds(st->start, now);
+    double audio = (double)st->capturedBytes / (sampleRate * channel * sizeof(int16_t));
+    if (wall <= 0.0 || audio <= 0.0 || st->periods == 0)
+        return;
 
-    if (pAudioRecord == NULL) {
-        ALOGE("%s: create AudioRecord failed", __FUNCTION__);
-        return -1;
+    ALOGI("%s: %.1fs audio in %.1fs, %.0f B/s out, jitter avg %.2fms max %.2fms, "
+          "cpu %.2fms per audio second",
+          __FUNCTION__, audio, wall, st->queuedBytes / wall, st->jitterSum / st->periods * 1000.0,
+          st->jitterMax * 1000.0, audiostreamer_seconds(st->cpuStart, cpu) / audio * 1000.0);
+}
+
+static void audiostreamer_update_stats(PipelineStats *st, int readLen, int outLen) {
+    timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+
+    if (st->periods > 0) {
+        double expected = (double)readLen / (sampleRate * channel * sizeof(int16_t));
+        double jitter = audiostreamer_seconds(st->lastRead, now) - expected;
+        if (jitter < 0.0)
+            jitter = -jitter;
+        st->jitterSum += jitter;
+        if (jitter > st->jitterMax)
+            st->jitterMax = jitter;
+    }
+    st->lastRead = now;
+    st->periods++;
+    st->capturedBytes += readLen;
+    st->queuedBytes += outLen;
+
+    if (audiostreamer_seconds(st->start, now) >= st->nextReport) {
+        audiostreamer_report_stats(st);
+        st->nextReport += STATS_INTERVAL_SECONDS;
     }
+}
 
-    if (pAudioRecord->initCheck() != OK) {
-        ALOGE("%s: init AudioRecord failed", __FUNCTION__);
-        return -1;
+// Reads the whole request, or fails if it does not arrive in time.
+static bool audiostreamer_read_format(int sock, FormatRequest *req) {
+    FormatRequest tmp;
+    size_t got = 0;
+    while (got < sizeof(tmp)) {
+        pollfd pfd;
+        pfd.fd = sock;
+        pfd.events = POLLIN;
+        pfd.revents = 0;
+        if (poll(&pfd, 1, FORMAT_REQUEST_TIMEOUT_MS) <= 0)
+            return false;
+
+        ssize_t n = recv(sock, (char *)&tmp + got, sizeof(tmp) - got, MSG_DONTWAIT);
+        if (n <= 0 && !(n < 0 && (errno == EAGAIN || errno == EINTR)))
+            return false;
+        if (n > 0)
+            got += n;
     }
 
-    return 0;
+    req->sampleRate = le32toh(tmp.sampleRate);
+    req->channel = le32toh(tmp.channel);
+    return true;
+}
+
+// Sets up |converter| for the default output format.
+static void audiostreamer_default_format(AudioConverter *converter) {
+    const int maxFrames = READ_AUDIO_MAX / (channel * sizeof(int16_t));
+
+    if (!initAudioConverter(converter, sampleRate, channel, gOutputSampleRate, gOutputChannel,
+                            maxFrames)) {
+        initAudioConverter(converter, sampleRate, channel, sampleRate, channel, maxFrames);
+    }
+}
+
+// Switches |converter| to the client's format if it sent a request,
+// checked once before the first period goes out so the stream never
+// changes format. Never waits for a request that has not started to
+// arrive: starting the source and capturing that period already gave
+// the client time to send one. Returns false if the client should be
+// dropped.
+static bool audiostreamer_negotiate_format(int sock, AudioConverter *converter) {
+    const int maxFrames = READ_AUDIO_MAX / (channel * sizeof(int16_t));
+
+    pollfd pfd;
+    pfd.fd = sock;
+    pfd.events = POLLIN;
+    pfd.revents = 0;
+    if (poll(&pfd, 1, 0) <= 0)
+        return true;
+
+    FormatRequest req;
+    if (!audiostreamer_read_format(sock, &req)) {
+        ALOGE("%s: incomplete format request", __FUNCTION__);
+        return false;
+    }
+
+    FormatReply reply;
+    AudioConverter requested;
+    if (initAudioConverter(&requested, sampleRate, channel, req.sampleRate, req.channel,
+                           maxFrames)) {
+        releaseAudioConverter(converter);
+        *converter = requested;
+        reply.status = htole32(FORMAT_ACCEPTED);
+    } else {
+        ALOGE("%s: rejected %uHz/%uch, streaming %dHz/%dch", __FUNCTION__, req.sampleRate,
+              req.channel, converter->outRate, converter->outChannels);
+        reply.status = htole32(FORMAT_REJECTED);
+    }
+    reply.sampleRate = htole32(converter->outRate);
+    reply.channel = htole32(converter->outChannels);
+
+    return sendDataSocket(sock, &reply, sizeof(reply), FORMAT_REQUEST_TIMEOUT_MS);
+}
+
+// Nothing is written to the client while silence is suppressed, so a
+// client that went away would go unnoticed until sound resumes. Clients
+// never half-close the connection, so an orderly shutdown counts too.
+static bool audiostreamer_client_gone(int sock) {
+    pollfd pfd;
+    pfd.fd = sock;
+    pfd.events = POLLRDHUP;
+    pfd.revents = 0;
+    if (poll(&pfd, 1, 0) <= 0)
+        return false;
+    return (pfd.revents & (POLLRDHUP | POLLHUP | POLLERR)) != 0;
 }
 
 void audiostreamer_record_thread(void *arg) {
     int err = 0;
     char *pReadBuf = NULL;
+    char *pOutBuf = NULL;
     int iReadLen = 0;
+    int iOutLen = 0;
+    int readFailures = 0;
+    bool negotiated = false;
     int nSock = 0;
+    SilenceDetector silence;
+    SendQueue *pQueue = NULL;
+    SendQueueStats queueStats;
+    AudioConverter converter;
+    PipelineStats stats;
 
     if (NULL != arg) {
         nSock = *((int *)arg);
@@ -89,43 +265,115 @@ void audiostreamer_record_thread(void *arg) {
         return;
     }
 
-    if (pAudioRecord == NULL) {
+    if (pAudioSource == NULL) {
         err = audiostreamer_init();
         if (err != 0) {
-            ALOGE("%s: create AudioRecord failed", __FUNCTION__);
+            ALOGE("%s: create audio source failed", __FUNCTION__);
+            closeSocket(nSock);
             return;
         }
     }
 
     pReadBuf = (char *) malloc(READ_AUDIO_MAX);
-    if (pReadBuf == NULL) {
+    pOutBuf = (char *) malloc(READ_AUDIO_MAX);
+    if (pReadBuf == NULL || pOutBuf == NULL) {
         ALOGE("%s: Failed to allocate memory", __FUNCTION__);
+        free(pReadBuf);
+        free(pOutBuf);
         return;
     }
 
-    pAudioRecord->start();
-    while (gRunning) {
+    audiostreamer_default_format(&converter);
+
+    pQueue = createSendQueue(nSock, gSendQueuePackets, READ_AUDIO_MAX);
+    if (pQueue == NULL) {
+        ALOGE("%s: Failed to create send queue", __FUNCTION__);
+        releaseAudioConverter(&converter);
+        free(pReadBuf);
+        free(pOutBuf);
+        closeSocket(nSock);
+        return;
+    }
+
+    initSilenceDetector(&silence, gSilenceThreshold, DEFAULT_SILENCE_HANGOVER);
+
+    memset(&stats, 0, sizeof(stats));
+    clock_gettime(CLOCK_MONOTONIC, &stats.start);
+    clock_gettime(CLOCK_THREAD_CPUTIME_ID, &stats.cpuStart);
+    stats.nextReport = STATS_INTERVAL_SECONDS;
+
+    bool capturing = pAudioSource->start();
+    if (!capturing) {
+        ALOGE("%s: start audio source failed", __FUNCTION__);
+    }
+    while (gRunning && capturing) {
         memset(pReadBuf, 0, READ_AUDIO_MAX);
 
-        iReadLen = pAudioRecord->read(pReadBuf, kBufferOutputSize);
+        iReadLen = pAudioSource->read(pReadBuf, kBufferOutputSize);
         if (iReadLen <= 0) {
-            ALOGE("%s: pAudioRecord->read failed", __FUNCTION__);
+            // back off, and give up on a source that stays broken
+            // rather than spin on it
+            if (++readFailures >= READ_MAX_FAILURES) {
+                ALOGE("%s: pAudioSource->read failed %d times, giving up", __FUNCTION__,
+                      readFailures);
+                break;
+            }
+            if (readFailures == 1)
+                ALOGE("%s: pAudioSource->read failed: %d", __FUNCTION__, iReadLen);
+            usleep(READ_RETRY_DELAY_MS * 1000);
             continue;
         }
+        readFailures = 0;
 
-        if (!sendDataSocket(nSock, pReadBuf, iReadLen, 0)) break;
-    }
+        if (!negotiated) {
+            if (!audiostreamer_negotiate_format(nSock, &converter))
+                break;
+            negotiated = true;
+        }
 
-    if (pAudioRecord != NULL) {
-        ALOGI("%s: pAudioRecord->stop", __FUNCTION__);
-        pAudioRecord->stop();
-        if (pAudioRecord->stopped()) {
-            ALOGI("%s: pAudioRecord->stop end", __FUNCTION__);
+        if (!shouldSendPeriod(&silence, pReadBuf, iReadLen)) {
+            audiostreamer_update_stats(&stats, iReadLen, 0);
+            if (audiostreamer_client_gone(nSock)) {
+                ALOGI("%s: client disconnected during silence", __FUNCTION__);
+                break;
+            }
+            continue;
         }
+
+        iOutLen = convertAudio(&converter, (const int16_t *)pReadBuf,
+                               iReadLen / (channel * sizeof(int16_t)), (int16_t *)pOutBuf);
+        iOutLen *= converter.outChannels * sizeof(int16_t);
+        audiostreamer_update_stats(&stats, iReadLen, iOutLen);
+        if (iOutLen == 0) continue;
+
+        // never blocks, a stalled client only loses its oldest periods
+        if (!queueDataSocket(pQueue, pOutBuf, iOutLen)) break;
+    }
+
+    audiostreamer_report_stats(&stats);
+    ALOGI("%s: sent %llu bytes, suppressed %llu bytes in %llu silent periods", __FUNCTION__,
+          (unsigned long long)silence.sentBytes, (unsigned long long)silence.suppressedBytes,
+          (unsigned long long)silence.suppressedPeriods);
+
+    getSendQueueStats(pQueue, &queueStats);
+    destroySendQueue(pQueue);
+    ALOGI("%s: queued %llu packets, dropped %llu packets (%llu bytes), max depth %d/%d",
+          __FUNCTION__, (unsigned long long)queueStats.queuedPackets,
+          (unsigned long long)queueStats.droppedPackets,
+          (unsigned long long)queueStats.droppedBytes, queueStats.maxDepth, gSendQueuePackets);
+
+    if (pAudioSource != NULL) {
+        ALOGI("%s: audio source overrun lost %u frames", __FUNCTION__,
+              pAudioSource->framesLost());
+        pAudioSource->stop();
     }
 
+    releaseAudioConverter(&converter);
+
     if (pReadBuf)
         free(pReadBuf);
+    if (pOutBuf)
+        free(pOutBuf);
 
     closeSocket(nSock);
 }
@@ -155,18 +403,29 @@ void audiostreamer_create_thread() {
 }
 
 static int usage() {
-    fprintf(stderr, "\nUsage: %s [-T <Port>] or [<-U>] or [-u <Name>]\n", gProgramName);
+    fprintf(stderr, "\nUsage: %s [-T <Port>] or [<-U>] or [-u <Name>] [-s <Level>] [-q <Packets>]\n"
+            "       [-r <Rate>] [-c <Channels>] [-g <Hz>] or [-f <File>]\n",
+            gProgramName);
     fprintf(stderr,
             "\n"
             "-T: TCP socket (default port: %d)\n"
             "-U: Android control unix socket with name: %s\n"
-            "-u: Unix socket (default: %s)\n",
-            DEFAULT_SOCKET_TCP_PORT, DEFAULT_SOCKET_UNIX_NAME, "@" DEFAULT_SOCKET_UNIX_NAME);
+            "-u: Unix socket (default: %s)\n"
+            "-s: Silence threshold, -1 always sends (default: %d)\n"
+            "-q: Send queue length in periods (default: %d)\n"
+            "-r: Output sample rate, must divide %u (default: %u)\n"
+            "-c: Output channels, 1 down-mixes to mono (default: %d)\n"
+            "-g: Capture a synthetic tone instead of the device (e.g. %d)\n"
+            "-f: Capture raw %uHz/%dch PCM from a file instead of the device\n",
+            DEFAULT_SOCKET_TCP_PORT, DEFAULT_SOCKET_UNIX_NAME, "@" DEFAULT_SOCKET_UNIX_NAME,
+            DEFAULT_SILENCE_THRESHOLD, DEFAULT_SEND_QUEUE_PACKETS, sampleRate, gOutputSampleRate, gOutputChannel,
+            DEFAULT_SYNTHETIC_TONE_HZ, sampleRate, channel);
     return 1;
 }
 
-int audio_main(int argc, char **argv) {
+int audio_main(int argc, char **argv, AudioSourceFactory deviceSource) {
     gRunning = true;
+    gDeviceSource = deviceSource;
     gProgramName = argv[0];
     int i = 1;
 
@@ -197,34 +456,68 @@ int audio_main(int argc, char **argv) {
             } else {
                 gSocketName = strdup("@" DEFAULT_SOCKET_UNIX_NAME);
             }
+        } else if (strcmp(argv[i], "-s") == 0) {
+            i++;
+            if (i < argc) {
+                gSilenceThreshold = atoi(argv[i]);
+                i++;
+            } else {
+                return usage();
+            }
+        } else if (strcmp(argv[i], "-q") == 0) {
+            i++;
+            if (i < argc) {
+                gSendQueuePackets = atoi(argv[i]);
+                i++;
+            } else {
+                return usage();
+            }
+        } else if (strcmp(argv[i], "-r") == 0) {
+            i++;
+            if (i < argc) {
+                gOutputSampleRate = atoi(argv[i]);
+                i++;
+            } else {
+                return usage();
+            }
+        } else if (strcmp(argv[i], "-c") == 0) {
+            i++;
+            if (i < argc) {
+                gOutputChannel = atoi(argv[i]);
+                i++;
+            } else {
+                return usage();
+            }
+        } else if (strcmp(argv[i], "-g") == 0) {
+            i++;
+            if (i < argc) {
+                gSyntheticToneHz = atoi(argv[i]);
+                i++;
+            } else {
+                return usage();
+            }
+        } else if (strcmp(argv[i], "-f") == 0) {
+            i++;
+            if (i < argc) {
+                gSourcePath = strdup(argv[i]);
+                i++;
+            } else {
+                return usage();
+            }
         } else {
             return usage();
         }
     }
 
-    audiostreamer_create_thread();
-    return 0;
-}
-
-
-extern "C" jint Java_com_libremobileos_vncflinger_VncFlinger_startAudioStreamer(JNIEnv *env,
-                                                                               jobject thiz,
-                                                                               jobjectArray command_line_args) {
-    const int argc = env->GetArrayLength(command_line_args);
-    char* argv[argc];
-    for (int i=0; i<argc; i++) {
-        jstring o = (jstring)(env->GetObjectArrayElement(command_line_args, i));
-        const char *cmdline_temp = env->GetStringUTFChars(o, NULL);
-        argv[i] = strdup(cmdline_temp);
-        env->ReleaseStringUTFChars(o, cmdline_temp);
-        env->DeleteLocalRef(o);
+    if (gSourcePath == NULL && gSyntheticToneHz <= 0 && gDeviceSource == NULL) {
+        fprintf(stderr, "%s: no device capture here, use -g or -f\n", gProgramName);
+        return usage();
     }
-    env->DeleteLocalRef(command_line_args);
 
-    return audio_main(argc, argv);
+    audiostreamer_create_thread();
+    return 0;
 }
 
-extern "C" void Java_com_libremobileos_vncflinger_VncFlinger_endAudioStreamer(JNIEnv *env,
-                                                                             jobject thiz) {
+void audio_stop() {
     gRunning = false;
 }
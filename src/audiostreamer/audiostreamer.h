@@ -0,0 +1,32 @@
+/*
+ * Copyright (C) 2022 LibreMobileOS Foundation
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef AUDIO_STREAMER_H
+#define AUDIO_STREAMER_H
+
+#include <stdint.h>
+
+#include "audiosource.h"
+
+// Creates the source that captures the device, used unless a synthetic
+// source is asked for on the command line. NULL where there is none.
+typedef AudioSource *(*AudioSourceFactory)(uint32_t sampleRate, int channel);
+
+// Serves clients one at a time until audio_stop() is called.
+int audio_main(int argc, char **argv, AudioSourceFactory deviceSource);
+void audio_stop();
+
+#endif // AUDIO_STREAMER_H
@@ -0,0 +1,42 @@
+/*
+ * Copyright (C) 2022 LibreMobileOS Foundation
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "audiorecordsource.h"
+#include "audiostreamer.h"
+#include <jni.h>
+#include <string.h>
+
+extern "C" jint Java_com_libremobileos_vncflinger_VncFlinger_startAudioStreamer(JNIEnv *env,
+                                                                               jobject thiz,
+                                                                               jobjectArray command_line_args) {
+    const int argc = env->GetArrayLength(command_line_args);
+    char* argv[argc];
+    for (int i=0; i<argc; i++) {
+        jstring o = (jstring)(env->GetObjectArrayElement(command_line_args, i));
+        const char *cmdline_temp = env->GetStringUTFChars(o, NULL);
+        argv[i] = strdup(cmdline_temp);
+        env->ReleaseStringUTFChars(o, cmdline_temp);
+        env->DeleteLocalRef(o);
+    }
+    env->DeleteLocalRef(command_line_args);
+
+    return audio_main(argc, argv, createAudioRecordSource);
+}
+
+extern "C" void Java_com_libremobileos_vncflinger_VncFlinger_endAudioStreamer(JNIEnv *env,
+                                                                             jobject thiz) {
+    audio_stop();
+}
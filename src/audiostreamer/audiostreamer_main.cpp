@@ -0,0 +1,26 @@
+/*
+ * Copyright (C) 2022 LibreMobileOS Foundation
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <signal.h>
+
+#include "audiostreamer.h"
+
+// Host build of the streamer: no AudioRecord, so the pipeline is fed
+// from a synthetic tone (-g) or a raw PCM file (-f).
+int main(int argc, char **argv) {
+    signal(SIGPIPE, SIG_IGN);
+    return audio_main(argc, argv, NULL);
+}
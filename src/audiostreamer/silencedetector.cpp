@@ -0,0 +1,109 @@
+/*
+ * Copyright (C) 2022 LibreMobileOS Foundation
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#define LOG_TAG "audiostreamer-dtx"
+
+#include "silencedetector.h"
+#include <cutils/log.h>
+
+#if defined(__ARM_NEON)
+#include <arm_neon.h>
+#elif defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
+void initSilenceDetector(SilenceDetector *sd, int threshold, int hangover) {
+    sd->threshold = threshold;
+    sd->hangover = hangover;
+    sd->silentPeriods = 0;
+    sd->suppressing = false;
+    sd->suppressedBytes = 0;
+    sd->suppressedPeriods = 0;
+    sd->sentBytes = 0;
+}
+
+int peakLevel(const int16_t *samples, size_t count) {
+    size_t i = 0;
+    int peak = 0;
+
+#if defined(__ARM_NEON)
+    int16x8_t vpeak = vdupq_n_s16(0);
+    for (; i + 16 <= count; i += 16) {
+        vpeak = vmaxq_s16(vpeak, vqabsq_s16(vld1q_s16(samples + i)));
+        vpeak = vmaxq_s16(vpeak, vqabsq_s16(vld1q_s16(samples + i + 8)));
+    }
+    int16x4_t half = vmax_s16(vget_low_s16(vpeak), vget_high_s16(vpeak));
+    half = vpmax_s16(half, half);
+    half = vpmax_s16(half, half);
+    peak = vget_lane_s16(half, 0);
+#elif defined(__SSE2__)
+    const __m128i zero = _mm_setzero_si128();
+    __m128i vpeak = zero;
+    for (; i + 8 <= count; i += 8) {
+        __m128i v = _mm_loadu_si128((const __m128i *)(samples + i));
+        // saturating negate keeps -32768 from wrapping back to itself
+        vpeak = _mm_max_epi16(vpeak, _mm_max_epi16(v, _mm_subs_epi16(zero, v)));
+    }
+    vpeak = _mm_max_epi16(vpeak, _mm_srli_si128(vpeak, 8));
+    vpeak = _mm_max_epi16(vpeak, _mm_srli_si128(vpeak, 4));
+    vpeak = _mm_max_epi16(vpeak, _mm_srli_si128(vpeak, 2));
+    peak = (int16_t)_mm_extract_epi16(vpeak, 0);
+#endif
+
+    for (; i < count; i++) {
+        // saturate like the vector paths, -32768 counts as 32767
+        int v = samples[i] < 0 ? -samples[i] : samples[i];
+        if (v > INT16_MAX)
+            v = INT16_MAX;
+        if (v > peak)
+            peak = v;
+    }
+
+    return peak;
+}
+
+bool shouldSendPeriod(SilenceDetector *sd, const void *data, int length) {
+    if (sd->threshold < 0) {
+        sd->sentBytes += length;
+        return true;
+    }
+
+    int peak = peakLevel((const int16_t *)data, length / sizeof(int16_t));
+    if (peak > sd->threshold) {
+        if (sd->suppressing) {
+            ALOGV("%s: sound resumed, suppressed %llu bytes so far", __FUNCTION__,
+                  (unsigned long long)sd->suppressedBytes);
+            sd->suppressing = false;
+        }
+        sd->silentPeriods = 0;
+        sd->sentBytes += length;
+        return true;
+    }
+
+    if (sd->silentPeriods < sd->hangover) {
+        sd->silentPeriods++;
+        sd->sentBytes += length;
+        return true;
+    }
+
+    if (!sd->suppressing) {
+        ALOGV("%s: silence, pausing transmission", __FUNCTION__);
+        sd->suppressing = true;
+    }
+    sd->suppressedPeriods++;
+    sd->suppressedBytes += length;
+    return false;
+}
@@ -0,0 +1,46 @@
+/*
+ * Copyright (C) 2022 LibreMobileOS Foundation
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef SILENCE_DETECTOR_H
+#define SILENCE_DETECTOR_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+// Discontinuous transmission state for one client stream.
+// A period is silent when no sample exceeds |threshold|. After
+// |hangover| consecutive silent periods, further silent periods are
+// suppressed until a non-silent period arrives, which is sent at once.
+struct SilenceDetector {
+    int threshold;
+    int hangover;
+    int silentPeriods;
+    bool suppressing;
+
+    uint64_t suppressedBytes;
+    uint64_t suppressedPeriods;
+    uint64_t sentBytes;
+};
+
+void initSilenceDetector(SilenceDetector *sd, int threshold, int hangover);
+
+// Returns the largest absolute sample value in a 16-bit PCM buffer.
+int peakLevel(const int16_t *samples, size_t count);
+
+// Feeds one captured period; returns false if it should not be sent.
+bool shouldSendPeriod(SilenceDetector *sd, const void *data, int length);
+
+#endif // SILENCE_DETECTOR_H
@@ -20,16 +20,24 @@
 #include <cutils/log.h>
 #include <cutils/sockets.h>
 #include <errno.h>
+#include <fcntl.h>
 #include <netinet/in.h>
 #include <netinet/tcp.h>
 #include <stdlib.h>
+#include <poll.h>
 #include <string.h>
+#include <sys/eventfd.h>
 #include <sys/socket.h>
 #include <sys/un.h>
 #include <sys/time.h>
 #include <sys/types.h>
 #include <unistd.h>
 
+#include <mutex>
+#include <thread>
+
+#include "socketmanager.h"
+
 #define MAX_PAYLOAD_LENGTH 4096
 
 static bool canSend(int sock, int timeout) {
@@ -205,3 +213,219 @@ bool sendDataSocket(int sock, void *data, int length, int timeout) {
 
     return success;
 }
+
+
+struct SendQueue {
+    int sock;
+    int wakeFd;
+
+    // ring of fixed size packet slots
+    unsigned char *slots;
+    int *lengths;
+    int maxPackets;
+    int maxPacketSize;
+    int head;
+    int count;
+    // bytes of the head packet already written to the socket
+    int headOffset;
+
+    bool failed;
+    bool stopping;
+    SendQueueStats stats;
+
+    std::mutex lock;
+    std::thread writer;
+};
+
+static bool wakeSendQueue(SendQueue *q) {
+    uint64_t one = 1;
+    // EAGAIN only means the counter is full, the writer is awake anyway
+    if (write(q->wakeFd, &one, sizeof(one)) != sizeof(one) && errno != EAGAIN) {
+        ALOGI("wakeSendQueue write failed: %d\n", errno);
+        return false;
+    }
+    return true;
+}
+
+static void sendQueueWriter(SendQueue *q) {
+    pollfd fds[2];
+    fds[0].fd = q->wakeFd;
+    fds[0].events = POLLIN;
+    fds[1].fd = q->sock;
+
+    while (true) {
+        bool pending;
+        {
+            std::lock_guard<std::mutex> _l(q->lock);
+            if (q->stopping || q->failed)
+                break;
+            pending = q->count > 0;
+        }
+
+        // only ask for writability while there is something to flush
+        fds[1].events = pending ? POLLOUT : 0;
+        if (poll(fds, 2, -1) < 0) {
+            if (errno == EINTR)
+                continue;
+            ALOGI("sendQueueWriter poll failed: %d\n", errno);
+            break;
+        }
+
+        if (fds[0].revents & POLLIN) {
+            uint64_t val;
+            if (read(q->wakeFd, &val, sizeof(val)) != sizeof(val) && errno != EAGAIN) {
+                ALOGI("sendQueueWriter read failed: %d\n", errno);
+                break;
+            }
+        }
+
+        if (fds[1].revents & (POLLERR | POLLHUP)) {
+            std::lock_guard<std::mutex> _l(q->lock);
+            q->failed = true;
+            break;
+        }
+
+        if (!(fds[1].revents & POLLOUT))
+            continue;
+
+        // drain as much as the socket takes without blocking
+        std::lock_guard<std::mutex> _l(q->lock);
+        while (q->count > 0) {
+            unsigned char *ptr = q->slots + q->head * q->maxPacketSize + q->headOffset;
+            int size = q->lengths[q->head] - q->headOffset;
+
+            int bytes = send(q->sock, ptr, size, MSG_NOSIGNAL | MSG_DONTWAIT);
+            if (bytes < 0) {
+                if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR) {
+                    ALOGI("sendQueueWriter send failed: %d\n", errno);
+                    q->failed = true;
+                }
+                break;
+            }
+
+            q->stats.sentBytes += bytes;
+            if (bytes < size) {
+                q->headOffset += bytes;
+                break;
+            }
+
+            q->headOffset = 0;
+            q->head = (q->head + 1) % q->maxPackets;
+            q->count--;
+        }
+    }
+
+    std::lock_guard<std::mutex> _l(q->lock);
+    q->failed = true;
+}
+
+SendQueue *createSendQueue(int sock, int maxPackets, int maxPacketSize) {
+    if (maxPackets < 2)
+        maxPackets = 2;
+
+    int flags = fcntl(sock, F_GETFL, 0);
+    if (flags < 0 || fcntl(sock, F_SETFL, flags | O_NONBLOCK) < 0) {
+        ALOGI("createSendQueue fcntl failed: %d\n", errno);
+        return NULL;
+    }
+
+    SendQueue *q = new SendQueue();
+    q->sock = sock;
+    q->wakeFd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+    if (q->wakeFd < 0) {
+        ALOGI("createSendQueue eventfd failed: %d\n", errno);
+        delete q;
+        return NULL;
+    }
+
+    q->maxPackets = maxPackets;
+    q->maxPacketSize = maxPacketSize;
+    q->slots = (unsigned char *)malloc((size_t)maxPackets * maxPacketSize);
+    q->lengths = (int *)calloc(maxPackets, sizeof(int));
+    if (q->slots == NULL || q->lengths == NULL) {
+        ALOGI("createSendQueue failed to allocate %d packets of %d bytes\n", maxPackets,
+              maxPacketSize);
+        close(q->wakeFd);
+        free(q->slots);
+        free(q->lengths);
+        delete q;
+        return NULL;
+    }
+    q->head = 0;
+    q->count = 0;
+    q->headOffset = 0;
+    q->failed = false;
+    q->stopping = false;
+    memset(&q->stats, 0, sizeof(q->stats));
+
+    q->writer = std::thread(sendQueueWriter, q);
+    return q;
+}
+
+bool queueDataSocket(SendQueue *q, const void *data, int length) {
+    if (length <= 0 || length > q->maxPacketSize)
+        return false;
+
+    {
+        std::lock_guard<std::mutex> _l(q->lock);
+        if (q->failed)
+            return false;
+
+        if (q->count == q->maxPackets) {
+            // drop the oldest packet the writer has not started on yet,
+            // a partially written head must be completed to keep the
+            // stream aligned to whole frames
+            int next = (q->head + 1) % q->maxPackets;
+            int victim = q->headOffset > 0 ? next : q->head;
+            q->stats.droppedPackets++;
+            q->stats.droppedBytes += q->lengths[victim];
+
+            if (victim != q->head) {
+                // carry the partial head over the dropped slot
+                memcpy(q->slots + next * q->maxPacketSize, q->slots + q->head * q->maxPacketSize,
+                       q->lengths[q->head]);
+                q->lengths[next] = q->lengths[q->head];
+            }
+            q->head = next;
+            q->count--;
+        }
+
+        int tail = (q->head + q->count) % q->maxPackets;
+        memcpy(q->slots + tail * q->maxPacketSize, data, length);
+        q->lengths[tail] = length;
+        q->count++;
+
+        q->stats.queuedPackets++;
+        if (q->count > q->stats.maxDepth)
+            q->stats.maxDepth = q->count;
+    }
+
+    // without the wakeup the writer would never flush the packet
+    if (!wakeSendQueue(q)) {
+        std::lock_guard<std::mutex> _l(q->lock);
+        q->failed = true;
+        return false;
+    }
+    return true;
+}
+
+void getSendQueueStats(SendQueue *q, SendQueueStats *stats) {
+    std::lock_guard<std::mutex> _l(q->lock);
+    *stats = q->stats;
+}
+
+void destroySendQueue(SendQueue *q) {
+    {
+        std::lock_guard<std::mutex> _l(q->lock);
+        q->stopping = true;
+    }
+    // a writer that cannot be woken still returns from poll() on hangup
+    if (!wakeSendQueue(q))
+        shutdown(q->sock, SHUT_RDWR);
+    q->writer.join();
+
+    close(q->wakeFd);
+    free(q->slots);
+    free(q->lengths);
+    delete q;
+}
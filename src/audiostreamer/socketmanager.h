@@ -17,6 +17,8 @@
 #ifndef SOCKET_MANAGER_H
 #define SOCKET_MANAGER_H
 
+#include <stdint.h>
+
 int createTCPSocket(int port);
 int createUnixSocket(const char *name);
 int createAndroidSocket(const char *name);
@@ -24,4 +26,21 @@ void closeSocket(int sock);
 int acceptSocket(int sock);
 bool sendDataSocket(int sock, void *data, int length, int timeout);
 
+// Bounded, drop-oldest send queue flushed by its own writer thread, so
+// that the producer never waits on the network.
+struct SendQueue;
+
+struct SendQueueStats {
+    uint64_t queuedPackets;
+    uint64_t sentBytes;
+    uint64_t droppedPackets;
+    uint64_t droppedBytes;
+    int maxDepth;
+};
+
+SendQueue *createSendQueue(int sock, int maxPackets, int maxPacketSize);
+bool queueDataSocket(SendQueue *queue, const void *data, int length);
+void getSendQueueStats(SendQueue *queue, SendQueueStats *stats);
+void destroySendQueue(SendQueue *queue);
+
 #endif // SOCKET_MANAGER_H
@@ -0,0 +1,52 @@
+/*
+ * Copyright (C) 2022 LibreMobileOS Foundation
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <math.h>
+#include <stdint.h>
+
+#include <vector>
+
+#include <benchmark/benchmark.h>
+
+#include "audioconverter.h"
+
+// one capture period of 48kHz stereo, what the streamer converts at a time
+static const int kRate = 48000;
+static const int kChannels = 2;
+static const int kPeriodFrames = 1452 / (kChannels * sizeof(int16_t));
+
+static void BM_ConvertAudio(benchmark::State &state, int outRate, int outChannels) {
+    std::vector<int16_t> in(kPeriodFrames * kChannels);
+    for (int i = 0; i < kPeriodFrames; i++)
+        for (int c = 0; c < kChannels; c++)
+            in[i * kChannels + c] = (int16_t)(8192.0 * sin(2.0 * M_PI * 440 * i / kRate));
+    std::vector<int16_t> out(in.size());
+
+    AudioConverter conv;
+    if (!initAudioConverter(&conv, kRate, kChannels, outRate, outChannels, kPeriodFrames)) {
+        state.SkipWithError("unsupported format");
+        return;
+    }
+    for (auto _ : state)
+        benchmark::DoNotOptimize(convertAudio(&conv, in.data(), kPeriodFrames, out.data()));
+    state.SetBytesProcessed(state.iterations() * in.size() * sizeof(int16_t));
+    releaseAudioConverter(&conv);
+}
+BENCHMARK_CAPTURE(BM_ConvertAudio, passthrough, 48000, 2);
+BENCHMARK_CAPTURE(BM_ConvertAudio, stereo_to_mono, 48000, 1);
+BENCHMARK_CAPTURE(BM_ConvertAudio, 48k_to_24k, 24000, 2);
+BENCHMARK_CAPTURE(BM_ConvertAudio, 48k_to_16k, 16000, 2);
+BENCHMARK_CAPTURE(BM_ConvertAudio, 48k_to_16k_mono, 16000, 1);
@@ -0,0 +1,103 @@
+/*
+ * Copyright (C) 2022 LibreMobileOS Foundation
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <math.h>
+#include <stdint.h>
+#include <stdlib.h>
+
+#include <vector>
+
+#include <gtest/gtest.h>
+
+#include "audioconverter.h"
+
+static const int kRate = 48000;
+static const int kFrames = 363;
+
+static std::vector<int16_t> tone(int hz, int channels, int frames, int periods) {
+    std::vector<int16_t> samples(frames * periods * channels);
+    for (int i = 0; i < frames * periods; i++)
+        for (int c = 0; c < channels; c++)
+            samples[i * channels + c] = (int16_t)(8192.0 * sin(2.0 * M_PI * hz * i / kRate));
+    return samples;
+}
+
+static int peak(const std::vector<int16_t> &samples, size_t from) {
+    int p = 0;
+    for (size_t i = from; i < samples.size(); i++)
+        p = std::max(p, abs((int)samples[i]));
+    return p;
+}
+
+TEST(AudioConverterTest, RejectsUnsupportedFormats) {
+    AudioConverter conv;
+    EXPECT_FALSE(initAudioConverter(&conv, kRate, 2, 44100, 2, kFrames));
+    EXPECT_FALSE(initAudioConverter(&conv, kRate, 2, 4000, 2, kFrames));
+    EXPECT_FALSE(initAudioConverter(&conv, kRate, 2, 0, 2, kFrames));
+    EXPECT_FALSE(initAudioConverter(&conv, kRate, 2, kRate, 3, kFrames));
+}
+
+TEST(AudioConverterTest, PassesThroughUnchanged) {
+    AudioConverter conv;
+    ASSERT_TRUE(initAudioConverter(&conv, kRate, 2, kRate, 2, kFrames));
+
+    std::vector<int16_t> in = tone(440, 2, kFrames, 1);
+    std::vector<int16_t> out(in.size());
+    ASSERT_EQ(kFrames, convertAudio(&conv, in.data(), kFrames, out.data()));
+    EXPECT_EQ(in, out);
+    releaseAudioConverter(&conv);
+}
+
+TEST(AudioConverterTest, DecimatesAndDownMixes) {
+    const int factors[] = {2, 3, 6};
+    for (int factor : factors) {
+        AudioConverter conv;
+        ASSERT_TRUE(initAudioConverter(&conv, kRate, 2, kRate / factor, 1, kFrames));
+
+        // periods do not divide by the factor, the phase carries over
+        const int periods = 40;
+        std::vector<int16_t> in = tone(440, 2, kFrames, periods);
+        std::vector<int16_t> out;
+        std::vector<int16_t> period(kFrames);
+        for (int p = 0; p < periods; p++) {
+            int n = convertAudio(&conv, in.data() + p * kFrames * 2, kFrames, period.data());
+            out.insert(out.end(), period.begin(), period.begin() + n);
+        }
+        EXPECT_NEAR(kFrames * periods / factor, (int)out.size(), 1) << "factor " << factor;
+
+        // a tone well inside the pass band keeps its level, once the
+        // filter has settled
+        EXPECT_NEAR(8192, peak(out, out.size() / 2), 8192 / 10) << "factor " << factor;
+        releaseAudioConverter(&conv);
+    }
+}
+
+TEST(AudioConverterTest, FiltersAboveNyquist) {
+    AudioConverter conv;
+    ASSERT_TRUE(initAudioConverter(&conv, kRate, 1, 8000, 1, kFrames));
+
+    // 6kHz folds back into the 8kHz output unless it is filtered
+    const int periods = 40;
+    std::vector<int16_t> in = tone(6000, 1, kFrames, periods);
+    std::vector<int16_t> out;
+    std::vector<int16_t> period(kFrames);
+    for (int p = 0; p < periods; p++) {
+        int n = convertAudio(&conv, in.data() + p * kFrames, kFrames, period.data());
+        out.insert(out.end(), period.begin(), period.begin() + n);
+    }
+    EXPECT_LT(peak(out, out.size() / 2), 8192 / 10);
+    releaseAudioConverter(&conv);
+}
@@ -0,0 +1,78 @@
+/*
+ * Copyright (C) 2022 LibreMobileOS Foundation
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <stdint.h>
+#include <stdlib.h>
+
+#include <vector>
+
+#include <benchmark/benchmark.h>
+
+#include "silencedetector.h"
+
+// one capture period of 48kHz stereo, and a long buffer to see the
+// memory bound rate
+static const int kPeriodSamples = 1452 / sizeof(int16_t);
+
+static std::vector<int16_t> noise(size_t count) {
+    std::vector<int16_t> samples(count);
+    srand(1);
+    for (int16_t &s : samples)
+        s = (int16_t)(rand() % 64 - 32);
+    return samples;
+}
+
+static int scalarPeak(const int16_t *samples, size_t count) {
+    int peak = 0;
+    for (size_t i = 0; i < count; i++) {
+        int v = samples[i] < 0 ? -samples[i] : samples[i];
+        if (v > peak)
+            peak = v;
+    }
+    return peak;
+}
+
+static void BM_PeakLevel(benchmark::State &state) {
+    std::vector<int16_t> samples = noise(state.range(0));
+    for (auto _ : state)
+        benchmark::DoNotOptimize(peakLevel(samples.data(), samples.size()));
+    state.SetBytesProcessed(state.iterations() * samples.size() * sizeof(int16_t));
+}
+BENCHMARK(BM_PeakLevel)->Arg(kPeriodSamples)->Arg(1 << 16);
+
+static void BM_PeakLevelScalar(benchmark::State &state) {
+    std::vector<int16_t> samples = noise(state.range(0));
+    for (auto _ : state) {
+        // keep the compiler from vectorizing the reference
+        benchmark::DoNotOptimize(samples.data());
+        benchmark::DoNotOptimize(scalarPeak(samples.data(), samples.size()));
+    }
+    state.SetBytesProcessed(state.iterations() * samples.size() * sizeof(int16_t));
+}
+BENCHMARK(BM_PeakLevelScalar)->Arg(kPeriodSamples)->Arg(1 << 16);
+
+static void BM_ShouldSendPeriod(benchmark::State &state) {
+    std::vector<int16_t> samples = noise(kPeriodSamples);
+    SilenceDetector sd;
+    initSilenceDetector(&sd, 0, 16);
+    for (auto _ : state)
+        benchmark::DoNotOptimize(
+                shouldSendPeriod(&sd, samples.data(), samples.size() * sizeof(int16_t)));
+    state.SetBytesProcessed(state.iterations() * samples.size() * sizeof(int16_t));
+}
+BENCHMARK(BM_ShouldSendPeriod);
+
+BENCHMARK_MAIN();
@@ -0,0 +1,95 @@
+/*
+ * Copyright (C) 2022 LibreMobileOS Foundation
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <stdint.h>
+#include <stdlib.h>
+
+#include <vector>
+
+#include <gtest/gtest.h>
+
+#include "silencedetector.h"
+
+static int referencePeak(const int16_t *samples, size_t count) {
+    int peak = 0;
+    for (size_t i = 0; i < count; i++) {
+        int v = abs((int)samples[i]);
+        if (v > INT16_MAX)
+            v = INT16_MAX;
+        if (v > peak)
+            peak = v;
+    }
+    return peak;
+}
+
+TEST(SilenceDetectorTest, PeakLevelMatchesScalar) {
+    srand(1);
+    // every length around the vector widths, and a whole period
+    for (size_t count = 0; count <= 72; count++) {
+        std::vector<int16_t> samples(count);
+        for (int round = 0; round < 50; round++) {
+            for (int16_t &s : samples)
+                s = (int16_t)(rand() % (1 << 16) - (1 << 15)) / (1 << (rand() % 15));
+            EXPECT_EQ(referencePeak(samples.data(), count), peakLevel(samples.data(), count))
+                    << "count " << count;
+        }
+    }
+}
+
+TEST(SilenceDetectorTest, PeakLevelSaturates) {
+    for (size_t pos = 0; pos < 40; pos++) {
+        std::vector<int16_t> samples(40, 3);
+        samples[pos] = INT16_MIN;
+        EXPECT_EQ(INT16_MAX, peakLevel(samples.data(), samples.size())) << "at " << pos;
+    }
+}
+
+TEST(SilenceDetectorTest, SuppressesAfterHangover) {
+    SilenceDetector sd;
+    initSilenceDetector(&sd, 100, 3);
+
+    std::vector<int16_t> loud(64, 0);
+    loud[10] = -101;
+    std::vector<int16_t> quiet(64, 0);
+    quiet[20] = 100;
+    const int bytes = 64 * sizeof(int16_t);
+
+    EXPECT_TRUE(shouldSendPeriod(&sd, loud.data(), bytes));
+    for (int i = 0; i < 3; i++)
+        EXPECT_TRUE(shouldSendPeriod(&sd, quiet.data(), bytes));
+    EXPECT_FALSE(shouldSendPeriod(&sd, quiet.data(), bytes));
+    EXPECT_FALSE(shouldSendPeriod(&sd, quiet.data(), bytes));
+    EXPECT_TRUE(sd.suppressing);
+
+    // sound is sent at once, and restarts the hangover
+    EXPECT_TRUE(shouldSendPeriod(&sd, loud.data(), bytes));
+    EXPECT_FALSE(sd.suppressing);
+    EXPECT_TRUE(shouldSendPeriod(&sd, quiet.data(), bytes));
+
+    EXPECT_EQ(2u, sd.suppressedPeriods);
+    EXPECT_EQ(2u * bytes, sd.suppressedBytes);
+    EXPECT_EQ(6u * bytes, sd.sentBytes);
+}
+
+TEST(SilenceDetectorTest, NegativeThresholdAlwaysSends) {
+    SilenceDetector sd;
+    initSilenceDetector(&sd, -1, 0);
+
+    std::vector<int16_t> quiet(64, 0);
+    for (int i = 0; i < 10; i++)
+        EXPECT_TRUE(shouldSendPeriod(&sd, quiet.data(), quiet.size() * sizeof(int16_t)));
+    EXPECT_EQ(0u, sd.suppressedPeriods);
+}
@@ -0,0 +1,622 @@
+//
+// vncflinger - Copyright (C) 2021 Stefanie Kondik
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+//
+
+
+#include <algorithm>
+
+#include <arpa/inet.h>
+#include <errno.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <stddef.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "rfbclient.h"
+
+using namespace vncbench;
+
+enum {
+    kEncodingRaw = 0,
+    kEncodingCopyRect = 1,
+    kEncodingHextile = 5,
+    kEncodingTight = 7,
+    kEncodingZRLE = 16,
+    kEncodingQualityLevel0 = -32,
+    kEncodingDesktopSize = -223,
+    kEncodingLastRect = -224,
+};
+
+enum {
+    kHextileRaw = 1,
+    kHextileBackground = 2,
+    kHextileForeground = 4,
+    kHextileAnySubrects = 8,
+    kHextileSubrectsColoured = 16,
+};
+
+struct PixelFormatInfo {
+    const char* name;
+    uint8_t bpp, depth;
+    uint16_t redMax, greenMax, blueMax;
+    uint8_t redShift, greenShift, blueShift;
+};
+
+static const PixelFormatInfo kFormats[] = {
+    {"rgbx", 32, 24, 255, 255, 255, 0, 8, 16},
+    {"bgrx", 32, 24, 255, 255, 255, 16, 8, 0},
+    {"rgb565", 16, 16, 31, 63, 31, 11, 5, 0},
+    {"rgb332", 8, 8, 7, 7, 3, 5, 2, 0},
+};
+
+static const struct {
+    const char* name;
+    int32_t encoding;
+} kEncodings[] = {
+    {"raw", kEncodingRaw},
+    {"copyrect", kEncodingCopyRect},
+    {"hextile", kEncodingHextile},
+    {"tight", kEncodingTight},
+    {"zrle", kEncodingZRLE},
+};
+
+// pixels of the frame stamp, one bit each
+static const int kStampBits = 32;
+
+static const size_t kBufferSize = 256 * 1024;
+
+static int64_t nowUs() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (int64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+RfbClient::RfbClient(int id, const ClientConfig& config)
+    : mId(id), mConfig(config), mFd(-1), mStopping(false), mBuffer(kBufferSize), mPos(0),
+      mEnd(0), mWidth(0), mHeight(0), mBpp(4), mTightBpp(3), mRequestTime(0) {
+}
+
+RfbClient::~RfbClient() {
+    if (mFd >= 0) {
+        close(mFd);
+    }
+}
+
+bool RfbClient::fail(const char* what) {
+    if (mError.empty()) {
+        mError = what;
+        if (errno != 0) {
+            mError += ": ";
+            mError += strerror(errno);
+        }
+    }
+    return false;
+}
+
+bool RfbClient::connectTcp(const char* host, int port) {
+    struct sockaddr_in addr = {};
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(port);
+    if (inet_pton(AF_INET, host, &addr.sin_addr) != 1) {
+        errno = 0;
+        return fail("invalid address");
+    }
+
+    mFd = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (mFd < 0 || connect(mFd, (struct sockaddr*)&addr, sizeof(addr)) < 0) {
+        return fail("connect");
+    }
+
+    int one = 1;
+    setsockopt(mFd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+    return true;
+}
+
+bool RfbClient::connectUnix(const char* name) {
+    struct sockaddr_un addr = {};
+    addr.sun_family = AF_UNIX;
+    size_t len = strlen(name);
+    if (len >= sizeof(addr.sun_path)) {
+        errno = 0;
+        return fail("socket name too long");
+    }
+    memcpy(addr.sun_path, name, len);
+    if (name[0] == '@') {
+        addr.sun_path[0] = '\0';
+    } else {
+        len++;
+    }
+
+    mFd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (mFd < 0 ||
+        connect(mFd, (struct sockaddr*)&addr, offsetof(struct sockaddr_un, sun_path) + len) < 0) {
+        return fail("connect");
+    }
+    return true;
+}
+
+void RfbClient::stop() {
+    mStopping = true;
+    if (mFd >= 0) {
+        shutdown(mFd, SHUT_RDWR);
+    }
+}
+
+bool RfbClient::fill() {
+    if (mPos > 0) {
+        memmove(mBuffer.data(), mBuffer.data() + mPos, mEnd - mPos);
+        mEnd -= mPos;
+        mPos = 0;
+    }
+
+    ssize_t n;
+    do {
+        n = recv(mFd, mBuffer.data() + mEnd, mBuffer.size() - mEnd, 0);
+    } while (n < 0 && errno == EINTR);
+
+    if (n <= 0) {
+        if (mStopping) {
+            return false;
+        }
+        if (n == 0) {
+            errno = 0;
+        }
+        return fail("connection closed");
+    }
+    mEnd += n;
+    mStats.bytes += n;
+    return true;
+}
+
+bool RfbClient::readFully(void* data, size_t len) {
+    uint8_t* p = (uint8_t*)data;
+    while (len > 0) {
+        if (mPos == mEnd && !fill()) {
+            return false;
+        }
+        size_t n = std::min(len, mEnd - mPos);
+        memcpy(p, mBuffer.data() + mPos, n);
+        mPos += n;
+        p += n;
+        len -= n;
+    }
+    return true;
+}
+
+bool RfbClient::skip(size_t len) {
+    while (len > 0) {
+        if (mPos == mEnd && !fill()) {
+            return false;
+        }
+        size_t n = std::min(len, mEnd - mPos);
+        mPos += n;
+        len -= n;
+    }
+    return true;
+}
+
+bool RfbClient::readU8(uint8_t* v) {
+    return readFully(v, 1);
+}
+
+bool RfbClient::readU16(uint16_t* v) {
+    if (!readFully(v, 2)) {
+        return false;
+    }
+    *v = ntohs(*v);
+    return true;
+}
+
+bool RfbClient::readU32(uint32_t* v) {
+    if (!readFully(v, 4)) {
+        return false;
+    }
+    *v = ntohl(*v);
+    return true;
+}
+
+bool RfbClient::writeFully(const void* data, size_t len) {
+    const uint8_t* p = (const uint8_t*)data;
+    while (len > 0) {
+        ssize_t n = send(mFd, p, len, MSG_NOSIGNAL);
+        if (n < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return fail("send");
+        }
+        p += n;
+        len -= n;
+    }
+    return true;
+}
+
+bool RfbClient::handshake() {
+    char version[12];
+    if (!readFully(version, sizeof(version))) {
+        return false;
+    }
+    if (memcmp(version, "RFB 003.", 8) != 0) {
+        errno = 0;
+        return fail("not an RFB server");
+    }
+    if (!writeFully("RFB 003.008\n", 12)) {
+        return false;
+    }
+
+    // only "None" is supported, the way vncflinger is normally run
+    uint8_t count, type;
+    bool none = false;
+    if (!readU8(&count)) {
+        return false;
+    }
+    if (count == 0) {
+        errno = 0;
+        return fail("server refused the connection");
+    }
+    for (int i = 0; i < count; i++) {
+        if (!readU8(&type)) {
+            return false;
+        }
+        none |= type == 1;
+    }
+    if (!none) {
+        errno = 0;
+        return fail("server requires authentication");
+    }
+    type = 1;
+    uint32_t result;
+    if (!writeFully(&type, 1) || !readU32(&result)) {
+        return false;
+    }
+    if (result != 0) {
+        errno = 0;
+        return fail("security handshake failed");
+    }
+
+    // ClientInit (shared) and ServerInit
+    uint8_t shared = 1;
+    uint8_t init[24];
+    if (!writeFully(&shared, 1) || !readFully(init, sizeof(init))) {
+        return false;
+    }
+    mWidth = (init[0] << 8) | init[1];
+    mHeight = (init[2] << 8) | init[3];
+    uint32_t nameLength = ntohl(*(uint32_t*)(init + 20));
+    if (!skip(nameLength)) {
+        return false;
+    }
+
+    const PixelFormatInfo* pf = nullptr;
+    for (const PixelFormatInfo& f : kFormats) {
+        if (mConfig.format == f.name) {
+            pf = &f;
+        }
+    }
+    int32_t encoding = -1;
+    for (const auto& e : kEncodings) {
+        if (mConfig.encoding == e.name) {
+            encoding = e.encoding;
+        }
+    }
+    if (pf == nullptr || encoding < 0) {
+        errno = 0;
+        return fail("unknown format or encoding");
+    }
+
+    uint8_t setPixelFormat[20] = {0};
+    uint8_t* p = setPixelFormat + 4;
+    p[0] = pf->bpp;
+    p[1] = pf->depth;
+    p[2] = 0;   // little endian
+    p[3] = 1;   // true colour
+    p[4] = pf->redMax >> 8;
+    p[5] = pf->redMax & 0xff;
+    p[6] = pf->greenMax >> 8;
+    p[7] = pf->greenMax & 0xff;
+    p[8] = pf->blueMax >> 8;
+    p[9] = pf->blueMax & 0xff;
+    p[10] = pf->redShift;
+    p[11] = pf->greenShift;
+    p[12] = pf->blueShift;
+    if (!writeFully(setPixelFormat, sizeof(setPixelFormat))) {
+        return false;
+    }
+    mBpp = pf->bpp / 8;
+    mTightBpp = pf->bpp == 32 && pf->depth == 24 ? 3 : mBpp;
+
+    std::vector<int32_t> encodings;
+    encodings.push_back(encoding);
+    if (encoding == kEncodingTight && mConfig.quality >= 0) {
+        encodings.push_back(kEncodingQualityLevel0 + std::min(mConfig.quality, 9));
+    }
+    encodings.push_back(kEncodingDesktopSize);
+    encodings.push_back(kEncodingLastRect);
+
+    std::vector<uint8_t> setEncodings(4 + encodings.size() * 4);
+    setEncodings[0] = 2;
+    setEncodings[2] = encodings.size() >> 8;
+    setEncodings[3] = encodings.size() & 0xff;
+    for (size_t i = 0; i < encodings.size(); i++) {
+        uint32_t v = htonl((uint32_t)encodings[i]);
+        memcpy(&setEncodings[4 + i * 4], &v, 4);
+    }
+    return writeFully(setEncodings.data(), setEncodings.size());
+}
+
+bool RfbClient::requestUpdate() {
+    uint8_t msg[10] = {3, 1, 0, 0, 0, 0};
+    msg[6] = mWidth >> 8;
+    msg[7] = mWidth & 0xff;
+    msg[8] = mHeight >> 8;
+    msg[9] = mHeight & 0xff;
+    mRequestTime = nowUs();
+    return writeFully(msg, sizeof(msg));
+}
+
+bool RfbClient::run() {
+    if (!handshake() || !requestUpdate()) {
+        return false;
+    }
+    while (!mStopping) {
+        if (!readMessage()) {
+            return mStopping;
+        }
+    }
+    return true;
+}
+
+bool RfbClient::readMessage() {
+    uint8_t type;
+    if (!readU8(&type)) {
+        return false;
+    }
+
+    switch (type) {
+        case 0:
+            if (!readUpdate()) {
+                return false;
+            }
+            return requestUpdate();
+        case 1: {
+            // SetColourMapEntries, never used with true colour
+            uint8_t hdr[5];
+            if (!readFully(hdr, sizeof(hdr))) {
+                return false;
+            }
+            return skip(((hdr[3] << 8) | hdr[4]) * 6);
+        }
+        case 2:
+            // Bell
+            return true;
+        case 3: {
+            // ServerCutText, negative lengths are the extended format
+            uint8_t pad[3];
+            uint32_t len;
+            if (!readFully(pad, sizeof(pad)) || !readU32(&len)) {
+                return false;
+            }
+            return skip((int32_t)len < 0 ? -(int32_t)len : len);
+        }
+        default:
+            errno = 0;
+            return fail("unexpected server message");
+    }
+}
+
+bool RfbClient::readUpdate() {
+    uint8_t pad;
+    uint16_t rects;
+    if (!readU8(&pad) || !readU16(&rects)) {
+        return false;
+    }
+
+    for (int i = 0; i < rects || rects == 0xffff; i++) {
+        uint16_t x, y, w, h;
+        uint32_t encoding;
+        if (!readU16(&x) || !readU16(&y) || !readU16(&w) || !readU16(&h) ||
+            !readU32(&encoding)) {
+            return false;
+        }
+
+        bool ok;
+        switch ((int32_t)encoding) {
+            case kEncodingRaw:
+                ok = readRaw(x, y, w, h);
+                break;
+            case kEncodingCopyRect:
+                ok = skip(4);
+                break;
+            case kEncodingHextile:
+                ok = readHextile(w, h);
+                break;
+            case kEncodingTight:
+                ok = readTight(w, h);
+                break;
+            case kEncodingZRLE: {
+                uint32_t len;
+                ok = readU32(&len) && skip(len);
+                break;
+            }
+            case kEncodingDesktopSize:
+                mWidth = w;
+                mHeight = h;
+                ok = true;
+                break;
+            case kEncodingLastRect:
+                rects = i;
+                ok = true;
+                break;
+            default:
+                errno = 0;
+                return fail("unexpected encoding");
+        }
+        if (!ok) {
+            return false;
+        }
+        mStats.rects++;
+    }
+
+    uint64_t latency = nowUs() - mRequestTime;
+    mStats.updates++;
+    mStats.latencyUs += latency;
+    if (latency > mStats.latencyMaxUs) {
+        mStats.latencyMaxUs = latency;
+    }
+    if (latency > mStats.latencyPeakUs) {
+        mStats.latencyPeakUs = latency;
+    }
+    return true;
+}
+
+bool RfbClient::readRaw(int x, int y, int w, int h) {
+    size_t len = (size_t)w * h * mBpp;
+    if (x != 0 || y != 0 || w < kStampBits) {
+        return skip(len);
+    }
+
+    // the synthetic frame source writes the low 32 bits of the frame
+    // time in ms into the first pixels of the top row, black for 0
+    uint8_t row[kStampBits * 4];
+    if (!readFully(row, kStampBits * mBpp)) {
+        return false;
+    }
+    uint32_t stamp = 0;
+    for (int i = 0; i < kStampBits; i++) {
+        bool set = false;
+        for (int b = 0; b < mBpp; b++) {
+            set |= row[i * mBpp + b] != 0;
+        }
+        stamp |= (uint32_t)set << i;
+    }
+
+    // anything else in the corner reads as a nonsense age
+    uint32_t age = (uint32_t)(nowUs() / 1000) - stamp;
+    if (age < 10000) {
+        mStats.stamps++;
+        mStats.stampLatencyUs += age * 1000;
+    }
+    return skip(len - kStampBits * mBpp);
+}
+
+bool RfbClient::readHextile(int w, int h) {
+    for (int ty = 0; ty < h; ty += 16) {
+        for (int tx = 0; tx < w; tx += 16) {
+            const int tw = std::min(16, w - tx);
+            const int th = std::min(16, h - ty);
+
+            uint8_t flags;
+            if (!readU8(&flags)) {
+                return false;
+            }
+            if (flags & kHextileRaw) {
+                if (!skip(tw * th * mBpp)) {
+                    return false;
+                }
+                continue;
+            }
+
+            size_t len = 0;
+            if (flags & kHextileBackground) {
+                len += mBpp;
+            }
+            if (flags & kHextileForeground) {
+                len += mBpp;
+            }
+            if (!skip(len)) {
+                return false;
+            }
+            if (flags & kHextileAnySubrects) {
+                uint8_t count;
+                if (!readU8(&count)) {
+                    return false;
+                }
+                len = count * ((flags & kHextileSubrectsColoured) ? mBpp + 2 : 2);
+                if (!skip(len)) {
+                    return false;
+                }
+            }
+        }
+    }
+    return true;
+}
+
+bool RfbClient::readCompactLength(size_t* len) {
+    uint8_t b;
+    *len = 0;
+    for (int i = 0; i < 3; i++) {
+        if (!readU8(&b)) {
+            return false;
+        }
+        *len |= (size_t)(i < 2 ? b & 0x7f : b) << (7 * i);
+        if (i < 2 && !(b & 0x80)) {
+            break;
+        }
+    }
+    return true;
+}
+
+bool RfbClient::readTight(int w, int h) {
+    uint8_t control;
+    if (!readU8(&control)) {
+        return false;
+    }
+    const int type = control >> 4;
+
+    size_t len;
+    if (type == 0x08) {
+        // fill
+        return skip(mTightBpp);
+    }
+    if (type == 0x09 || type == 0x0a) {
+        // jpeg, png
+        return readCompactLength(&len) && skip(len);
+    }
+    if (type > 0x0a) {
+        errno = 0;
+        return fail("bad tight control");
+    }
+
+    // basic compression, with an optional filter
+    uint8_t filter = 0;
+    if ((type & 0x04) && !readU8(&filter)) {
+        return false;
+    }
+
+    size_t raw;
+    if (filter == 1) {
+        uint8_t colours;
+        if (!readU8(&colours) || !skip((colours + 1) * mTightBpp)) {
+            return false;
+        }
+        raw = colours + 1 <= 2 ? (size_t)((w + 7) / 8) * h : (size_t)w * h;
+    } else if (filter <= 2) {
+        raw = (size_t)w * h * mTightBpp;
+    } else {
+        errno = 0;
+        return fail("bad tight filter");
+    }
+
+    // small data is sent as is
+    if (raw < 12) {
+        return skip(raw);
+    }
+    return readCompactLength(&len) && skip(len);
+}
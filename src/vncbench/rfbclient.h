@@ -0,0 +1,129 @@
+//
+// vncflinger - Copyright (C) 2021 Stefanie Kondik
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+//
+
+
+#ifndef RFB_CLIENT_H_
+#define RFB_CLIENT_H_
+
+#include <stdint.h>
+#include <sys/types.h>
+
+#include <atomic>
+#include <string>
+#include <vector>
+
+namespace vncbench {
+
+// What one simulated viewer asks the server for.
+struct ClientConfig {
+    // raw, copyrect, hextile, tight or zrle
+    std::string encoding;
+    // rgbx, bgrx, rgb565 or rgb332
+    std::string format;
+    // JPEG quality 0-9 requested with tight, -1 for lossless only
+    int quality;
+};
+
+// Counters of one viewer, read by the reporting thread while it runs.
+struct ClientStats {
+    std::atomic<uint64_t> updates{0};
+    std::atomic<uint64_t> rects{0};
+    std::atomic<uint64_t> bytes{0};
+    // from sending a request to the end of the update answering it
+    std::atomic<uint64_t> latencyUs{0};
+    // since the last report, and over the whole run
+    std::atomic<uint64_t> latencyMaxUs{0};
+    std::atomic<uint64_t> latencyPeakUs{0};
+    // from the frame timestamp of a synthetic frame to its arrival
+    std::atomic<uint64_t> stamps{0};
+    std::atomic<uint64_t> stampLatencyUs{0};
+};
+
+// A minimal RFB 3.8 viewer that keeps exactly one incremental update
+// request outstanding and skips over the pixel data it receives. It
+// understands enough of every encoding it can ask for to find where a
+// rectangle ends, nothing is decoded except the frame stamp the
+// server's synthetic frames carry in their top row (raw only).
+class RfbClient {
+  public:
+    RfbClient(int id, const ClientConfig& config);
+    ~RfbClient();
+
+    bool connectTcp(const char* host, int port);
+    // a leading '@' is the abstract namespace
+    bool connectUnix(const char* name);
+
+    // handshake, then request and read updates until stop() or an error
+    bool run();
+    void stop();
+
+    ClientStats& stats() {
+        return mStats;
+    }
+
+    const std::string& error() {
+        return mError;
+    }
+
+    int id() {
+        return mId;
+    }
+
+    const ClientConfig& config() {
+        return mConfig;
+    }
+
+  private:
+    bool fail(const char* what);
+
+    bool fill();
+    bool readFully(void* data, size_t len);
+    bool skip(size_t len);
+    bool readU8(uint8_t* v);
+    bool readU16(uint16_t* v);
+    bool readU32(uint32_t* v);
+    bool writeFully(const void* data, size_t len);
+
+    bool handshake();
+    bool requestUpdate();
+    bool readMessage();
+    bool readUpdate();
+    bool readRaw(int x, int y, int w, int h);
+    bool readHextile(int w, int h);
+    bool readTight(int w, int h);
+    bool readCompactLength(size_t* len);
+
+    int mId;
+    ClientConfig mConfig;
+    ClientStats mStats;
+    std::string mError;
+
+    int mFd;
+    std::atomic<bool> mStopping;
+
+    std::vector<uint8_t> mBuffer;
+    size_t mPos, mEnd;
+
+    int mWidth, mHeight;
+    int mBpp;
+    // bytes of a tight pixel, 3 for 24-bit depth in 32-bit pixels
+    int mTightBpp;
+    int64_t mRequestTime;
+};
+};
+
+#endif
@@ -0,0 +1,301 @@
+//
+// vncflinger - Copyright (C) 2021 Stefanie Kondik
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+//
+
+
+// Load generator for vncflinger: opens a number of simultaneous viewer
+// connections, keeps each of them asking for updates as fast as it can
+// take them and reports what every viewer gets. Run it against a server
+// started with -syntheticsize to have a repeatable frame source; its
+// frames carry their timestamp, so raw viewers also report how old the
+// frames they receive are (the server has to be on the same machine).
+
+#include <errno.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <memory>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "rfbclient.h"
+
+using namespace vncbench;
+
+#define DEFAULT_SOCKET_TCP_PORT (5900)
+#define DEFAULT_SOCKET_UNIX_NAME "@vncflinger"
+#define DEFAULT_CLIENTS (4)
+#define DEFAULT_QUALITY (8)
+#define DEFAULT_DURATION_SECONDS (30)
+#define DEFAULT_INTERVAL_SECONDS (5)
+
+static char* gProgramName;
+static volatile sig_atomic_t gStopping = 0;
+
+// what was counted at the start of a report interval
+struct Snapshot {
+    uint64_t updates;
+    uint64_t bytes;
+    uint64_t latencyUs;
+    uint64_t stamps;
+    uint64_t stampLatencyUs;
+};
+
+static Snapshot snapshot(ClientStats& stats) {
+    Snapshot s;
+    s.updates = stats.updates;
+    s.bytes = stats.bytes;
+    s.latencyUs = stats.latencyUs;
+    s.stamps = stats.stamps;
+    s.stampLatencyUs = stats.stampLatencyUs;
+    return s;
+}
+
+static double nowSeconds() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+// utime + stime of a process, in clock ticks
+static bool readCpuTicks(int pid, uint64_t* ticks) {
+    char path[64];
+    snprintf(path, sizeof(path), "/proc/%d/stat", pid);
+    FILE* f = fopen(path, "re");
+    if (f == nullptr) {
+        return false;
+    }
+    char line[1024];
+    bool ok = fgets(line, sizeof(line), f) != nullptr;
+    fclose(f);
+    if (!ok) {
+        return false;
+    }
+
+    // the command name may contain anything, fields restart after it
+    const char* p = strrchr(line, ')');
+    unsigned long long utime, stime;
+    if (p == nullptr ||
+        sscanf(p + 2, "%*c %*d %*d %*d %*d %*d %*u %*u %*u %*u %*u %llu %llu", &utime, &stime) !=
+                2) {
+        return false;
+    }
+    *ticks = utime + stime;
+    return true;
+}
+
+static std::vector<std::string> split(const char* list) {
+    std::vector<std::string> items;
+    std::string item;
+    for (const char* p = list;; p++) {
+        if (*p == ',' || *p == '\0') {
+            if (!item.empty()) {
+                items.push_back(item);
+            }
+            item.clear();
+            if (*p == '\0') {
+                break;
+            }
+        } else {
+            item += *p;
+        }
+    }
+    return items;
+}
+
+static void report(const char* label, std::vector<std::unique_ptr<RfbClient>>& clients,
+                   std::vector<Snapshot>& last, double seconds, int pid, uint64_t* lastTicks,
+                   bool wholeRun) {
+    double totalFps = 0, totalBytes = 0;
+
+    for (size_t i = 0; i < clients.size(); i++) {
+        RfbClient* c = clients[i].get();
+        Snapshot now = snapshot(c->stats());
+        const Snapshot& then = last[i];
+
+        const uint64_t updates = now.updates - then.updates;
+        const uint64_t stamps = now.stamps - then.stamps;
+        const double fps = updates / seconds;
+        const double bytes = (now.bytes - then.bytes) / seconds;
+        totalFps += fps;
+        totalBytes += bytes;
+
+        printf("[%s] client %d %s/%s: %.1f fps, %.2f MB/s, update %.1f ms avg %.1f max", label,
+               c->id(), c->config().encoding.c_str(), c->config().format.c_str(), fps,
+               bytes / 1e6, updates ? (now.latencyUs - then.latencyUs) / 1e3 / updates : 0.0,
+               (wholeRun ? c->stats().latencyPeakUs.load() : c->stats().latencyMaxUs.exchange(0)) /
+                       1e3);
+        if (stamps > 0) {
+            printf(", frame age %.1f ms", (now.stampLatencyUs - then.stampLatencyUs) / 1e3 / stamps);
+        }
+        if (!c->error().empty()) {
+            printf(" (%s)", c->error().c_str());
+        }
+        printf("\n");
+
+        last[i] = now;
+    }
+
+    printf("[%s] total %.1f fps, %.2f MB/s", label, totalFps, totalBytes / 1e6);
+    uint64_t ticks;
+    if (pid > 0 && readCpuTicks(pid, &ticks)) {
+        printf(", server cpu %.1f%%",
+               (ticks - *lastTicks) * 100.0 / sysconf(_SC_CLK_TCK) / seconds);
+        *lastTicks = ticks;
+    }
+    printf("\n");
+    fflush(stdout);
+}
+
+static void onSignal(int) {
+    gStopping = 1;
+}
+
+static int usage() {
+    fprintf(stderr, "\nUsage: %s [-T <Port>] or [-u <Name>] [-n <Clients>] [-e <Encodings>]\n"
+            "       [-f <Formats>] [-q <Quality>] [-d <Seconds>] [-i <Seconds>] [-p <Pid>]\n",
+            gProgramName);
+    fprintf(stderr,
+            "\n"
+            "-T: TCP port on 127.0.0.1 (default port: %d)\n"
+            "-u: Unix socket, @ for the abstract namespace (default: %s)\n"
+            "-n: Simultaneous viewers (default: %d)\n"
+            "-e: Encodings handed out to the viewers in turn, of raw, copyrect,\n"
+            "    hextile, tight, zrle (default: tight)\n"
+            "-f: Pixel formats handed out in turn, of rgbx, bgrx, rgb565, rgb332\n"
+            "    (default: rgbx)\n"
+            "-q: JPEG quality 0-9 asked for with tight, -1 for lossless (default: %d)\n"
+            "-d: Duration of the run (default: %d)\n"
+            "-i: Report interval (default: %d)\n"
+            "-p: Server process to report the CPU use of\n",
+            DEFAULT_SOCKET_TCP_PORT, DEFAULT_SOCKET_UNIX_NAME, DEFAULT_CLIENTS, DEFAULT_QUALITY,
+            DEFAULT_DURATION_SECONDS, DEFAULT_INTERVAL_SECONDS);
+    return 1;
+}
+
+int main(int argc, char** argv) {
+    gProgramName = argv[0];
+
+    int port = 0;
+    const char* socketName = DEFAULT_SOCKET_UNIX_NAME;
+    int count = DEFAULT_CLIENTS;
+    std::vector<std::string> encodings = {"tight"};
+    std::vector<std::string> formats = {"rgbx"};
+    int quality = DEFAULT_QUALITY;
+    int duration = DEFAULT_DURATION_SECONDS;
+    int interval = DEFAULT_INTERVAL_SECONDS;
+    int pid = 0;
+
+    for (int i = 1; i < argc; i++) {
+        if (i + 1 >= argc) {
+            return usage();
+        }
+        const char* value = argv[i + 1];
+        if (strcmp(argv[i], "-T") == 0) {
+            port = atoi(value);
+        } else if (strcmp(argv[i], "-u") == 0) {
+            socketName = value;
+            port = 0;
+        } else if (strcmp(argv[i], "-n") == 0) {
+            count = atoi(value);
+        } else if (strcmp(argv[i], "-e") == 0) {
+            encodings = split(value);
+        } else if (strcmp(argv[i], "-f") == 0) {
+            formats = split(value);
+        } else if (strcmp(argv[i], "-q") == 0) {
+            quality = atoi(value);
+        } else if (strcmp(argv[i], "-d") == 0) {
+            duration = atoi(value);
+        } else if (strcmp(argv[i], "-i") == 0) {
+            interval = atoi(value);
+        } else if (strcmp(argv[i], "-p") == 0) {
+            pid = atoi(value);
+        } else {
+            return usage();
+        }
+        i++;
+    }
+    if (count <= 0 || encodings.empty() || formats.empty() || duration <= 0 || interval <= 0) {
+        return usage();
+    }
+
+    signal(SIGINT, onSignal);
+    signal(SIGTERM, onSignal);
+    signal(SIGPIPE, SIG_IGN);
+
+    std::vector<std::unique_ptr<RfbClient>> clients;
+    for (int i = 0; i < count; i++) {
+        ClientConfig config;
+        config.encoding = encodings[i % encodings.size()];
+        config.format = formats[i % formats.size()];
+        config.quality = quality;
+
+        RfbClient* c = new RfbClient(i, config);
+        bool ok = port > 0 ? c->connectTcp("127.0.0.1", port) : c->connectUnix(socketName);
+        if (!ok) {
+            fprintf(stderr, "client %d: %s\n", i, c->error().c_str());
+            delete c;
+            return 2;
+        }
+        clients.emplace_back(c);
+    }
+
+    std::vector<std::thread> threads;
+    std::vector<Snapshot> last(clients.size());
+    for (auto& c : clients) {
+        RfbClient* client = c.get();
+        threads.emplace_back([client] { client->run(); });
+    }
+
+    uint64_t startTicks = 0, lastTicks = 0;
+    if (pid > 0 && !readCpuTicks(pid, &startTicks)) {
+        fprintf(stderr, "cannot read the cpu time of process %d\n", pid);
+        pid = 0;
+    }
+    lastTicks = startTicks;
+
+    const double start = nowSeconds();
+    double lastReport = start;
+    while (!gStopping && nowSeconds() - start < duration) {
+        usleep(100000);
+
+        const double now = nowSeconds();
+        if (now - lastReport >= interval) {
+            char label[16];
+            snprintf(label, sizeof(label), "%4ds", (int)(now - start + 0.5));
+            report(label, clients, last, now - lastReport, pid, &lastTicks, false);
+            lastReport = now;
+        }
+    }
+
+    for (auto& c : clients) {
+        c->stop();
+    }
+    for (auto& t : threads) {
+        t.join();
+    }
+
+    // over the whole run
+    std::vector<Snapshot> zero(clients.size(), Snapshot{});
+    lastTicks = startTicks;
+    report("total", clients, zero, nowSeconds() - start, pid, &lastTicks, true);
+    return 0;
+}
@@ -1,6 +1,8 @@
 #define LOG_TAG "VNCFlinger:AndroidDesktop"
 #include <utils/Log.h>
 
+#include <algorithm>
+
 #include <fcntl.h>
 #include <inttypes.h>
 #include <sys/eventfd.h>
@@ -12,10 +14,13 @@
 #include <rfb/PixelFormat.h>
 #include <rfb/Rect.h>
 #include <rfb/ScreenSet.h>
+#include <rfb/ServerCore.h>
 
 #include "AndroidDesktop.h"
 #include "AndroidPixelBuffer.h"
 #include "InputDevice.h"
+#include "RecordingInputSink.h"
+#include "SyntheticFrameSource.h"
 #include "VirtualDisplay.h"
 
 using namespace vncflinger;
@@ -24,9 +29,25 @@ using namespace android;
 extern void runJniCallbackNewSurfaceAvailable();
 extern void runJniCallbackResizeDisplay(int32_t w, int32_t h);
 extern void runJniCallbackSetClipboard(const char* text);
-extern const char* runJniCallbackGetClipboard();
+extern void runJniCallbackGetClipboard(AndroidDesktop* desktop);
+
+// rows per copy job, one row of damage tiles so the hash runs on
+// pixels that are still in cache
+static const int kCopyBandHeight = DamageTracker::kTileSize;
+
+// frames between capture statistics in the log
+static const uint64_t kCaptureStatsInterval = 600;
+
+// producer damage kept for frames not copied yet, older frames are
+// forgotten and the next copy is a full one
+static const size_t kMaxSurfaceDamageFrames = 8;
 
-AndroidDesktop::AndroidDesktop() {
+// lowest frame rate congestion backoff goes down to
+static const int kMinFrameRate = 10;
+
+AndroidDesktop::AndroidDesktop(sp<WorkerPool> workers, bool javaSurface)
+    : mServer(NULL), mJavaSurface(javaSurface), mWorkers(workers), mDeferTimer(this),
+      mFrameTimer(this) {
     mDisplayRect = Rect(0, 0);
 
     mEventFd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
@@ -35,20 +56,53 @@ AndroidDesktop::AndroidDesktop() {
         return;
     }
 
-    runJniCallbackNewSurfaceAvailable();
+    if (mJavaSurface) {
+        runJniCallbackNewSurfaceAvailable();
+    }
 }
 
 AndroidDesktop::~AndroidDesktop() {
     close(mEventFd);
 }
 
+// the server starts the desktop for its first viewer, the service loop
+// for the first shared memory client; capture runs while either needs it
 void AndroidDesktop::start(rfb::VNCServer* vs) {
     mServer = vs;
-    mInputDevice = new InputDevice();
+    if (mStartCount++ > 0) {
+        if (mPixels != NULL) {
+            mServer->setPixelBuffer(mPixels.get(), computeScreenLayout());
+        }
+        return;
+    }
+
+    if (mSyntheticWidth > 0 || !mInputRecordPath.empty()) {
+        mInputDevice = new RecordingInputSink(mInputRecordPath.c_str());
+    } else {
+        mInputDevice = new InputDevice();
+    }
+
+    // a 16-bit capture is used as is, otherwise the copy can convert
+    // to what most clients want so the server does not have to
+    const rfb::PixelFormat* pf = &AndroidPixelBuffer::sRGB565;
+    mConvert = nullptr;
+    if (mCaptureDepth != 16) {
+        pf = AndroidPixelBuffer::formatByName(mServerFormat.c_str());
+        if (pf == nullptr) {
+            ALOGW("Unknown server format %s, using rgbx", mServerFormat.c_str());
+            pf = &AndroidPixelBuffer::sRGBX;
+        }
+        mConvert = rgbxRowConverter(mServerFormat.c_str());
+    }
 
-    mPixels = new AndroidPixelBuffer();
+    mPixels = new AndroidPixelBuffer(*pf);
     mPixels->setDimensionsChangedListener(this);
 
+    {
+        Mutex::Autolock _l(mLock);
+        applyDisplayProps();
+    }
+
     if (updateDisplayInfo(true) != NO_ERROR) {
         ALOGE("Failed to query display!");
         return;
@@ -60,6 +114,10 @@ void AndroidDesktop::start(rfb::VNCServer* vs) {
 }
 
 void AndroidDesktop::stop() {
+    if (mStartCount == 0 || --mStartCount > 0) {
+        return;
+    }
+
     Mutex::Autolock _L(mLock);
 
     ALOGV("Shutting down");
@@ -67,16 +125,40 @@ void AndroidDesktop::stop() {
     mServer->setPixelBuffer(0);
     mPixels->reset();
 
-    mVirtualDisplay.clear();
+    mDeferTimer.stop();
+    mDeferred.clear();
+    mFrameTimer.stop();
+
+    // a display we project ourselves is kept, paused, so the next
+    // viewer does not wait for SurfaceFlinger to set up a new one
+    mFrameSource.clear();
+    {
+        Mutex::Autolock _s(mSurfaceLock);
+        if (mVirtualDisplay != NULL && mLayerId >= 0) {
+            mVirtualDisplay->pause();
+        } else {
+            mVirtualDisplay.clear();
+        }
+    }
     mPixels.clear();
     mInputDevice->stop();
+    mInputMode = {};
 
-    runJniCallbackNewSurfaceAvailable();
+    if (mJavaSurface && mSyntheticWidth == 0) {
+        runJniCallbackNewSurfaceAvailable();
+    }
 }
 
+// answered through onClipboardReply() once Java has the text
 void AndroidDesktop::handleClipboardRequest() {
-    const char* data = runJniCallbackGetClipboard();
-    if (strlen(data)) mServer->sendClipboardData(data);
+    runJniCallbackGetClipboard(this);
+}
+
+void AndroidDesktop::onClipboardReply(const char* text) {
+    Mutex::Autolock _l(mClipboardLock);
+    mClipboardReply = text;
+    clipboardReplied = true;
+    notify();
 }
 
 void AndroidDesktop::handleClipboardAnnounce(bool available) {
@@ -93,6 +175,16 @@ void AndroidDesktop::notifyClipboardChanged() {
 }
 
 void AndroidDesktop::processClipboard() {
+    std::string reply;
+    bool replied;
+    {
+        Mutex::Autolock _l(mClipboardLock);
+        replied = clipboardReplied;
+        clipboardReplied = false;
+        reply.swap(mClipboardReply);
+    }
+    if (replied && !reply.empty() && mServer) mServer->sendClipboardData(reply.c_str());
+
     if (!clipboardChanged)
         return;
     clipboardChanged = false;
@@ -109,6 +201,34 @@ void AndroidDesktop::setCursor(uint32_t width, uint32_t height, int hotX, int ho
     notify();
 }
 
+void AndroidDesktop::setDisplayProps(int32_t width, int32_t height, int32_t rotation,
+                                     int32_t layerId, bool touch, bool relative) {
+    {
+        Mutex::Autolock _l(mLock);
+        mPendingProps = {width, height, rotation, layerId, touch, relative};
+        mPropsPending = true;
+    }
+    notify();
+}
+
+void AndroidDesktop::processDisplayProps() {
+    Mutex::Autolock _l(mLock);
+    applyDisplayProps();
+}
+
+void AndroidDesktop::applyDisplayProps() {
+    if (!mPropsPending)
+        return;
+    mPropsPending = false;
+
+    _width = mPendingProps.width;
+    _height = mPendingProps.height;
+    _rotation = mPendingProps.rotation;
+    mLayerId = mPendingProps.layerId;
+    touch = mPendingProps.touch;
+    relative = mPendingProps.relative;
+}
+
 void AndroidDesktop::processCursor() {
     if (!cursorChanged)
         return;
@@ -118,43 +238,236 @@ void AndroidDesktop::processCursor() {
 }
 
 void AndroidDesktop::processFrames() {
-    if (mVirtualDisplay == NULL)
+    if (mFrameSource == NULL)
         return;
     if (mPixels == NULL)
         return;
     if (!frameChanged)
         return;
+
+    // a congested desktop takes frames at a lower rate, the newest one
+    // is picked up once the interval is over
+    nsecs_t now = systemTime(SYSTEM_TIME_MONOTONIC);
+    if (mFrameInterval > 0 && now - mLastFrameTime < ms2ns(mFrameInterval)) {
+        if (!mFrameTimer.isStarted()) {
+            mFrameTimer.start(ns2ms(mLastFrameTime + ms2ns(mFrameInterval) - now) + 1);
+        }
+        return;
+    }
+    mLastFrameTime = now;
     frameChanged = false;
 
     Mutex::Autolock _l(mLock);
 
+    applyDisplayProps();
     updateDisplayInfo();
 
     // get a frame from the virtual display
     CpuConsumer::LockedBuffer imgBuffer;
-    status_t res = mVirtualDisplay->getConsumer()->lockNextBuffer(&imgBuffer);
+    status_t res = mFrameSource->lockNextBuffer(&imgBuffer);
     if (res != OK) {
         ALOGE("Failed to lock next buffer: %s (%d)", strerror(-res), res);
         return;
     }
 
+    // frames queued behind this one would be overwritten before they
+    // are ever sent, only the newest is worth copying
+    CpuConsumer::LockedBuffer nextBuffer;
+    while (mFrameSource->lockNextBuffer(&nextBuffer) == OK) {
+        mFrameSource->unlockBuffer(imgBuffer);
+        imgBuffer = nextBuffer;
+        mFramesSkipped++;
+    }
+
+    // frames queued before the display was resized in place
+    if ((int)imgBuffer.width != mPixels->width() || (int)imgBuffer.height != mPixels->height()) {
+        ALOGV("Dropping %ux%u frame for %dx%d buffer", imgBuffer.width, imgBuffer.height,
+              mPixels->width(), mPixels->height());
+        mFrameSource->unlockBuffer(imgBuffer);
+        return;
+    }
+
+    if (mResizeStart != 0) {
+        ALOGI("Resize: first %dx%d frame after %" PRId64 " ms", mPixels->width(),
+              mPixels->height(), ns2ms(systemTime(SYSTEM_TIME_MONOTONIC) - mResizeStart));
+        mResizeStart = 0;
+    }
+
     mFrameNumber = imgBuffer.frameNumber;
     //ALOGV("processFrame: [%" PRIu64 "] format: %x (%dx%d, stride=%d)", mFrameNumber, imgBuffer.format,
     //      imgBuffer.width, imgBuffer.height, imgBuffer.stride);
 
+    // the producer may not honour the requested format, and copying
+    // with the wrong pixel size would run off the end of the buffer
+    const int bpp = mConvert != nullptr ? 4 : mPixels->getPF().bpp / 8;
+    if ((int)bytesPerPixel(imgBuffer.format) != bpp) {
+        ALOGE("Unexpected buffer format %d, expected %d bytes per pixel", imgBuffer.format, bpp);
+        mFrameSource->unlockBuffer(imgBuffer);
+        mFullCopy = true;
+        return;
+    }
+
     // we don't know if there was a stride change until we get
     // a buffer from the queue. if it changed, we need to resize
 
     rfb::Rect bufRect(0, 0, imgBuffer.width, imgBuffer.height);
+    if (mDamage.width() != (int)imgBuffer.width || mDamage.height() != (int)imgBuffer.height) {
+        mDamage.reset(imgBuffer.width, imgBuffer.height);
+        mClassifier.reset(mDamage);
+        mDeferred.clear();
+        mFullCopy = true;
+    }
+
+    // the rest of the pixel buffer still holds the previous frame, so
+    // only what the producer redrew has to be copied. the
+    // buffer maps 1:1 onto the pixel buffer, so its damage needs no
+    // scaling, but a transformed buffer is taken as a whole.
+    rfb::Region redrawn;
+    const bool partial = takeSurfaceDamage(imgBuffer.frameNumber, &redrawn) && !mFullCopy &&
+                         imgBuffer.transform == 0;
+    if (partial) {
+        redrawn = redrawn.intersect(bufRect);
+        std::vector<rfb::Rect> rects;
+        redrawn.get_rects(&rects);
+        int pixels = 0;
+        for (const rfb::Rect& r : rects) {
+            pixels += r.area();
+        }
+        mPixelsNotCopied += bufRect.area() - pixels;
+        mPartialFrames++;
+    } else {
+        mFullFrames++;
+    }
+    mFullCopy = false;
 
     // performance is extremely bad if the gpu memory is used
-    // directly without copying because it is likely uncached
-    mPixels->imageRect(bufRect, imgBuffer.data, imgBuffer.stride);
+    // directly without copying because it is likely uncached.
+    // the copy is memory bound, so split it into bands and let
+    // every core pull on its own share of the bandwidth
+    const bool classify = classifying();
+    const int bands = (bufRect.height() + kCopyBandHeight - 1) / kCopyBandHeight;
+    mWorkers->run(bands, [&](int i) {
+        rfb::Rect band(0, i * kCopyBandHeight, bufRect.width(),
+                       std::min((i + 1) * kCopyBandHeight, bufRect.height()));
+        rfb::Region area(band);
+        if (partial) {
+            area = redrawn.intersect(area);
+        }
+
+        std::vector<rfb::Rect> rects;
+        area.get_rects(&rects);
+        for (const rfb::Rect& r : rects) {
+            const uint8_t* src = imgBuffer.data + (r.tl.y * imgBuffer.stride + r.tl.x) * bpp;
+            if (mConvert == nullptr) {
+                mPixels->imageRect(r, src, imgBuffer.stride);
+            } else {
+                int stride;
+                uint8_t* dst = mPixels->getBufferRW(r, &stride);
+                const int dstBpp = mPixels->getPF().bpp / 8;
+                for (int y = 0; y < r.height(); y++) {
+                    mConvert(src + y * imgBuffer.stride * bpp, dst + y * stride * dstBpp,
+                             r.width());
+                }
+                mPixels->commitBufferRW(r);
+            }
+        }
+        if (classify) {
+            if (partial) {
+                mDamage.clearTileRow(i);
+            }
+            if (!rects.empty()) {
+                mDamage.hashTileRow(mPixels.get(), area.get_bounding_rect(), i);
+            }
+            mClassifier.classifyTileRow(mPixels.get(), mDamage, i);
+        }
+    });
+
+    mFrameSource->unlockBuffer(imgBuffer);
+
+    // everything copied is reported, the server compares it with what
+    // each client has and only encodes pixels that really differ
+    rfb::Region changed = partial ? redrawn : rfb::Region(bufRect);
+    if (classify) {
+        mDamage.frameDone();
+    }
+    if (!changed.is_empty() && mVideo != NULL) {
+        mVideo->encodeFrame(mPixels.get(), imgBuffer.timestamp);
+    }
+    if (!changed.is_empty() && mShared != NULL) {
+        mShared->update(mPixels.get(), changed);
+    }
+
+    // tiles playing video are collected and sent together when the
+    // timer fires, everything else goes out right away
+    if (!changed.is_empty() && mVideoTileInterval > 0) {
+        rfb::Region video = mDamage.maskRegion(mClassifier.videoMask(), bufRect).intersect(changed);
+        if (!video.is_empty()) {
+            changed.assign_subtract(video);
+            mDeferred.assign_union(video);
+            if (!mDeferTimer.isStarted()) {
+                mDeferTimer.start(mVideoTileInterval);
+            }
+
+            std::vector<rfb::Rect> rects;
+            video.get_rects(&rects);
+            int pixels = 0;
+            for (const rfb::Rect& r : rects) {
+                pixels += r.area();
+            }
+            const int tileArea = DamageTracker::kTileSize * DamageTracker::kTileSize;
+            mClassifier.countWithheld((pixels + tileArea - 1) / tileArea);
+        }
+    }
+
+    if (!changed.is_empty()) {
+        mServer->add_changed(changed);
+    }
+
+    if (++mFramesSinceStats >= kCaptureStatsInterval) {
+        mFramesSinceStats = 0;
+        if (classify) {
+            mClassifier.dumpStats();
+        }
+        ALOGI("Capture: %" PRIu64 " queued frames skipped", mFramesSkipped);
+        mFramesSkipped = 0;
+        ALOGI("Surface damage: %" PRIu64 " frames copied in part, %" PRIu64 " in full, "
+              "%" PRIu64 " pixels not copied",
+              mPartialFrames, mFullFrames, mPixelsNotCopied);
+        mPartialFrames = mFullFrames = mPixelsNotCopied = 0;
+    }
+}
+
+// flushes the video tiles held back by processFrames(), the frame timer
+// only has to wake the service loop
+bool AndroidDesktop::handleTimeout(rfb::Timer* t) {
+    if (t == &mFrameTimer) {
+        return false;
+    }
+
+    Mutex::Autolock _l(mLock);
+
+    if (mServer != NULL && mPixels != NULL && !mDeferred.is_empty()) {
+        mServer->add_changed(mDeferred.intersect(rfb::Region(mPixels->getRect())));
+    }
+    mDeferred.clear();
+    return false;
+}
+
+// every congestion level halves the frame rate of this desktop and
+// doubles the interval of video tiles, within what was configured. The
+// server's frameRate is shared by all desktops and left alone.
+void AndroidDesktop::onLinkLevelChanged(int level) {
+    if (mBaseFrameRate == 0) {
+        mBaseFrameRate = rfb::Server::frameRate;
+    }
+
+    int frameRate = std::max(std::min(kMinFrameRate, mBaseFrameRate), mBaseFrameRate >> level);
+    mFrameInterval = level > 0 ? 1000 / frameRate : 0;
 
-    mVirtualDisplay->getConsumer()->unlockBuffer(imgBuffer);
+    mVideoTileInterval = mBaseVideoTileInterval << level;
 
-    // update clients
-    mServer->add_changed(bufRect);
+    ALOGI("Link level %d: frame rate %d, video tile interval %d ms", level, frameRate,
+          mVideoTileInterval);
 }
 
 // notifies the server loop that we have changes
@@ -166,9 +479,11 @@ void AndroidDesktop::notify() {
 // called when a client resizes the window
 unsigned int AndroidDesktop::setScreenLayout(int reqWidth, int reqHeight,
                                              const rfb::ScreenSet& layout) {
-	if (mLayerId < 0) {
+    if (mLayerId < 0 && mSyntheticWidth == 0) {
+        // Java resizes its display in the background, the viewers get the
+        // new mode through updateDisplayInfo() once it is active. if we
+        // return success, we crash because the mode change took too long.
         runJniCallbackResizeDisplay(reqWidth, reqHeight);
-        // if we return success, we crash because the mode change took too long.
         return rfb::resultInvalid;
     }
 
@@ -199,11 +514,48 @@ unsigned int AndroidDesktop::setScreenLayout(int reqWidth, int reqHeight,
 // cpuconsumer frame listener, called from binder thread
 void AndroidDesktop::onFrameAvailable(const BufferItem& item) {
     //ALOGV("onFrameAvailable: [%" PRIu64 "] mTimestamp=%" PRId64, item.mFrameNumber, item.mTimestamp);
+    if (mUseSurfaceDamage) {
+        Mutex::Autolock _d(mSurfaceDamageLock);
+        if (mSurfaceDamage.size() >= kMaxSurfaceDamageFrames) {
+            mSurfaceDamage.erase(mSurfaceDamage.begin());
+            mSurfaceDamageLost = true;
+        }
+        mSurfaceDamage[item.mFrameNumber] = item.mSurfaceDamage;
+    }
     frameChanged = true;
 
     notify();
 }
 
+// Collects the damage of |frameNumber| and of the frames before it that
+// were never copied. False if any of them came without damage, in which
+// case the frame has to be taken as a whole.
+bool AndroidDesktop::takeSurfaceDamage(uint64_t frameNumber, rfb::Region* damage) {
+    Mutex::Autolock _d(mSurfaceDamageLock);
+
+    bool usable = mUseSurfaceDamage && !mSurfaceDamageLost;
+    bool found = false;
+    mSurfaceDamageLost = false;
+
+    auto it = mSurfaceDamage.begin();
+    while (it != mSurfaceDamage.end() && it->first <= frameNumber) {
+        found = found || it->first == frameNumber;
+        // empty, or INVALID_REGION, when the producer did not say
+        const Region& region = it->second;
+        if (region.isEmpty()) {
+            usable = false;
+        } else if (usable) {
+            for (Region::const_iterator r = region.begin(); r != region.end(); r++) {
+                damage->assign_union(
+                        rfb::Region(rfb::Rect(r->left, r->top, r->right, r->bottom)));
+            }
+        }
+        it = mSurfaceDamage.erase(it);
+    }
+
+    return usable && found;
+}
+
 void AndroidDesktop::keyEvent(rdr::U32 keysym, __unused_attr rdr::U32 keycode, bool down) {
     mInputDevice->keyEvent(down, keysym);
 }
@@ -217,8 +569,9 @@ void AndroidDesktop::pointerEvent(const rfb::Point& pos, int buttonMask) {
     }
     uint32_t mx = (mPixels->width() - mDisplayRect.getWidth()) / 2;
     uint32_t my = (mPixels->height() - mDisplayRect.getHeight()) / 2;
-    uint32_t x = (((pos.x - mx) * mDisplayMode.width) / ((float)(mDisplayRect.getWidth())));
-    uint32_t y = (((pos.y - my) * mDisplayMode.height) / ((float)(mDisplayRect.getHeight())));
+    uint32_t x, y;
+    mapPointer(mCaptureRect, mDisplayMode, mDisplayRect.getWidth(), mDisplayRect.getHeight(),
+               pos.x - mx, pos.y - my, &x, &y);
 
     ALOGV("pointer xlate x1=%d y1=%d x2=%d y2=%d", pos.x, pos.y, x, y);
 
@@ -228,7 +581,10 @@ void AndroidDesktop::pointerEvent(const rfb::Point& pos, int buttonMask) {
 
 // refresh the display dimensions
 status_t AndroidDesktop::updateDisplayInfo(bool force) {
-    if (mLayerId == 0) {
+    if (mSyntheticWidth > 0) {
+        mDisplayMode = ui::Size(mSyntheticWidth, mSyntheticHeight);
+        mDisplayState = ui::ROTATION_0;
+    } else if (mLayerId == 0) {
         const auto displayToken = SurfaceComposerClient::getInternalDisplayToken();
         if (displayToken == nullptr) {
             ALOGE("Failed to get display token\n");
@@ -262,8 +618,22 @@ status_t AndroidDesktop::updateDisplayInfo(bool force) {
     }
 
     ALOGV("updateDisplayInfo: [%d:%d], rotated %d, layerId %d", mDisplayMode.width, mDisplayMode.height, mDisplayState, mLayerId);
+
+    mCaptureRect = Rect();
+    mCaptureMode = mDisplayMode;
+    if (!mCrop.isEmpty() && mLayerId >= 0 && mSyntheticWidth == 0) {
+        mCaptureRect = captureArea(mCrop, mDisplayMode, mDisplayState);
+        if (!mCaptureRect.isEmpty()) {
+            mCaptureMode = ui::Size(mCaptureRect.getWidth(), mCaptureRect.getHeight());
+        } else if (mDisplayState != ui::ROTATION_0) {
+            ALOGW("Capture rect needs an unrotated display, capturing all of it");
+        } else {
+            ALOGW("Capture rect is outside the display, capturing all of it");
+        }
+    }
+
 	if (mPixels != NULL)
-        mPixels->setDisplayInfo(&mDisplayMode, &mDisplayState, force);
+        mPixels->setDisplayInfo(&mCaptureMode, &mDisplayState, force);
     return NO_ERROR;
 }
 
@@ -278,14 +648,58 @@ void AndroidDesktop::onBufferDimensionsChanged(uint32_t width, uint32_t height)
     ALOGI("Dimensions changed: old=(%ux%u) new=(%ux%u)", mDisplayRect.getWidth(),
           mDisplayRect.getHeight(), width, height);
 
-    mVirtualDisplay.clear();
-    mVirtualDisplay = new VirtualDisplay(&mDisplayMode,  &mDisplayState,
-                                         mPixels->width(), mPixels->height(), mLayerId, this);
-    runJniCallbackNewSurfaceAvailable();
+    const PixelFormat format = mCaptureDepth == 16 ? PIXEL_FORMAT_RGB_565 : PIXEL_FORMAT_RGBX_8888;
+
+    Mutex::Autolock _s(mSurfaceLock);
+    mFrameSource.clear();
+    if (mSyntheticWidth > 0) {
+        mVirtualDisplay.clear();
+        mFrameSource = new SyntheticFrameSource(mPixels->width(), mPixels->height(), mSyntheticFps,
+                                                format, mSyntheticReplay.c_str(), this);
+    } else if (mVirtualDisplay != NULL && mLayerId >= 0 &&
+               mVirtualDisplay->canResize(mLayerId, format)) {
+        // a display we project ourselves is resized in place, which
+        // keeps SurfaceFlinger from tearing down and setting up a new one
+        if (!mVirtualDisplay->matches(&mDisplayMode, &mDisplayState, mPixels->width(),
+                                      mPixels->height(), mLayerId, format, mCaptureRect)) {
+            mVirtualDisplay->resize(&mDisplayMode, &mDisplayState, mPixels->width(),
+                                    mPixels->height(), mCaptureRect);
+        }
+        mVirtualDisplay->resume();
+        mFrameSource = mVirtualDisplay;
+    } else {
+        mVirtualDisplay.clear();
+        mVirtualDisplay = new VirtualDisplay(&mDisplayMode,  &mDisplayState,
+                                             mPixels->width(), mPixels->height(), mLayerId, this,
+                                             format, mCaptureRect);
+        mFrameSource = mVirtualDisplay;
+        if (mJavaSurface) {
+            runJniCallbackNewSurfaceAvailable();
+        }
+    }
+
+    mDisplayRect = mFrameSource->getDisplayRect();
+    mDamage.reset(width, height);
+    mClassifier.reset(mDamage);
+    mDeferred.clear();
 
-    mDisplayRect = mVirtualDisplay->getDisplayRect();
+    // frame numbers start over with a new source
+    mFullCopy = true;
+    {
+        Mutex::Autolock _d(mSurfaceDamageLock);
+        mSurfaceDamage.clear();
+    }
+
+    // uinput devices take a while to come back, and only care
+    // about the display mode
+    if (mInputMode != mDisplayMode || mInputTouch != touch || mInputRelative != relative) {
+        mInputDevice->reconfigure(mDisplayMode.width, mDisplayMode.height, touch, relative);
+        mInputMode = mDisplayMode;
+        mInputTouch = touch;
+        mInputRelative = relative;
+    }
 
-    mInputDevice->reconfigure(mDisplayMode.width, mDisplayMode.height, touch, relative);
+    mResizeStart = systemTime(SYSTEM_TIME_MONOTONIC);
 
     mServer->setPixelBuffer(mPixels.get(), computeScreenLayout());
     mServer->setScreenLayout(computeScreenLayout());
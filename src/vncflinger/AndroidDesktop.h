@@ -1,7 +1,9 @@
 #ifndef ANDROID_DESKTOP_H_
 #define ANDROID_DESKTOP_H_
 
+#include <map>
 #include <memory>
+#include <string>
 
 #include <utils/Condition.h>
 #include <utils/Mutex.h>
@@ -12,14 +14,25 @@
 
 #include <ui/DisplayMode.h>
 #include <ui/DisplayState.h>
+#include <ui/Region.h>
 
 #include <rfb/PixelBuffer.h>
 #include <rfb/SDesktop.h>
 #include <rfb/ScreenSet.h>
+#include <rfb/Timer.h>
 
 #include "AndroidPixelBuffer.h"
-#include "InputDevice.h"
+#include "CaptureArea.h"
+#include "ColorConvert.h"
+#include "ConnectionMonitor.h"
+#include "DamageTracker.h"
+#include "FrameSource.h"
+#include "InputSink.h"
+#include "SharedFramebuffer.h"
+#include "TileClassifier.h"
+#include "VideoStreamer.h"
 #include "VirtualDisplay.h"
+#include "WorkerPool.h"
 
 using namespace android;
 
@@ -27,9 +40,13 @@ namespace vncflinger {
 
 class AndroidDesktop : public rfb::SDesktop,
                        public CpuConsumer::FrameAvailableListener,
-                       public AndroidPixelBuffer::BufferDimensionsListener {
+                       public AndroidPixelBuffer::BufferDimensionsListener,
+                       public rfb::Timer::Callback,
+                       public ConnectionMonitor::LinkListener {
   public:
-    AndroidDesktop();
+    // |javaSurface| hands the virtual display surface to the Java service,
+    // desktops on a layer stack of their own do without
+    AndroidDesktop(sp<WorkerPool> workers, bool javaSurface = true);
 
     virtual ~AndroidDesktop();
 
@@ -39,6 +56,8 @@ class AndroidDesktop : public rfb::SDesktop,
     virtual void handleClipboardRequest();
     virtual void handleClipboardAnnounce(bool available);
     virtual void handleClipboardData(const char* data);
+    // the Java service answering handleClipboardRequest()
+    void onClipboardReply(const char* text);
     virtual void notifyClipboardChanged();
 	virtual void processClipboard();
     virtual void setCursor(uint32_t width, uint32_t height, int hotX, int hotY, const rdr::U8* buffer);
@@ -51,22 +70,112 @@ class AndroidDesktop : public rfb::SDesktop,
 
     virtual void processFrames();
 
+    // producer of the virtual display for the Java service, called from
+    // its callback thread
+    sp<IGraphicBufferProducer> getSurfaceProducer() {
+        Mutex::Autolock _l(mSurfaceLock);
+        return mVirtualDisplay != NULL ? mVirtualDisplay->getProducer() : NULL;
+    }
+
+    // a frame arrived that processFrames() has not picked up yet
+    bool hasPendingFrame() {
+        return frameChanged;
+    }
+
     virtual int getEventFd() {
         return mEventFd;
     }
 
+    void setVideoStreamer(sp<VideoStreamer> video) {
+        mVideo = video;
+    }
+
+    void setSharedFramebuffer(sp<SharedFramebuffer> shared) {
+        mShared = shared;
+    }
+
+    // 16 captures RGB_565 instead of RGBX_8888, takes effect on the next start()
+    void setCaptureDepth(int depth) {
+        mCaptureDepth = depth;
+    }
+
+    // format the pixel buffer is kept in when capturing RGBX_8888, see
+    // AndroidPixelBuffer::formatByName(). Takes effect on the next start()
+    void setServerFormat(const char* name) {
+        mServerFormat = name;
+    }
+
+    // minimum time between updates of tiles showing video, 0 disables
+    void setVideoTileInterval(int ms) {
+        mBaseVideoTileInterval = mVideoTileInterval = ms;
+    }
+
+    // copy only what the producer says it redrew in each frame
+    void setSurfaceDamage(bool enabled) {
+        mUseSurfaceDamage = enabled;
+    }
+
+    // frames of |width| x |height| made up at |fps|, or replayed from the
+    // raw frames in |replayPath|, instead of capturing the display. Takes
+    // effect on the next start(), a width of 0 captures the display
+    void setSyntheticFrames(int width, int height, int fps, const char* replayPath) {
+        mSyntheticWidth = width;
+        mSyntheticHeight = height;
+        mSyntheticFps = fps;
+        mSyntheticReplay = replayPath;
+    }
+
+    // write viewer input to |path| instead of injecting it, see
+    // RecordingInputSink. Always the case with synthetic frames
+    void setInputRecording(const char* path) {
+        mInputRecordPath = path;
+    }
+
+    // captures only this part of the display, empty for all of it. The
+    // pixel buffer takes its size and pointer events are mapped into it.
+    // Applies while the display is unrotated, see captureArea(). Needs a
+    // layer stack to project, so it has no effect on displays created by
+    // the Java service
+    void setCaptureRect(const Rect& rect) {
+        mCrop = rect;
+    }
+
+    virtual bool handleTimeout(rfb::Timer* t);
+
+    // backs off frame rate and video tile updates on congested links
+    virtual void onLinkLevelChanged(int level);
+
     virtual void onBufferDimensionsChanged(uint32_t width, uint32_t height);
 
     virtual void onFrameAvailable(const BufferItem& item);
 
     virtual void queryConnection(network::Socket* sock, const char* userName);
 
+    // the display the Java service created, or the layer stack to
+    // project, and how input is injected. From any thread: the values
+    // are handed over under mLock and the service thread applies them
+    void setDisplayProps(int32_t width, int32_t height, int32_t rotation, int32_t layerId,
+                         bool touch, bool relative);
+    // takes what setDisplayProps() handed over, on the service thread
+    void processDisplayProps();
+
 	// Virtual display controller
-	int32_t mLayerId = -1;
     sp<VirtualDisplay> mVirtualDisplay;
+  private:
+    // called with mLock held
+    void applyDisplayProps();
+
+	int32_t mLayerId = -1;
     int32_t _width = 1, _height = 1, _rotation = 0;
 	bool touch = false, relative = false;
-  private:
+
+    struct DisplayProps {
+        int32_t width, height, rotation, layerId;
+        bool touch, relative;
+    };
+    DisplayProps mPendingProps = {};
+    bool mPropsPending = false;
+
     virtual void notify();
 
     virtual status_t updateDisplayInfo(bool force = false);
@@ -77,6 +186,9 @@ class AndroidDesktop : public rfb::SDesktop,
 
     Mutex mLock;
 
+    // guards mVirtualDisplay against getSurfaceProducer()
+    Mutex mSurfaceLock;
+
     uint64_t mFrameNumber;
 
     int mEventFd;
@@ -84,18 +196,105 @@ class AndroidDesktop : public rfb::SDesktop,
     // Server instance
     rfb::VNCServer* mServer;
 
+    // Where frames come from, the virtual display or a synthetic source
+    sp<FrameSource> mFrameSource;
+    int mSyntheticWidth = 0, mSyntheticHeight = 0, mSyntheticFps = 60;
+    std::string mSyntheticReplay;
+
+    // The Java service is told about surface changes
+    bool mJavaSurface;
+
+    // Threads splitting up the per-frame copy
+    sp<WorkerPool> mWorkers;
+
     // Pixel buffer
     sp<AndroidPixelBuffer> mPixels = NULL;
+    int mCaptureDepth = 32;
+    std::string mServerFormat = "rgbx";
+
+    // converts captured rows to the pixel buffer format, null to copy
+    RowConverter mConvert = nullptr;
 	bool frameChanged = false;
 
+    // queued frames released without being copied
+    uint64_t mFramesSkipped = 0;
+    uint64_t mFramesSinceStats = 0;
+
+    // Damage regions the producer queued with each frame, by frame
+    // number, until the frame or a newer one is copied. Filled on
+    // binder threads.
+    bool takeSurfaceDamage(uint64_t frameNumber, rfb::Region* damage);
+    bool mUseSurfaceDamage = false;
+    Mutex mSurfaceDamageLock;
+    std::map<uint64_t, Region> mSurfaceDamage;
+    bool mSurfaceDamageLost = false;
+
+    // the pixel buffer does not hold the previous frame, so the next one
+    // is copied in full whatever its damage
+    bool mFullCopy = true;
+
+    // statistics
+    uint64_t mPartialFrames = 0;
+    uint64_t mFullFrames = 0;
+    uint64_t mPixelsNotCopied = 0;
+
+    // Which tiles changed, to tell the classifier. Only kept while
+    // something uses the labels.
+    DamageTracker mDamage;
+    bool classifying() {
+        return mVideoTileInterval > 0;
+    }
+
+    // Per-tile content labels, video tiles are sent at a reduced rate
+    TileClassifier mClassifier;
+    int mVideoTileInterval = 0;
+    int mBaseVideoTileInterval = 0;
+    int mBaseFrameRate = 0;
+    rfb::Region mDeferred;
+    rfb::Timer mDeferTimer;
+
+    // Minimum time between frames while the link is congested, 0 leaves
+    // the rate to the server. The timer brings the service loop back
+    // for a frame held back.
+    int mFrameInterval = 0;
+    nsecs_t mLastFrameTime = 0;
+    rfb::Timer mFrameTimer;
+
+    // Optional VP8 side channel
+    sp<VideoStreamer> mVideo;
+
+    // Optional shared memory side channel for local clients
+    sp<SharedFramebuffer> mShared;
+
+    // start() calls not yet matched by stop()
+    int mStartCount = 0;
+
 	bool clipboardChanged = false;
 
+    // clipboard text from the Java service, for the viewers that asked
+    Mutex mClipboardLock;
+    bool clipboardReplied = false;
+    std::string mClipboardReply;
+
+    // when the capture last changed size, until its first frame
+    nsecs_t mResizeStart = 0;
+
+    // what the input device was last configured for
+    ui::Size mInputMode = {};
+    bool mInputTouch = false, mInputRelative = false;
+
 	// Primary display
     ui::Size mDisplayMode = {};
     ui::Rotation mDisplayState = {};
 
-    // Virtual input device
-    sp<InputDevice> mInputDevice;
+    // Part of it that is captured, and the size of that part
+    Rect mCrop;
+    Rect mCaptureRect;
+    ui::Size mCaptureMode = {};
+
+    // Virtual input device, or a recording of the input
+    sp<InputSink> mInputDevice;
+    std::string mInputRecordPath;
 
 	bool cursorChanged = false;
 	uint32_t cur_width, cur_height;
@@ -18,16 +18,21 @@
 #define LOG_TAG "VNCFlinger:AndroidPixelBuffer"
 #include <utils/Log.h>
 
+#include <string.h>
+
 #include "AndroidPixelBuffer.h"
 
 using namespace vncflinger;
 using namespace android;
 
 const rfb::PixelFormat AndroidPixelBuffer::sRGBX(32, 24, false, true, 255, 255, 255, 0, 8, 16);
+const rfb::PixelFormat AndroidPixelBuffer::sBGRX(32, 24, false, true, 255, 255, 255, 16, 8, 0);
+const rfb::PixelFormat AndroidPixelBuffer::sRGB565(16, 16, false, true, 31, 63, 31, 11, 5, 0);
+const rfb::PixelFormat AndroidPixelBuffer::sRGB332(8, 8, false, true, 7, 7, 3, 5, 2, 0);
 
-AndroidPixelBuffer::AndroidPixelBuffer()
+AndroidPixelBuffer::AndroidPixelBuffer(const rfb::PixelFormat& pf)
     : ManagedPixelBuffer(), mRotated(false), mScaleX(1.0f), mScaleY(1.0f) {
-    setPF(sRGBX);
+    setPF(pf);
     setSize(0, 0);
 }
 
@@ -111,6 +116,22 @@ void AndroidPixelBuffer::setDisplayInfo(ui::Size* mode, ui::Rotation* state, boo
     }
 }
 
+const rfb::PixelFormat* AndroidPixelBuffer::formatByName(const char* name) {
+    if (strcmp(name, "rgbx") == 0) {
+        return &sRGBX;
+    }
+    if (strcmp(name, "bgrx") == 0) {
+        return &sBGRX;
+    }
+    if (strcmp(name, "rgb565") == 0) {
+        return &sRGB565;
+    }
+    if (strcmp(name, "rgb332") == 0) {
+        return &sRGB332;
+    }
+    return nullptr;
+}
+
 Rect AndroidPixelBuffer::getSourceRect() {
     return Rect(mSourceWidth, mSourceHeight);
 }
@@ -34,7 +34,7 @@ namespace vncflinger {
 
 class AndroidPixelBuffer : public RefBase, public rfb::ManagedPixelBuffer {
   public:
-    AndroidPixelBuffer();
+    AndroidPixelBuffer(const rfb::PixelFormat& pf = sRGBX);
 
     virtual void setDisplayInfo(ui::Size* mode, ui::Rotation* state, bool force = false);
 
@@ -61,6 +61,16 @@ class AndroidPixelBuffer : public RefBase, public rfb::ManagedPixelBuffer {
 
     void reset();
 
+    // RGBX_8888 is what the virtual display produces by default. The
+    // others are what the capture copy can convert to, see ColorConvert.
+    static const rfb::PixelFormat sRGBX;
+    static const rfb::PixelFormat sBGRX;
+    static const rfb::PixelFormat sRGB565;
+    static const rfb::PixelFormat sRGB332;
+
+    // format for a name accepted by rgbxRowConverter(), or null
+    static const rfb::PixelFormat* formatByName(const char* name);
+
   private:
     static bool isDisplayRotated(ui::Rotation orientation);
 
@@ -84,9 +94,6 @@ class AndroidPixelBuffer : public RefBase, public rfb::ManagedPixelBuffer {
 
     // callback when buffer size changes
     BufferDimensionsListener* mListener;
-
-    // Android virtual display is always 32-bit
-    static const rfb::PixelFormat sRGBX;
 };
 };
 
@@ -5,10 +5,26 @@
 #include <sys/stat.h>
 #include <sys/socket.h>
 #include <sys/un.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
 #include <unistd.h>
 #include <errno.h>
+#include <fcntl.h>
 #include <stdlib.h>
 #include <stddef.h>
+#include <strings.h>
+#include <inttypes.h>
+#include <sys/ioctl.h>
+
+#include <algorithm>
+
+#include <linux/errqueue.h>
+
+#include <openssl/base64.h>
+#include <openssl/sha.h>
+
+#define LOG_TAG "VNCFlinger:AndroidSocket"
+#include <utils/Log.h>
 
 using namespace vncflinger;
 
@@ -75,4 +91,581 @@ network::Socket* AbsUnixListener::createSocket(int fd) {
 
 int AbsUnixListener::getMyPort() {
 	return 0;
-}
\ No newline at end of file
+}
+
+// RFC 6455 section 1.3
+static const char* kWebSocketGuid = "258EAFA5-E914-47DA-95CA-C5AB0DC85B11";
+
+// an HTTP request larger than this is not a WebSocket upgrade
+static const size_t kMaxHandshake = 8192;
+
+// frames from browsers are small input events, anything this large is
+// garbage
+static const uint64_t kMaxFrame = 16 * 1024 * 1024;
+
+// stop reading a side while this much is waiting for the other
+static const size_t kMaxPending = 1024 * 1024;
+
+static const size_t kReadSize = 64 * 1024;
+
+// below this the page pinning and completion costs more than the copy
+static const size_t kZeroCopyMin = 32 * 1024;
+
+// after this many completions, give up on zerocopy for a connection if
+// the kernel copied most of them anyway (loopback, some NICs)
+static const uint64_t kZeroCopyProbe = 64;
+
+enum {
+	kOpContinuation = 0x0,
+	kOpText = 0x1,
+	kOpBinary = 0x2,
+	kOpClose = 0x8,
+	kOpPing = 0x9,
+	kOpPong = 0xa,
+};
+
+static void setNonBlocking(int fd) {
+	fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+}
+
+// XOR the payload with the 4-byte key, eight bytes at a time. the
+// key phase repeats every 4 bytes, so a doubled key lines up with
+// every 8-byte step
+static void unmask(uint8_t* data, size_t len, const uint8_t* key) {
+	uint32_t k32;
+	memcpy(&k32, key, sizeof(k32));
+	const uint64_t k64 = ((uint64_t)k32 << 32) | k32;
+
+	size_t i = 0;
+	for (; i + 8 <= len; i += 8) {
+		uint64_t v;
+		memcpy(&v, data + i, sizeof(v));
+		v ^= k64;
+		memcpy(data + i, &v, sizeof(v));
+	}
+	for (; i < len; i++) {
+		data[i] ^= key[i & 3];
+	}
+}
+
+// value of an HTTP header, names compared case insensitively
+static std::string headerValue(const std::string& request, const char* name) {
+	size_t nameLen = strlen(name);
+	size_t pos = request.find("\r\n");
+	while (pos != std::string::npos && pos + 2 < request.size()) {
+		size_t line = pos + 2;
+		size_t end = request.find("\r\n", line);
+		if (end == std::string::npos || end == line)
+			break;
+		if (end - line > nameLen && request[line + nameLen] == ':' &&
+		    strncasecmp(request.c_str() + line, name, nameLen) == 0) {
+			size_t v = line + nameLen + 1;
+			while (v < end && request[v] == ' ')
+				v++;
+			return request.substr(v, end - v);
+		}
+		pos = end;
+	}
+	return "";
+}
+
+// whether a comma separated header value lists |token|, ignoring case
+static bool headerHasToken(const std::string& value, const char* token) {
+	size_t tokenLen = strlen(token);
+	size_t pos = 0;
+	while (pos <= value.size()) {
+		size_t end = value.find(',', pos);
+		if (end == std::string::npos)
+			end = value.size();
+		size_t b = pos, e = end;
+		while (b < e && value[b] == ' ')
+			b++;
+		while (e > b && value[e - 1] == ' ')
+			e--;
+		if (e - b == tokenLen && strncasecmp(value.c_str() + b, token, tokenLen) == 0)
+			return true;
+		pos = end + 1;
+	}
+	return false;
+}
+
+// host of "scheme://host[:port][/...]" or "host[:port]", lower case
+static std::string hostOf(const std::string& s) {
+	size_t start = s.find("://");
+	start = start == std::string::npos ? 0 : start + 3;
+	size_t end = s.find('/', start);
+	std::string host = s.substr(start, end == std::string::npos ? std::string::npos : end - start);
+
+	if (!host.empty() && host[0] == '[') {
+		// IPv6 literal
+		size_t close = host.find(']');
+		host = host.substr(0, close == std::string::npos ? std::string::npos : close + 1);
+	} else {
+		size_t colon = host.find(':');
+		if (colon != std::string::npos)
+			host.erase(colon);
+	}
+	std::transform(host.begin(), host.end(), host.begin(), ::tolower);
+	return host;
+}
+
+WebSocketListener::WebSocketListener(int port, bool localhostOnly, bool zeroCopy,
+                                     const char* allowedOrigins)
+	: mPort(port), mZeroCopy(zeroCopy)
+{
+	struct sockaddr_in addr;
+	int one = 1;
+
+	std::string origins(allowedOrigins != NULL ? allowedOrigins : "");
+	size_t pos = 0;
+	while (pos < origins.size()) {
+		size_t end = origins.find(',', pos);
+		if (end == std::string::npos)
+			end = origins.size();
+		std::string origin = origins.substr(pos, end - pos);
+		origin.erase(0, origin.find_first_not_of(' '));
+		origin.erase(origin.find_last_not_of(' ') + 1);
+		if (!origin.empty())
+			mAllowedOrigins.push_back(origin);
+		pos = end + 1;
+	}
+
+	if ((fd = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0)) < 0)
+		throw network::SocketException("unable to create listening socket", errno);
+
+	setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+
+	memset(&addr, 0, sizeof(addr));
+	addr.sin_family = AF_INET;
+	addr.sin_port = htons(port);
+	addr.sin_addr.s_addr = htonl(localhostOnly ? INADDR_LOOPBACK : INADDR_ANY);
+	if (bind(fd, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
+		int e = errno;
+		close(fd);
+		throw network::SocketException("unable to bind listening socket", e);
+	}
+
+	listen(fd);
+}
+
+WebSocketListener::~WebSocketListener()
+{
+	for (auto& conn : mConnections) {
+		close(conn.wsFd);
+		close(conn.pairFd);
+	}
+	close(fd);
+}
+
+int WebSocketListener::getMyPort() {
+	return mPort;
+}
+
+WebSocketListener::Connection* WebSocketListener::findConnection(network::Socket* sock) {
+	for (auto& conn : mConnections) {
+		if (conn.serverFd == sock->getFd())
+			return &conn;
+	}
+	return NULL;
+}
+
+int WebSocketListener::relayFd(network::Socket* sock) {
+	Connection* conn = findConnection(sock);
+	return conn != NULL ? conn->wsFd : -1;
+}
+
+size_t WebSocketListener::relayPending(network::Socket* sock) {
+	Connection* conn = findConnection(sock);
+	if (conn == NULL)
+		return 0;
+
+	// what the server wrote and we did not read yet, then what we did
+	// not get out to the browser
+	int queued = 0;
+	if (ioctl(conn->pairFd, FIONREAD, &queued) < 0)
+		queued = 0;
+	return queued + pendingToWs(*conn);
+}
+
+network::Socket* WebSocketListener::createSocket(int fd) {
+	int pair[2];
+	if (socketpair(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0, pair) < 0) {
+		ALOGE("Failed to create socket pair: %s", strerror(errno));
+		close(fd);
+		return NULL;
+	}
+
+	int one = 1;
+	setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+	setNonBlocking(fd);
+	setNonBlocking(pair[1]);
+
+	Connection conn;
+	conn.wsFd = fd;
+	conn.pairFd = pair[1];
+	conn.serverFd = pair[0];
+	conn.upgraded = false;
+	conn.closing = false;
+	conn.zeroCopy = mZeroCopy &&
+	                setsockopt(fd, SOL_SOCKET, SO_ZEROCOPY, &one, sizeof(one)) == 0;
+	conn.sendingBytes = 0;
+	conn.nextId = 0;
+	conn.waitingForCompletion = false;
+	conn.bytesOut = 0;
+	conn.zeroCopyBytes = 0;
+	conn.completions = 0;
+	conn.copied = 0;
+	mConnections.push_back(conn);
+
+	return new network::UnixSocket(pair[0]);
+}
+
+void WebSocketListener::setFds(fd_set* rfds, fd_set* wfds) {
+	for (auto& conn : mConnections) {
+		// completions arrive on the error queue, which polls readable
+		if ((!conn.closing && conn.toServer.size() < kMaxPending) || !conn.inFlight.empty())
+			FD_SET(conn.wsFd, rfds);
+		if (conn.upgraded && !conn.closing && pendingToWs(conn) < kMaxPending)
+			FD_SET(conn.pairFd, rfds);
+		if (pendingToWs(conn) > 0 && !conn.waitingForCompletion)
+			FD_SET(conn.wsFd, wfds);
+		if (!conn.toServer.empty())
+			FD_SET(conn.pairFd, wfds);
+	}
+}
+
+void WebSocketListener::processSockets(fd_set* rfds, fd_set* wfds) {
+	for (auto it = mConnections.begin(); it != mConnections.end();) {
+		Connection& conn = *it;
+		bool ok = true;
+
+		if (!conn.inFlight.empty())
+			reapCompletions(conn);
+		if (FD_ISSET(conn.wsFd, rfds) && !conn.closing)
+			ok = readWs(conn);
+		if (ok && conn.upgraded && FD_ISSET(conn.pairFd, rfds))
+			ok = readServer(conn);
+		if (ok && !conn.toServer.empty())
+			ok = flush(conn.pairFd, conn.toServer);
+		if (ok && pendingToWs(conn) > 0 && !conn.waitingForCompletion)
+			ok = flushWs(conn);
+
+		// zerocopy buffers must outlive the send, unless the socket
+		// is broken anyway
+		if (!ok || (conn.closing && pendingToWs(conn) == 0 && conn.inFlight.empty())) {
+			if (conn.upgraded) {
+				ALOGI("WebSocket client gone: %" PRIu64 " bytes out, %" PRIu64
+				      " zerocopy, %" PRIu64 "/%" PRIu64 " completions copied",
+				      conn.bytesOut, conn.zeroCopyBytes, conn.copied, conn.completions);
+			}
+			// closing our end makes the server drop its side
+			close(conn.wsFd);
+			close(conn.pairFd);
+			it = mConnections.erase(it);
+		} else {
+			it++;
+		}
+	}
+}
+
+bool WebSocketListener::readWs(Connection& conn) {
+	char buf[kReadSize];
+	ssize_t n = recv(conn.wsFd, buf, sizeof(buf), 0);
+	if (n < 0)
+		return errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR;
+	if (n == 0)
+		return false;
+
+	conn.fromWs.append(buf, n);
+	if (!conn.upgraded)
+		return handshake(conn);
+	return parseFrames(conn);
+}
+
+bool WebSocketListener::readServer(Connection& conn) {
+	char buf[kReadSize];
+	ssize_t n = recv(conn.pairFd, buf, sizeof(buf), 0);
+	if (n < 0)
+		return errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR;
+	if (n == 0) {
+		// server closed the connection, say goodbye properly
+		const char status[2] = { 0x03, (char)0xe8 };
+		queueFrame(conn, kOpClose, status, sizeof(status));
+		conn.closing = true;
+		return true;
+	}
+
+	queueFrame(conn, kOpBinary, buf, n);
+	return true;
+}
+
+bool WebSocketListener::handshake(Connection& conn) {
+	size_t end = conn.fromWs.find("\r\n\r\n");
+	if (end == std::string::npos)
+		return conn.fromWs.size() < kMaxHandshake;
+
+	std::string request = conn.fromWs.substr(0, end + 2);
+	conn.fromWs.erase(0, end + 4);
+
+	std::string key = headerValue(request, "Sec-WebSocket-Key");
+	if (request.compare(0, 4, "GET ") != 0 || key.empty() ||
+	    !headerHasToken(headerValue(request, "Upgrade"), "websocket") ||
+	    !headerHasToken(headerValue(request, "Connection"), "upgrade")) {
+		ALOGW("Rejecting non-WebSocket request");
+		reject(conn, "400 Bad Request", "");
+		return true;
+	}
+
+	if (headerValue(request, "Sec-WebSocket-Version") != "13") {
+		ALOGW("Rejecting WebSocket version \"%s\"",
+		      headerValue(request, "Sec-WebSocket-Version").c_str());
+		reject(conn, "426 Upgrade Required", "Sec-WebSocket-Version: 13\r\n");
+		return true;
+	}
+
+	std::string origin = headerValue(request, "Origin");
+	if (!origin.empty() && !originAllowed(origin, headerValue(request, "Host"))) {
+		ALOGW("Rejecting WebSocket request from origin %s", origin.c_str());
+		reject(conn, "403 Forbidden", "");
+		return true;
+	}
+
+	key += kWebSocketGuid;
+	uint8_t digest[SHA_DIGEST_LENGTH];
+	SHA1((const uint8_t*)key.data(), key.size(), digest);
+	uint8_t accept[4 * ((SHA_DIGEST_LENGTH + 2) / 3) + 1];
+	EVP_EncodeBlock(accept, digest, SHA_DIGEST_LENGTH);
+
+	conn.toWs = "HTTP/1.1 101 Switching Protocols\r\n"
+	            "Upgrade: websocket\r\n"
+	            "Connection: Upgrade\r\n"
+	            "Sec-WebSocket-Accept: ";
+	conn.toWs += (const char*)accept;
+	conn.toWs += "\r\n";
+	if (headerValue(request, "Sec-WebSocket-Protocol").find("binary") != std::string::npos)
+		conn.toWs += "Sec-WebSocket-Protocol: binary\r\n";
+	conn.toWs += "\r\n";
+
+	conn.upgraded = true;
+	ALOGI("WebSocket client connected");
+	return parseFrames(conn);
+}
+
+void WebSocketListener::reject(Connection& conn, const char* status, const char* headers) {
+	conn.toWs = "HTTP/1.1 ";
+	conn.toWs += status;
+	conn.toWs += "\r\nConnection: close\r\n";
+	conn.toWs += headers;
+	conn.toWs += "\r\n";
+	conn.closing = true;
+}
+
+// a page served by the host the browser connected to is fine, others
+// must be listed: a page from anywhere could otherwise drive a viewer
+// to a device on the user's network
+bool WebSocketListener::originAllowed(const std::string& origin, const std::string& host) {
+	if (!host.empty() && hostOf(origin) == hostOf(host))
+		return true;
+
+	for (const std::string& allowed : mAllowedOrigins) {
+		if (allowed == "*" || strcasecmp(allowed.c_str(), origin.c_str()) == 0)
+			return true;
+	}
+	return false;
+}
+
+bool WebSocketListener::parseFrames(Connection& conn) {
+	size_t pos = 0;
+
+	while (!conn.closing) {
+		const size_t avail = conn.fromWs.size() - pos;
+		uint8_t* p = (uint8_t*)&conn.fromWs[pos];
+		if (avail < 2)
+			break;
+
+		const int opcode = p[0] & 0x0f;
+		const bool masked = p[1] & 0x80;
+		uint64_t len = p[1] & 0x7f;
+		size_t header = 2;
+		if (len == 126) {
+			if (avail < 4)
+				break;
+			len = ((uint64_t)p[2] << 8) | p[3];
+			header = 4;
+		} else if (len == 127) {
+			if (avail < 10)
+				break;
+			len = 0;
+			for (int i = 0; i < 8; i++)
+				len = (len << 8) | p[2 + i];
+			header = 10;
+		}
+
+		// clients must mask, and only binary data is RFB
+		if (!masked || len > kMaxFrame) {
+			ALOGW("Bad WebSocket frame, closing");
+			return false;
+		}
+		if (avail < header + 4 + len)
+			break;
+
+		uint8_t* payload = p + header + 4;
+		unmask(payload, len, p + header);
+
+		switch (opcode) {
+			case kOpContinuation:
+			case kOpBinary:
+				conn.toServer.append((const char*)payload, len);
+				break;
+			case kOpClose:
+				queueFrame(conn, kOpClose, (const char*)payload, std::min<uint64_t>(len, 2));
+				conn.closing = true;
+				break;
+			case kOpPing:
+				queueFrame(conn, kOpPong, (const char*)payload, len);
+				break;
+			case kOpPong:
+				break;
+			default:
+				ALOGW("Unsupported WebSocket opcode %d, closing", opcode);
+				return false;
+		}
+
+		pos += header + 4 + len;
+	}
+
+	conn.fromWs.erase(0, pos);
+	return true;
+}
+
+// server to client frames are never masked
+void WebSocketListener::queueFrame(Connection& conn, int opcode, const char* data, size_t len) {
+	uint8_t header[10];
+	size_t headerLen = 2;
+
+	header[0] = 0x80 | opcode;
+	if (len < 126) {
+		header[1] = len;
+	} else if (len <= 0xffff) {
+		header[1] = 126;
+		header[2] = len >> 8;
+		header[3] = len;
+		headerLen = 4;
+	} else {
+		header[1] = 127;
+		for (int i = 0; i < 8; i++)
+			header[2 + i] = (uint64_t)len >> (56 - 8 * i);
+		headerLen = 10;
+	}
+
+	conn.toWs.append((const char*)header, headerLen);
+	conn.toWs.append(data, len);
+}
+
+bool WebSocketListener::flushWs(Connection& conn) {
+	while (true) {
+		// older zerocopy chunks go first
+		while (!conn.sending.empty()) {
+			Chunk& chunk = conn.sending.front();
+			const size_t left = chunk.data->size() - chunk.offset;
+			bool zeroCopy = true;
+			ssize_t n = send(conn.wsFd, chunk.data->data() + chunk.offset, left,
+			                 MSG_DONTWAIT | MSG_NOSIGNAL | MSG_ZEROCOPY);
+			if (n < 0 && errno == ENOBUFS) {
+				// out of pinned page budget. the socket may well be
+				// writable, so leave it out of the write set until a
+				// completion gives some back
+				if (!conn.inFlight.empty()) {
+					conn.waitingForCompletion = true;
+					return true;
+				}
+				// nothing to wait for, copy this one
+				zeroCopy = false;
+				n = send(conn.wsFd, chunk.data->data() + chunk.offset, left,
+				         MSG_DONTWAIT | MSG_NOSIGNAL);
+			}
+			if (n < 0)
+				return errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR;
+
+			// every successful zerocopy call gets its own completion id
+			if (zeroCopy) {
+				InFlight sent = { conn.nextId++, chunk.data };
+				conn.inFlight.push_back(sent);
+				conn.zeroCopyBytes += n;
+			}
+			conn.bytesOut += n;
+			conn.sendingBytes -= n;
+			chunk.offset += n;
+			if ((size_t)n < left)
+				return true;
+			conn.sending.pop_front();
+		}
+
+		if (conn.toWs.empty())
+			return true;
+		if (!conn.zeroCopy || conn.toWs.size() < kZeroCopyMin) {
+			size_t before = conn.toWs.size();
+			bool ok = flush(conn.wsFd, conn.toWs);
+			conn.bytesOut += before - conn.toWs.size();
+			return ok;
+		}
+
+		// hand the whole batch over, toWs starts a fresh buffer
+		Chunk chunk = { std::make_shared<std::string>(), 0 };
+		chunk.data->swap(conn.toWs);
+		conn.sendingBytes += chunk.data->size();
+		conn.sending.push_back(chunk);
+	}
+}
+
+void WebSocketListener::reapCompletions(Connection& conn) {
+	while (!conn.inFlight.empty()) {
+		char control[CMSG_SPACE(sizeof(struct sock_extended_err)) + 64];
+		struct msghdr msg = {};
+		msg.msg_control = control;
+		msg.msg_controllen = sizeof(control);
+		if (recvmsg(conn.wsFd, &msg, MSG_ERRQUEUE | MSG_DONTWAIT) < 0)
+			break;
+
+		for (struct cmsghdr* cmsg = CMSG_FIRSTHDR(&msg); cmsg != NULL;
+		     cmsg = CMSG_NXTHDR(&msg, cmsg)) {
+			if (!((cmsg->cmsg_level == SOL_IP && cmsg->cmsg_type == IP_RECVERR) ||
+			      (cmsg->cmsg_level == SOL_IPV6 && cmsg->cmsg_type == IPV6_RECVERR)))
+				continue;
+
+			struct sock_extended_err err;
+			memcpy(&err, CMSG_DATA(cmsg), sizeof(err));
+			if (err.ee_origin != SO_EE_ORIGIN_ZEROCOPY || err.ee_errno != 0)
+				continue;
+
+			// ids [ee_info, ee_data] are done, usually in order
+			const uint32_t lo = err.ee_info, hi = err.ee_data;
+			const uint32_t count = hi - lo + 1;
+			conn.completions += count;
+			if (err.ee_code & SO_EE_CODE_ZEROCOPY_COPIED)
+				conn.copied += count;
+
+			for (auto it = conn.inFlight.begin(); it != conn.inFlight.end();) {
+				if (it->id - lo < count)
+					it = conn.inFlight.erase(it);
+				else
+					it++;
+			}
+			conn.waitingForCompletion = false;
+		}
+	}
+
+	if (conn.zeroCopy && conn.completions >= kZeroCopyProbe &&
+	    conn.copied * 2 > conn.completions) {
+		ALOGI("Kernel copies zerocopy sends on this link, turning it off");
+		conn.zeroCopy = false;
+	}
+}
+
+bool WebSocketListener::flush(int fd, std::string& buf) {
+	ssize_t n = send(fd, buf.data(), buf.size(), MSG_DONTWAIT | MSG_NOSIGNAL);
+	if (n < 0)
+		return errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR;
+	buf.erase(0, n);
+	return true;
+}
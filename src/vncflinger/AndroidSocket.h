@@ -1,8 +1,20 @@
 #ifndef __ANDROID_SOCKET_H__
 #define __ANDROID_SOCKET_H__
 
+#include <sys/select.h>
+
+#include <stdint.h>
+
+#include <deque>
+#include <list>
+#include <memory>
+#include <string>
+#include <vector>
+
 #include <network/Socket.h>
 
+#include "ConnectionMonitor.h"
+
 namespace vncflinger {
 
 class AndroidListener : public network::SocketListener {
@@ -27,6 +39,103 @@ class AndroidListener : public network::SocketListener {
         virtual network::Socket* createSocket(int fd);
     };
 
+  // Accepts WebSocket (RFC 6455) connections on a TCP port so browser
+  // viewers like noVNC can connect without a websockify proxy. Each
+  // connection is handed to the server as one end of a socket pair;
+  // the listener does the HTTP upgrade and the framing between the
+  // browser and the other end from the service loop.
+  //
+  // Browsers send the page's Origin. A page from another host than the
+  // one the browser connected to is only let in when |allowedOrigins|
+  // (comma separated, "*" for any) lists it. Clients without an Origin
+  // are not browsers and are accepted.
+  //
+  // With |zeroCopy|, large batches for the browser are sent with
+  // MSG_ZEROCOPY and kept alive until the kernel reports completion.
+  // That only saves the copy into the kernel: the data was already
+  // copied twice in userspace, read from the pair and framed into toWs.
+  // tests/ZeroCopyBenchmark.cpp measures both on loopback.
+  class WebSocketListener : public network::SocketListener,
+                            public ConnectionMonitor::Relay {
+    public:
+        WebSocketListener(int port, bool localhostOnly, bool zeroCopy,
+                          const char* allowedOrigins);
+        virtual ~WebSocketListener();
+
+        int getMyPort();
+
+        // the browser's TCP connection behind a socket we handed out
+        virtual int relayFd(network::Socket* sock);
+        virtual size_t relayPending(network::Socket* sock);
+
+        // add connection fds for select() and service them afterwards
+        void setFds(fd_set* rfds, fd_set* wfds);
+        void processSockets(fd_set* rfds, fd_set* wfds);
+
+    protected:
+        virtual network::Socket* createSocket(int fd);
+
+    private:
+        typedef std::shared_ptr<std::string> Buffer;
+
+        struct Chunk {
+            Buffer data;
+            size_t offset;
+        };
+
+        struct InFlight {
+            uint32_t id;    // zerocopy send counter of the socket
+            Buffer data;
+        };
+
+        struct Connection {
+            int wsFd;       // browser
+            int pairFd;     // our end of the server's socket
+            int serverFd;   // the server's end
+            bool upgraded;
+            bool closing;
+            std::string fromWs;     // raw bytes from the browser
+            std::string toWs;       // framed bytes for the browser
+            std::string toServer;   // payload for the server
+
+            // zerocopy sends, older than anything in toWs. After ENOBUFS
+            // the socket waits for a completion, not for writability
+            bool zeroCopy;
+            std::deque<Chunk> sending;
+            size_t sendingBytes;
+            std::deque<InFlight> inFlight;
+            uint32_t nextId;
+            bool waitingForCompletion;
+
+            // statistics
+            uint64_t bytesOut;
+            uint64_t zeroCopyBytes;
+            uint64_t completions;
+            uint64_t copied;
+        };
+
+        size_t pendingToWs(const Connection& conn) {
+            return conn.toWs.size() + conn.sendingBytes;
+        }
+
+        bool readWs(Connection& conn);
+        bool readServer(Connection& conn);
+        bool handshake(Connection& conn);
+        void reject(Connection& conn, const char* status, const char* headers);
+        bool originAllowed(const std::string& origin, const std::string& host);
+        Connection* findConnection(network::Socket* sock);
+        bool parseFrames(Connection& conn);
+        void queueFrame(Connection& conn, int opcode, const char* data, size_t len);
+        bool flushWs(Connection& conn);
+        void reapCompletions(Connection& conn);
+        static bool flush(int fd, std::string& buf);
+
+        int mPort;
+        bool mZeroCopy;
+        std::vector<std::string> mAllowedOrigins;
+        std::list<Connection> mConnections;
+    };
+
 }
 
 #endif
@@ -0,0 +1,46 @@
+//
+// vncflinger - Copyright (C) 2021 Stefanie Kondik
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+//
+
+#include <algorithm>
+
+#include "CaptureArea.h"
+
+using namespace vncflinger;
+
+Rect vncflinger::captureArea(const Rect& crop, const ui::Size& mode, ui::Rotation rotation) {
+    if (rotation != ui::ROTATION_0) {
+        return Rect();
+    }
+
+    Rect area(std::max(crop.left, 0), std::max(crop.top, 0), std::min(crop.right, mode.width),
+              std::min(crop.bottom, mode.height));
+    if (area.left >= area.right || area.top >= area.bottom) {
+        return Rect();
+    }
+    return area;
+}
+
+void vncflinger::mapPointer(const Rect& area, const ui::Size& mode, uint32_t viewWidth,
+                            uint32_t viewHeight, int x, int y, uint32_t* outX, uint32_t* outY) {
+    if (area.isEmpty()) {
+        *outX = x * mode.width / (float)viewWidth;
+        *outY = y * mode.height / (float)viewHeight;
+    } else {
+        *outX = area.left + x * area.getWidth() / (float)viewWidth;
+        *outY = area.top + y * area.getHeight() / (float)viewHeight;
+    }
+}
@@ -0,0 +1,45 @@
+//
+// vncflinger - Copyright (C) 2021 Stefanie Kondik
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+//
+
+#ifndef CAPTURE_AREA_H_
+#define CAPTURE_AREA_H_
+
+#include <stdint.h>
+
+#include <ui/Rect.h>
+#include <ui/Rotation.h>
+#include <ui/Size.h>
+
+using namespace android;
+
+namespace vncflinger {
+
+// Clips the capturerect |crop| to a display of |mode| shown at
+// |rotation|. Empty, for all of the display, if nothing is left or the
+// display is rotated: the crop is given as the display is shown, but
+// the input device takes positions in the natural orientation, and only
+// ROTATION_0 puts both in the same place.
+Rect captureArea(const Rect& crop, const ui::Size& mode, ui::Rotation rotation);
+
+// Maps |x|,|y| in a viewport of |viewWidth|x|viewHeight| that shows
+// |area| of a display of |mode| to input device coordinates, which span
+// the whole display. An empty |area| is all of the display.
+void mapPointer(const Rect& area, const ui::Size& mode, uint32_t viewWidth, uint32_t viewHeight,
+                int x, int y, uint32_t* outX, uint32_t* outY);
+};
+
+#endif
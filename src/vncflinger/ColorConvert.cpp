@@ -0,0 +1,107 @@
+//
+// vncflinger - Copyright (C) 2021 Stefanie Kondik
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+//
+
+#include <string.h>
+
+#include "ColorConvert.h"
+
+using namespace vncflinger;
+
+// The loops below are kept branch free with fixed point math and 4-byte
+// interleaved loads so the compiler turns them into NEON (vld4) or SSE
+// code at -Ofast.
+
+static inline void lumaRow(const uint8_t* __restrict src, int width, uint8_t* __restrict y) {
+    for (int x = 0; x < width; x++) {
+        int r = src[x * 4 + 0];
+        int g = src[x * 4 + 1];
+        int b = src[x * 4 + 2];
+        y[x] = (uint8_t)(((66 * r + 129 * g + 25 * b + 128) >> 8) + 16);
+    }
+}
+
+static inline void chromaRow(const uint8_t* __restrict row0, const uint8_t* __restrict row1,
+                             int width, uint8_t* __restrict u, uint8_t* __restrict v) {
+    for (int x = 0; x < width / 2; x++) {
+        // average of the 2x2 block
+        int r = row0[x * 8 + 0] + row0[x * 8 + 4] + row1[x * 8 + 0] + row1[x * 8 + 4];
+        int g = row0[x * 8 + 1] + row0[x * 8 + 5] + row1[x * 8 + 1] + row1[x * 8 + 5];
+        int b = row0[x * 8 + 2] + row0[x * 8 + 6] + row1[x * 8 + 2] + row1[x * 8 + 6];
+        u[x] = (uint8_t)(((-38 * r - 74 * g + 112 * b + 512) >> 10) + 128);
+        v[x] = (uint8_t)(((112 * r - 94 * g - 18 * b + 512) >> 10) + 128);
+    }
+}
+
+void vncflinger::rgbxToI420(const uint8_t* src, int srcStride, int width, int y0, int y1,
+                            uint8_t* dstY, int strideY, uint8_t* dstU, uint8_t* dstV,
+                            int strideUV) {
+    for (int y = y0; y < y1; y += 2) {
+        const uint8_t* row0 = src + y * srcStride;
+        const uint8_t* row1 = row0 + srcStride;
+
+        lumaRow(row0, width, dstY + y * strideY);
+        lumaRow(row1, width, dstY + (y + 1) * strideY);
+        chromaRow(row0, row1, width, dstU + (y / 2) * strideUV, dstV + (y / 2) * strideUV);
+    }
+}
+
+void vncflinger::rgbxToBgrxRow(const uint8_t* __restrict src, uint8_t* __restrict dst,
+                               int width) {
+    // a pixel at a time as a little endian word, which vectorizes where
+    // the byte stores do not
+    for (int x = 0; x < width; x++) {
+        uint32_t v;
+        memcpy(&v, src + x * 4, sizeof(v));
+        v = ((v & 0xff) << 16) | (v & 0xff00) | ((v >> 16) & 0xff);
+        memcpy(dst + x * 4, &v, sizeof(v));
+    }
+}
+
+void vncflinger::rgbxToRgb565Row(const uint8_t* __restrict src, uint8_t* __restrict dst,
+                                 int width) {
+    for (int x = 0; x < width; x++) {
+        int r = src[x * 4 + 0];
+        int g = src[x * 4 + 1];
+        int b = src[x * 4 + 2];
+        int v = ((r >> 3) << 11) | ((g >> 2) << 5) | (b >> 3);
+        dst[x * 2 + 0] = (uint8_t)v;
+        dst[x * 2 + 1] = (uint8_t)(v >> 8);
+    }
+}
+
+void vncflinger::rgbxToRgb332Row(const uint8_t* __restrict src, uint8_t* __restrict dst,
+                                 int width) {
+    for (int x = 0; x < width; x++) {
+        int r = src[x * 4 + 0];
+        int g = src[x * 4 + 1];
+        int b = src[x * 4 + 2];
+        dst[x] = (uint8_t)(((r >> 5) << 5) | ((g >> 5) << 2) | (b >> 6));
+    }
+}
+
+RowConverter vncflinger::rgbxRowConverter(const char* format) {
+    if (strcmp(format, "bgrx") == 0) {
+        return rgbxToBgrxRow;
+    }
+    if (strcmp(format, "rgb565") == 0) {
+        return rgbxToRgb565Row;
+    }
+    if (strcmp(format, "rgb332") == 0) {
+        return rgbxToRgb332Row;
+    }
+    return nullptr;
+}
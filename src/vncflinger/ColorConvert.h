@@ -0,0 +1,44 @@
+//
+// vncflinger - Copyright (C) 2021 Stefanie Kondik
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+//
+
+#ifndef COLOR_CONVERT_H_
+#define COLOR_CONVERT_H_
+
+#include <stdint.h>
+
+namespace vncflinger {
+
+// Converts rows [y0, y1) of an RGBX_8888 image (bytes R, G, B, X) to
+// planar BT.601 limited range YUV 4:2:0. |width| and the row range must
+// be even. Strides are in bytes. Row ranges can be converted in parallel.
+void rgbxToI420(const uint8_t* src, int srcStride, int width, int y0, int y1, uint8_t* dstY,
+                int strideY, uint8_t* dstU, uint8_t* dstV, int strideUV);
+
+// Converts one row of |width| RGBX_8888 pixels to another packed format,
+// stored little endian.
+typedef void (*RowConverter)(const uint8_t* src, uint8_t* dst, int width);
+
+void rgbxToBgrxRow(const uint8_t* src, uint8_t* dst, int width);
+void rgbxToRgb565Row(const uint8_t* src, uint8_t* dst, int width);
+void rgbxToRgb332Row(const uint8_t* src, uint8_t* dst, int width);
+
+// Row converter for a named format ("bgrx", "rgb565", "rgb332"), or
+// null if the name is unknown or needs no conversion ("rgbx").
+RowConverter rgbxRowConverter(const char* format);
+};
+
+#endif
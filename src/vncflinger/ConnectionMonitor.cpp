@@ -0,0 +1,203 @@
+//
+// vncflinger - Copyright (C) 2021 Stefanie Kondik
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+//
+
+#define LOG_TAG "VNCFlinger:ConnectionMonitor"
+#include <utils/Log.h>
+
+#include <errno.h>
+#include <inttypes.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <string.h>
+#include <sys/socket.h>
+
+#include <algorithm>
+
+#include "ConnectionMonitor.h"
+
+using namespace vncflinger;
+
+// how often the kernel queues are sampled, and how many samples go
+// into one line of the log
+static const int kSampleIntervalMs = 250;
+static const int kSamplesPerReport = 40;
+
+// a congestion decision is taken once per second. the level rises when
+// a second averages more queue delay than kCongestedDelayMs and falls
+// after kCalmWindows seconds in a row below kClearDelayMs
+static const int kSamplesPerDecision = 4;
+static const uint32_t kCongestedDelayMs = 100;
+static const uint32_t kClearDelayMs = 20;
+static const int kCalmWindows = 3;
+
+ConnectionMonitor::ConnectionMonitor(int notsentLowat)
+    : mNotsentLowat(notsentLowat), mListener(nullptr), mLevel(0), mTimer(this), mTicks(0) {
+}
+
+ConnectionMonitor::~ConnectionMonitor() {
+    mTimer.stop();
+}
+
+void ConnectionMonitor::addSocket(network::Socket* sock, Relay* relay) {
+    Client client = {};
+    client.sock = sock;
+    client.relay = relay;
+
+    // unix sockets (adb forward, control socket) have no TCP_INFO
+    const int fd = tcpFd(client);
+    struct tcp_info info;
+    socklen_t len = sizeof(info);
+    client.tcp = fd >= 0 && getsockopt(fd, IPPROTO_TCP, TCP_INFO, &info, &len) == 0;
+
+    if (client.tcp && mNotsentLowat > 0) {
+        int lowat = mNotsentLowat;
+        if (setsockopt(fd, IPPROTO_TCP, TCP_NOTSENT_LOWAT, &lowat, sizeof(lowat)) < 0) {
+            ALOGW("Failed to set TCP_NOTSENT_LOWAT: %s", strerror(errno));
+        }
+    }
+
+    mClients.push_back(client);
+    if (!mTimer.isStarted()) {
+        mTimer.start(kSampleIntervalMs);
+    }
+}
+
+void ConnectionMonitor::removeSocket(network::Socket* sock) {
+    for (auto it = mClients.begin(); it != mClients.end(); it++) {
+        if (it->sock == sock) {
+            report(*it);
+            mClients.erase(it);
+            break;
+        }
+    }
+    updateLevel();
+
+    if (mClients.empty()) {
+        mTimer.stop();
+    }
+}
+
+int ConnectionMonitor::tcpFd(Client& client) {
+    return client.relay != nullptr ? client.relay->relayFd(client.sock) : client.sock->getFd();
+}
+
+void ConnectionMonitor::sample(Client& client) {
+    const int fd = tcpFd(client);
+    struct tcp_info info;
+    socklen_t len = sizeof(info);
+    memset(&info, 0, sizeof(info));
+    if (fd < 0 || getsockopt(fd, IPPROTO_TCP, TCP_INFO, &info, &len) < 0) {
+        return;
+    }
+
+    // delivery rate needs a 4.9 kernel, fall back to cwnd per rtt
+    uint64_t rate = info.tcpi_delivery_rate;
+    if (rate == 0 && info.tcpi_rtt > 0) {
+        rate = (uint64_t)info.tcpi_snd_cwnd * info.tcpi_snd_mss * 1000000 / info.tcpi_rtt;
+    }
+
+    // TCP_NOTSENT_LOWAT caps what the kernel holds, the rest of the
+    // backlog waits in the server's output stream
+    client.notsent = info.tcpi_notsent_bytes + client.sock->outStream().bufferUsage();
+    if (client.relay != nullptr) {
+        client.notsent += client.relay->relayPending(client.sock);
+    }
+    client.rttUs = info.tcpi_rtt;
+    client.rate = rate;
+    client.queueDelayMs = rate > 0 ? (uint32_t)((uint64_t)client.notsent * 1000 / rate) : 0;
+
+    client.queueDelaySum += client.queueDelayMs;
+    client.queueDelayMax = std::max(client.queueDelayMax, client.queueDelayMs);
+    client.samples++;
+
+    client.windowDelaySum += client.queueDelayMs;
+    if (++client.windowSamples == kSamplesPerDecision) {
+        decide(client);
+    }
+
+    ALOGV("fd %d: %u bytes queued, rtt %u us, queue delay %u ms", client.sock->getFd(),
+          client.notsent, client.rttUs, client.queueDelayMs);
+}
+
+void ConnectionMonitor::report(Client& client) {
+    if (!client.tcp || client.samples == 0) {
+        return;
+    }
+
+    ALOGI("fd %d: queue delay avg %u ms, max %u ms, rtt %u us", client.sock->getFd(),
+          (uint32_t)(client.queueDelaySum / client.samples), client.queueDelayMax, client.rttUs);
+
+    client.queueDelaySum = 0;
+    client.queueDelayMax = 0;
+    client.samples = 0;
+}
+
+void ConnectionMonitor::decide(Client& client) {
+    const uint32_t delay = client.windowDelaySum / client.windowSamples;
+    client.windowDelaySum = 0;
+    client.windowSamples = 0;
+
+    int level = client.level;
+    if (delay > kCongestedDelayMs) {
+        level = std::min(level + 1, kMaxLevel);
+        client.calmWindows = 0;
+    } else if (delay < kClearDelayMs) {
+        if (++client.calmWindows >= kCalmWindows) {
+            level = std::max(level - 1, 0);
+            client.calmWindows = 0;
+        }
+    } else {
+        client.calmWindows = 0;
+    }
+
+    if (level != client.level) {
+        ALOGI("fd %d: queue delay %u ms, %" PRIu64 " kB/s, rtt %u us, level %d -> %d",
+              client.sock->getFd(), delay, client.rate / 1024, client.rttUs, client.level, level);
+        client.level = level;
+    }
+}
+
+void ConnectionMonitor::updateLevel() {
+    int level = 0;
+    for (auto& client : mClients) {
+        level = std::max(level, client.level);
+    }
+
+    if (level != mLevel) {
+        mLevel = level;
+        if (mListener != nullptr) {
+            mListener->onLinkLevelChanged(level);
+        }
+    }
+}
+
+bool ConnectionMonitor::handleTimeout(rfb::Timer* t) {
+    const bool reportNow = ++mTicks % kSamplesPerReport == 0;
+
+    for (auto& client : mClients) {
+        if (!client.tcp || client.sock->isShutdown()) {
+            continue;
+        }
+        sample(client);
+        if (reportNow) {
+            report(client);
+        }
+    }
+    updateLevel();
+
+    return !mClients.empty();
+}
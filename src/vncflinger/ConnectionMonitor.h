@@ -0,0 +1,125 @@
+//
+// vncflinger - Copyright (C) 2021 Stefanie Kondik
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+//
+
+#ifndef CONNECTION_MONITOR_H_
+#define CONNECTION_MONITOR_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include <list>
+
+#include <network/Socket.h>
+#include <rfb/Timer.h>
+
+namespace vncflinger {
+
+// Tunes accepted viewer sockets for latency and keeps an eye on how
+// much of what the server wrote is still waiting to be sent, in the
+// kernel and in the server's output stream.
+//
+// With TCP_NOTSENT_LOWAT the kernel stops taking data once that much is
+// unsent. The server's output stream then keeps the rest, its
+// congestion check sees buffered data and no new update is generated;
+// further damage merges into the next update instead of queueing up
+// behind a stale one.
+//
+// From the same samples every client gets a congestion level: it goes
+// up a step for each second the queue delay stays high and back down
+// after a few calm seconds. The worst level among the clients is handed
+// to a listener, which backs off frame rate and video updates.
+class ConnectionMonitor : public rfb::Timer::Callback {
+  public:
+    static const int kMaxLevel = 3;
+
+    class LinkListener {
+      public:
+        // 0 is an uncongested link, kMaxLevel the most congested
+        virtual void onLinkLevelChanged(int level) = 0;
+        virtual ~LinkListener() {
+        }
+    };
+
+    // A viewer socket whose data someone else relays to the network,
+    // like WebSocketListener. The monitor tunes and samples the TCP
+    // connection behind it and counts what the relay still holds.
+    class Relay {
+      public:
+        // the TCP connection carrying |sock|, -1 once it is gone
+        virtual int relayFd(network::Socket* sock) = 0;
+        // bytes from |sock| not yet written to that connection
+        virtual size_t relayPending(network::Socket* sock) = 0;
+        virtual ~Relay() {
+        }
+    };
+
+    // |notsentLowat| in bytes, 0 leaves the socket default
+    ConnectionMonitor(int notsentLowat);
+
+    virtual ~ConnectionMonitor();
+
+    void setLinkListener(LinkListener* listener) {
+        mListener = listener;
+    }
+
+    void addSocket(network::Socket* sock, Relay* relay = nullptr);
+    void removeSocket(network::Socket* sock);
+
+    virtual bool handleTimeout(rfb::Timer* t);
+
+  private:
+    struct Client {
+        network::Socket* sock;
+        Relay* relay;
+        bool tcp;
+
+        // last sample, notsent counts both queues
+        uint32_t notsent;
+        uint32_t rttUs;
+        uint32_t queueDelayMs;
+        uint64_t rate;
+
+        // congestion estimate
+        int level;
+        uint32_t windowDelaySum;
+        int windowSamples;
+        int calmWindows;
+
+        // since the last report
+        uint64_t queueDelaySum;
+        uint32_t queueDelayMax;
+        int samples;
+    };
+
+    int tcpFd(Client& client);
+    void sample(Client& client);
+    void report(Client& client);
+    void decide(Client& client);
+    void updateLevel();
+
+    int mNotsentLowat;
+    std::list<Client> mClients;
+
+    LinkListener* mListener;
+    int mLevel;
+
+    rfb::Timer mTimer;
+    int mTicks;
+};
+};
+
+#endif
@@ -0,0 +1,124 @@
+//
+// vncflinger - Copyright (C) 2021 Stefanie Kondik
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+//
+
+#define LOG_TAG "VNCFlinger:DamageTracker"
+#include <utils/Log.h>
+
+#include <string.h>
+
+#include <algorithm>
+
+#include "DamageTracker.h"
+
+using namespace vncflinger;
+
+DamageTracker::DamageTracker()
+    : mWidth(0), mHeight(0), mTilesX(0), mTilesY(0), mValid(false) {
+}
+
+void DamageTracker::reset(int width, int height) {
+    mWidth = width;
+    mHeight = height;
+    mTilesX = (width + kTileSize - 1) / kTileSize;
+    mTilesY = (height + kTileSize - 1) / kTileSize;
+    mHashes.assign(mTilesX * mTilesY, 0);
+    mChanged.assign(mTilesX * mTilesY, 1);
+    mValid = false;
+}
+
+uint64_t DamageTracker::hashTile(const uint8_t* data, int stride, int width, int height,
+                                 int bpp) {
+    // 64-bit multiply/xor mix, word at a time. not cryptographic, only
+    // needs to notice that pixels moved
+    const uint64_t kMul = 0x9e3779b97f4a7c15ULL;
+    uint64_t h = 0xcbf29ce484222325ULL;
+    const int rowBytes = width * bpp;
+
+    for (int y = 0; y < height; y++) {
+        const uint8_t* row = data + y * stride * bpp;
+        int x = 0;
+        for (; x + 8 <= rowBytes; x += 8) {
+            uint64_t v;
+            memcpy(&v, row + x, sizeof(v));
+            h = (h ^ v) * kMul;
+            h ^= h >> 29;
+        }
+        for (; x < rowBytes; x++) {
+            h = (h ^ row[x]) * kMul;
+        }
+    }
+    return h;
+}
+
+void DamageTracker::hashTileRow(const rfb::PixelBuffer* pb, const rfb::Rect& area, int tileRow) {
+    const int bpp = pb->getPF().bpp / 8;
+    const int y0 = tileRow * kTileSize;
+    if (y0 >= mHeight || y0 + kTileSize <= area.tl.y || y0 >= area.br.y) {
+        return;
+    }
+
+    for (int tx = area.tl.x / kTileSize; tx * kTileSize < area.br.x && tx < mTilesX; tx++) {
+        rfb::Rect tile = tileRect(tx, tileRow);
+        int stride;
+        const uint8_t* data = pb->getBuffer(tile, &stride);
+        uint64_t h = hashTile(data, stride, tile.width(), tile.height(), bpp);
+
+        int idx = tileRow * mTilesX + tx;
+        mChanged[idx] = !mValid || h != mHashes[idx];
+        mHashes[idx] = h;
+    }
+}
+
+void DamageTracker::clearTileRow(int tileRow) {
+    if (!mValid || tileRow >= mTilesY) {
+        return;
+    }
+    memset(&mChanged[tileRow * mTilesX], 0, mTilesX);
+}
+
+rfb::Rect DamageTracker::tileRect(int tx, int ty) const {
+    return rfb::Rect(tx * kTileSize, ty * kTileSize, std::min((tx + 1) * kTileSize, mWidth),
+                     std::min((ty + 1) * kTileSize, mHeight));
+}
+
+rfb::Region DamageTracker::maskRegion(const std::vector<uint8_t>& mask,
+                                      const rfb::Rect& area) const {
+    rfb::Region region;
+
+    for (int ty = area.tl.y / kTileSize; ty * kTileSize < area.br.y && ty < mTilesY; ty++) {
+        // merge runs of set tiles so the region stays small
+        int runStart = -1;
+        for (int tx = area.tl.x / kTileSize; tx <= mTilesX; tx++) {
+            bool inArea = tx < mTilesX && tx * kTileSize < area.br.x;
+            bool set = inArea && mask[ty * mTilesX + tx];
+            if (set && runStart < 0) {
+                runStart = tx;
+            } else if (!set && runStart >= 0) {
+                region.assign_union(rfb::Region(
+                        rfb::Rect(runStart * kTileSize, ty * kTileSize,
+                                  std::min(tx * kTileSize, mWidth),
+                                  std::min((ty + 1) * kTileSize, mHeight))));
+                runStart = -1;
+            }
+            if (!inArea) {
+                break;
+            }
+        }
+    }
+
+    return region.intersect(rfb::Region(area));
+}
@@ -0,0 +1,96 @@
+//
+// vncflinger - Copyright (C) 2021 Stefanie Kondik
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+//
+
+#ifndef DAMAGE_TRACKER_H_
+#define DAMAGE_TRACKER_H_
+
+#include <stdint.h>
+#include <vector>
+
+#include <rfb/PixelBuffer.h>
+#include <rfb/Rect.h>
+#include <rfb/Region.h>
+
+namespace vncflinger {
+
+// Remembers a content hash for every tile of the framebuffer, to tell
+// which tiles changed since the previous frame. Only a hint for
+// TileClassifier: what is sent to viewers never depends on it, the
+// server compares the pixels itself.
+class DamageTracker {
+  public:
+    static const int kTileSize = 64;
+
+    DamageTracker();
+
+    // forget all hashes, every tile counts as changed in the next frame
+    void reset(int width, int height);
+
+    int width() {
+        return mWidth;
+    }
+
+    int height() {
+        return mHeight;
+    }
+
+    int tilesX() const {
+        return mTilesX;
+    }
+
+    int tilesY() const {
+        return mTilesY;
+    }
+
+    // valid after hashTileRow() ran for the tile's row
+    bool isChanged(int tx, int ty) const {
+        return mChanged[ty * mTilesX + tx];
+    }
+
+    rfb::Rect tileRect(int tx, int ty) const;
+
+    // Hashes the tiles of one row of tiles that overlap |area| and marks
+    // the ones that differ. Rows are independent and may run in parallel.
+    void hashTileRow(const rfb::PixelBuffer* pb, const rfb::Rect& area, int tileRow);
+
+    // Marks the tiles of one row unchanged, for hashTileRow() to look at
+    // only the part of the row that may have changed. Needs a frame to
+    // have been hashed in full since the last reset().
+    void clearTileRow(int tileRow);
+
+    // the tiles marked by hashTileRow() are the reference for the next
+    // frame
+    void frameDone() {
+        mValid = true;
+    }
+
+    // region covered by the tiles set in |mask| (one byte per tile)
+    rfb::Region maskRegion(const std::vector<uint8_t>& mask, const rfb::Rect& area) const;
+
+  private:
+    static uint64_t hashTile(const uint8_t* data, int stride, int width, int height, int bpp);
+
+    int mWidth, mHeight;
+    int mTilesX, mTilesY;
+
+    bool mValid;
+    std::vector<uint64_t> mHashes;
+    std::vector<uint8_t> mChanged;
+};
+};
+
+#endif
@@ -0,0 +1,50 @@
+//
+// vncflinger - Copyright (C) 2021 Stefanie Kondik
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+//
+
+
+#ifndef FRAME_SOURCE_H_
+#define FRAME_SOURCE_H_
+
+#include <utils/Errors.h>
+#include <utils/RefBase.h>
+
+#include <gui/CpuConsumer.h>
+
+#include <ui/Rect.h>
+
+using namespace android;
+
+namespace vncflinger {
+
+// Where the desktop gets its frames from. The display capture is one,
+// a generated or replayed sequence is another, so the server can be
+// exercised without SurfaceFlinger behind it.
+//
+// Frames are announced through the CpuConsumer::FrameAvailableListener
+// the source was created with and picked up from the service loop.
+class FrameSource : public RefBase {
+  public:
+    // the newest frame, NOT_ENOUGH_DATA if there is none
+    virtual status_t lockNextBuffer(CpuConsumer::LockedBuffer* buffer) = 0;
+    virtual void unlockBuffer(const CpuConsumer::LockedBuffer& buffer) = 0;
+
+    // part of the frame the display content is drawn into
+    virtual Rect getDisplayRect() = 0;
+};
+};
+
+#endif
@@ -24,12 +24,14 @@
 
 #include <linux/uinput.h>
 
+#include "InputSink.h"
+
 
 #define UINPUT_DEVICE "/dev/uinput"
 
 namespace android {
 
-class InputDevice : public RefBase {
+class InputDevice : public vncflinger::InputSink {
   public:
     virtual status_t start(uint32_t width, uint32_t height, bool istouch, bool relative);
     virtual status_t start_async(uint32_t width, uint32_t height, bool istouch, bool relative);
@@ -0,0 +1,42 @@
+//
+// vncflinger - Copyright (C) 2021 Stefanie Kondik
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+//
+
+
+#ifndef INPUT_SINK_H_
+#define INPUT_SINK_H_
+
+#include <stdint.h>
+
+#include <utils/Errors.h>
+#include <utils/RefBase.h>
+
+namespace vncflinger {
+
+// Receives the input of the viewers, already in display coordinates.
+// The uinput device is the one used on a phone.
+class InputSink : public android::RefBase {
+  public:
+    virtual android::status_t reconfigure(uint32_t width, uint32_t height, bool istouch,
+                                          bool relative) = 0;
+    virtual android::status_t stop() = 0;
+
+    virtual void keyEvent(bool down, uint32_t key) = 0;
+    virtual void pointerEvent(int buttonMask, int x, int y) = 0;
+};
+};
+
+#endif
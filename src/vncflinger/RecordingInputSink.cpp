@@ -0,0 +1,87 @@
+//
+// vncflinger - Copyright (C) 2021 Stefanie Kondik
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+//
+
+
+#define LOG_TAG "VNCFlinger:RecordingInputSink"
+#include <utils/Log.h>
+
+#include <errno.h>
+#include <inttypes.h>
+#include <string.h>
+
+#include <utils/Timers.h>
+
+#include "RecordingInputSink.h"
+
+using namespace vncflinger;
+using namespace android;
+
+RecordingInputSink::RecordingInputSink(const char* path)
+    : mFile(nullptr), mKeys(0), mPointers(0) {
+    mStart = systemTime(SYSTEM_TIME_MONOTONIC);
+
+    if (path != nullptr && path[0] != '\0') {
+        mFile = fopen(path, "we");
+        if (mFile == nullptr) {
+            ALOGE("Failed to open %s: %s", path, strerror(errno));
+        }
+    }
+}
+
+RecordingInputSink::~RecordingInputSink() {
+    stop();
+    if (mFile != nullptr) {
+        fclose(mFile);
+    }
+}
+
+int64_t RecordingInputSink::elapsedMs() {
+    return ns2ms(systemTime(SYSTEM_TIME_MONOTONIC) - mStart);
+}
+
+status_t RecordingInputSink::reconfigure(uint32_t width, uint32_t height, bool istouch,
+                                         bool relative) {
+    if (mFile != nullptr) {
+        fprintf(mFile, "%" PRId64 " config %u %u %d %d\n", elapsedMs(), width, height, istouch,
+                relative);
+    }
+    return NO_ERROR;
+}
+
+status_t RecordingInputSink::stop() {
+    if (mFile != nullptr) {
+        fflush(mFile);
+    }
+    if (mKeys > 0 || mPointers > 0) {
+        ALOGI("Input recorded: %" PRIu64 " key, %" PRIu64 " pointer events", mKeys, mPointers);
+    }
+    return NO_ERROR;
+}
+
+void RecordingInputSink::keyEvent(bool down, uint32_t key) {
+    mKeys++;
+    if (mFile != nullptr) {
+        fprintf(mFile, "%" PRId64 " key %u %d\n", elapsedMs(), key, down);
+    }
+}
+
+void RecordingInputSink::pointerEvent(int buttonMask, int x, int y) {
+    mPointers++;
+    if (mFile != nullptr) {
+        fprintf(mFile, "%" PRId64 " pointer %d %d %d\n", elapsedMs(), buttonMask, x, y);
+    }
+}
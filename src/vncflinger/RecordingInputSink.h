@@ -0,0 +1,62 @@
+//
+// vncflinger - Copyright (C) 2021 Stefanie Kondik
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+//
+
+
+#ifndef RECORDING_INPUT_SINK_H_
+#define RECORDING_INPUT_SINK_H_
+
+#include <stdint.h>
+#include <stdio.h>
+
+#include "InputSink.h"
+
+namespace vncflinger {
+
+// Takes the place of the uinput device where there is none, or none
+// should be touched. Every event is written to a file, one per line:
+//
+//   <ms> config <width> <height> <touch> <relative>
+//   <ms> key <keysym> <down>
+//   <ms> pointer <buttonMask> <x> <y>
+//
+// with the time relative to when the sink was created. Without a file
+// only the event counts are logged on stop().
+class RecordingInputSink : public InputSink {
+  public:
+    RecordingInputSink(const char* path);
+
+    virtual ~RecordingInputSink();
+
+    virtual android::status_t reconfigure(uint32_t width, uint32_t height, bool istouch,
+                                          bool relative);
+    virtual android::status_t stop();
+
+    virtual void keyEvent(bool down, uint32_t key);
+    virtual void pointerEvent(int buttonMask, int x, int y);
+
+  private:
+    int64_t elapsedMs();
+
+    FILE* mFile;
+    int64_t mStart;
+
+    uint64_t mKeys;
+    uint64_t mPointers;
+};
+};
+
+#endif
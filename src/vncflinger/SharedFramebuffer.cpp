@@ -0,0 +1,291 @@
+//
+// vncflinger - Copyright (C) 2021 Stefanie Kondik
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+//
+
+#define LOG_TAG "VNCFlinger:SharedFramebuffer"
+#include <utils/Log.h>
+
+#include <errno.h>
+#include <fcntl.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include <new>
+#include <vector>
+
+#include "SharedFramebuffer.h"
+
+using namespace vncflinger;
+
+// more rectangles than this are sent as their bounding box
+static const size_t kMaxRects = 64;
+
+SharedFramebuffer::SharedFramebuffer() : mFd(-1), mMap(nullptr), mSize(0), mHeader(nullptr) {
+}
+
+SharedFramebuffer::~SharedFramebuffer() {
+    for (auto& client : mClients) {
+        delete client.sock;
+    }
+    release();
+}
+
+void SharedFramebuffer::addClient(network::Socket* sock) {
+    ALOGI("Shared memory client connected");
+    Client client;
+    client.sock = sock;
+    client.needConfig = true;
+    mClients.push_back(client);
+
+    // a frame is already there, the newcomer gets all of it
+    if (mHeader != nullptr) {
+        Client& added = mClients.back();
+        added.pending.reset(rfb::Rect(0, 0, mHeader->width, mHeader->height));
+        if (sendConfig(added)) {
+            added.needConfig = false;
+            sendDamage(added);
+        }
+    }
+}
+
+void SharedFramebuffer::setFds(fd_set* rfds) {
+    for (auto& client : mClients) {
+        FD_SET(client.sock->getFd(), rfds);
+    }
+}
+
+void SharedFramebuffer::processSockets(fd_set* rfds) {
+    for (auto it = mClients.begin(); it != mClients.end();) {
+        int fd = it->sock->getFd();
+        bool closed = it->sock->isShutdown();
+
+        if (!closed && FD_ISSET(fd, rfds)) {
+            // clients have nothing to say, readable means gone
+            char buf[64];
+            ssize_t n = recv(fd, buf, sizeof(buf), MSG_DONTWAIT);
+            closed = n == 0 || (n < 0 && errno != EAGAIN && errno != EINTR);
+        }
+
+        if (closed) {
+            ALOGI("Shared memory client disconnected");
+            delete it->sock;
+            it = mClients.erase(it);
+        } else {
+            it++;
+        }
+    }
+
+    if (mClients.empty()) {
+        release();
+    }
+}
+
+bool SharedFramebuffer::allocate(const rfb::PixelBuffer* pb) {
+    release();
+
+    const rfb::PixelFormat& pf = pb->getPF();
+    const uint32_t stride = pb->width() * (pf.bpp / 8);
+    const size_t pageSize = sysconf(_SC_PAGESIZE);
+    mSize = (kShmPixelOffset + (size_t)stride * pb->height() + pageSize - 1) & ~(pageSize - 1);
+
+    mFd = memfd_create("vncflinger-fb", MFD_CLOEXEC | MFD_ALLOW_SEALING);
+    if (mFd < 0 || ftruncate(mFd, mSize) < 0) {
+        ALOGE("Failed to create shared framebuffer: %s", strerror(errno));
+        release();
+        return false;
+    }
+
+    mMap = (uint8_t*)mmap(nullptr, mSize, PROT_READ | PROT_WRITE, MAP_SHARED, mFd, 0);
+    if (mMap == MAP_FAILED) {
+        ALOGE("Failed to map shared framebuffer: %s", strerror(errno));
+        mMap = nullptr;
+        release();
+        return false;
+    }
+
+    // clients can neither resize the memory under us nor map it
+    // writable, our own mapping stays as it is
+    int seals = F_SEAL_SHRINK | F_SEAL_GROW | F_SEAL_SEAL;
+#ifdef F_SEAL_FUTURE_WRITE
+    seals |= F_SEAL_FUTURE_WRITE;
+#endif
+    if (fcntl(mFd, F_ADD_SEALS, seals) < 0) {
+        ALOGW("Failed to seal shared framebuffer: %s", strerror(errno));
+    }
+
+    mHeader = new (mMap) SharedFrameHeader();
+    mHeader->magic = kShmMagic;
+    mHeader->version = kShmVersion;
+    mHeader->sequence = 0;
+    mHeader->width = pb->width();
+    mHeader->height = pb->height();
+    mHeader->stride = stride;
+    mHeader->bpp = pf.bpp;
+    mHeader->redShift = pf.redShift;
+    mHeader->greenShift = pf.greenShift;
+    mHeader->blueShift = pf.blueShift;
+    mHeader->frames = 0;
+
+    ALOGV("Shared framebuffer %ux%u, %zu bytes", mHeader->width, mHeader->height, mSize);
+    return true;
+}
+
+void SharedFramebuffer::release() {
+    if (mMap != nullptr) {
+        munmap(mMap, mSize);
+    }
+    if (mFd >= 0) {
+        close(mFd);
+    }
+    mMap = nullptr;
+    mHeader = nullptr;
+    mFd = -1;
+    mSize = 0;
+}
+
+void SharedFramebuffer::copy(const rfb::PixelBuffer* pb, const rfb::Rect& rect) {
+    const int bpp = pb->getPF().bpp / 8;
+    const size_t rowBytes = rect.width() * bpp;
+    int stride;
+    const uint8_t* src = pb->getBuffer(rect, &stride);
+    uint8_t* dst = mMap + kShmPixelOffset + rect.tl.y * mHeader->stride + rect.tl.x * bpp;
+
+    for (int y = 0; y < rect.height(); y++) {
+        memcpy(dst, src, rowBytes);
+        src += stride * bpp;
+        dst += mHeader->stride;
+    }
+}
+
+void SharedFramebuffer::update(const rfb::PixelBuffer* pb, const rfb::Region& changed) {
+    if (mClients.empty()) {
+        return;
+    }
+
+    rfb::Region damage = changed;
+    if (mHeader == nullptr || mHeader->width != (uint32_t)pb->width() ||
+        mHeader->height != (uint32_t)pb->height() || mHeader->bpp != (uint32_t)pb->getPF().bpp) {
+        if (!allocate(pb)) {
+            return;
+        }
+        damage.reset(pb->getRect());
+        for (auto& client : mClients) {
+            client.needConfig = true;
+            client.pending.clear();
+        }
+    }
+
+    std::vector<rfb::Rect> rects;
+    damage.get_rects(&rects);
+
+    mHeader->sequence.fetch_add(1, std::memory_order_acq_rel);
+    for (const rfb::Rect& r : rects) {
+        copy(pb, r);
+    }
+    mHeader->frames++;
+    mHeader->sequence.fetch_add(1, std::memory_order_release);
+
+    for (auto& client : mClients) {
+        client.pending.assign_union(damage);
+        if (client.needConfig) {
+            if (!sendConfig(client)) {
+                continue;
+            }
+            client.needConfig = false;
+        }
+        sendDamage(client);
+    }
+}
+
+SharedFrameMessage SharedFramebuffer::message(uint32_t type, uint32_t count) {
+    SharedFrameMessage msg;
+    msg.type = type;
+    msg.sequence = mHeader->sequence.load(std::memory_order_acquire);
+    msg.width = mHeader->width;
+    msg.height = mHeader->height;
+    msg.stride = mHeader->stride;
+    msg.bpp = mHeader->bpp;
+    msg.redShift = mHeader->redShift;
+    msg.greenShift = mHeader->greenShift;
+    msg.blueShift = mHeader->blueShift;
+    msg.count = count;
+    return msg;
+}
+
+bool SharedFramebuffer::sendConfig(Client& client) {
+    SharedFrameMessage msg = message(kShmConfig, 0);
+    struct iovec iov = {&msg, sizeof(msg)};
+
+    char control[CMSG_SPACE(sizeof(int))];
+    memset(control, 0, sizeof(control));
+    struct msghdr hdr = {};
+    hdr.msg_iov = &iov;
+    hdr.msg_iovlen = 1;
+    hdr.msg_control = control;
+    hdr.msg_controllen = sizeof(control);
+
+    struct cmsghdr* cmsg = CMSG_FIRSTHDR(&hdr);
+    cmsg->cmsg_level = SOL_SOCKET;
+    cmsg->cmsg_type = SCM_RIGHTS;
+    cmsg->cmsg_len = CMSG_LEN(sizeof(int));
+    memcpy(CMSG_DATA(cmsg), &mFd, sizeof(int));
+
+    ssize_t n = sendmsg(client.sock->getFd(), &hdr, MSG_DONTWAIT | MSG_NOSIGNAL);
+    if (n == (ssize_t)sizeof(msg)) {
+        return true;
+    }
+    if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR)) {
+        return false;
+    }
+    ALOGW("Shared memory client lost: %s", n < 0 ? strerror(errno) : "short write");
+    client.sock->shutdown();
+    return false;
+}
+
+bool SharedFramebuffer::sendDamage(Client& client) {
+    std::vector<rfb::Rect> rects;
+    client.pending.get_rects(&rects);
+    if (rects.size() > kMaxRects) {
+        rects.assign(1, client.pending.get_bounding_rect());
+    }
+
+    std::vector<uint8_t> buf(sizeof(SharedFrameMessage) + rects.size() * sizeof(SharedFrameRect));
+    SharedFrameMessage msg = message(kShmDamage, rects.size());
+    memcpy(buf.data(), &msg, sizeof(msg));
+    SharedFrameRect* out = (SharedFrameRect*)(buf.data() + sizeof(msg));
+    for (size_t i = 0; i < rects.size(); i++) {
+        out[i].x = rects[i].tl.x;
+        out[i].y = rects[i].tl.y;
+        out[i].w = rects[i].width();
+        out[i].h = rects[i].height();
+    }
+
+    // a full socket only delays the damage, it merges into the next one
+    ssize_t n = send(client.sock->getFd(), buf.data(), buf.size(), MSG_DONTWAIT | MSG_NOSIGNAL);
+    if (n == (ssize_t)buf.size()) {
+        client.pending.clear();
+        return true;
+    }
+    if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR)) {
+        return false;
+    }
+    // a partial message cannot be completed later without framing state
+    ALOGW("Shared memory client lost: %s", n < 0 ? strerror(errno) : "short write");
+    client.sock->shutdown();
+    return false;
+}
@@ -0,0 +1,129 @@
+//
+// vncflinger - Copyright (C) 2021 Stefanie Kondik
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+//
+
+#ifndef SHARED_FRAMEBUFFER_H_
+#define SHARED_FRAMEBUFFER_H_
+
+#include <stdint.h>
+#include <sys/select.h>
+
+#include <atomic>
+#include <list>
+
+#include <utils/RefBase.h>
+
+#include <network/Socket.h>
+#include <rfb/PixelBuffer.h>
+#include <rfb/Region.h>
+
+using namespace android;
+
+namespace vncflinger {
+
+// Wire format of the shared memory transport, all fields little endian.
+//
+// On connect, and whenever the frame geometry changes, the client gets a
+// kShmConfig message with a memfd attached (SCM_RIGHTS). The memfd holds
+// a SharedFrameHeader followed by the pixels at kShmPixelOffset. After
+// every frame a kShmDamage message follows, with |count| SharedFrameRect
+// entries naming the pixels that changed.
+//
+// The header sequence is odd while the server writes. A reader copies
+// what it needs and retries if the sequence was odd or changed meanwhile.
+static const uint32_t kShmMagic = 0x564e4346;  // "VNCF"
+static const uint32_t kShmVersion = 1;
+static const uint32_t kShmPixelOffset = 4096;
+
+enum : uint32_t {
+    kShmConfig = 1,
+    kShmDamage = 2,
+};
+
+struct SharedFrameHeader {
+    uint32_t magic;
+    uint32_t version;
+    std::atomic<uint32_t> sequence;
+    uint32_t width, height;
+    uint32_t stride;  // bytes
+    uint32_t bpp;     // bits
+    uint32_t redShift, greenShift, blueShift;
+    uint64_t frames;
+};
+
+struct SharedFrameMessage {
+    uint32_t type;
+    uint32_t sequence;
+    uint32_t width, height;
+    uint32_t stride;
+    uint32_t bpp;
+    uint32_t redShift, greenShift, blueShift;
+    uint32_t count;
+};
+
+struct SharedFrameRect {
+    uint32_t x, y, w, h;
+};
+
+// Serves the framebuffer to local processes through a memfd instead of
+// RFB, so they neither decode nor receive pixels over the socket. All
+// calls come from the service thread.
+class SharedFramebuffer : public RefBase {
+  public:
+    SharedFramebuffer();
+
+    virtual ~SharedFramebuffer();
+
+    // takes ownership of the socket
+    void addClient(network::Socket* sock);
+
+    bool hasClients() {
+        return !mClients.empty();
+    }
+
+    // add client fds for select() and service them afterwards
+    void setFds(fd_set* rfds);
+    void processSockets(fd_set* rfds);
+
+    // copies |changed| from |pb| into shared memory and tells the clients
+    void update(const rfb::PixelBuffer* pb, const rfb::Region& changed);
+
+  private:
+    struct Client {
+        network::Socket* sock;
+        bool needConfig;
+        // damage not delivered yet because the socket was full
+        rfb::Region pending;
+    };
+
+    bool allocate(const rfb::PixelBuffer* pb);
+    void release();
+    void copy(const rfb::PixelBuffer* pb, const rfb::Rect& rect);
+
+    SharedFrameMessage message(uint32_t type, uint32_t count);
+    bool sendConfig(Client& client);
+    bool sendDamage(Client& client);
+
+    int mFd;
+    uint8_t* mMap;
+    size_t mSize;
+    SharedFrameHeader* mHeader;
+
+    std::list<Client> mClients;
+};
+};
+
+#endif
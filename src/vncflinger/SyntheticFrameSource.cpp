@@ -0,0 +1,222 @@
+//
+// vncflinger - Copyright (C) 2021 Stefanie Kondik
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+//
+
+
+#define LOG_TAG "VNCFlinger:SyntheticFrameSource"
+#include <utils/Log.h>
+
+#include <algorithm>
+
+#include <fcntl.h>
+#include <inttypes.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <gui/BufferItem.h>
+
+#include "SyntheticFrameSource.h"
+
+using namespace vncflinger;
+using namespace android;
+
+// size of the moving square, and how far it moves per frame
+static const int kSquareSize = 256;
+static const int kSquareStep = 8;
+
+// pixels of the frame stamp in the top left corner, one bit each
+static const uint32_t kStampBits = 32;
+
+SyntheticFrameSource::SyntheticFrameSource(uint32_t width, uint32_t height, int fps,
+                                           PixelFormat format, const char* replayPath,
+                                           sp<CpuConsumer::FrameAvailableListener> listener)
+    : mWidth(width), mHeight(height), mFormat(format), mReplayFd(-1), mReplayFrames(0),
+      mListener(listener), mExiting(false), mBack(0), mPending(1), mFront(2),
+      mHasPending(false), mPendingNumber(0), mPendingTimestamp(0), mFramesDropped(0) {
+    mInterval = s2ns(1) / (fps > 0 ? fps : 60);
+    mBpp = bytesPerPixel(format);
+    mFrameSize = (size_t)mWidth * mHeight * mBpp;
+    for (auto& buffer : mBuffers) {
+        buffer.resize(mFrameSize);
+    }
+
+    if (replayPath != nullptr && replayPath[0] != '\0') {
+        struct stat st;
+        mReplayFd = open(replayPath, O_RDONLY | O_CLOEXEC);
+        if (mReplayFd < 0 || fstat(mReplayFd, &st) < 0) {
+            ALOGE("Failed to open %s: %s", replayPath, strerror(errno));
+        } else {
+            mReplayFrames = st.st_size / mFrameSize;
+            if (mReplayFrames == 0) {
+                ALOGE("%s holds no complete %ux%u frame", replayPath, mWidth, mHeight);
+            }
+        }
+        if (mReplayFrames == 0 && mReplayFd >= 0) {
+            close(mReplayFd);
+            mReplayFd = -1;
+        }
+    }
+
+    mThread = std::thread(&SyntheticFrameSource::threadLoop, this);
+
+    ALOGI("Synthetic frames %ux%u at %d fps%s", mWidth, mHeight, (int)(s2ns(1) / mInterval),
+          mReplayFd >= 0 ? ", replayed" : "");
+}
+
+SyntheticFrameSource::~SyntheticFrameSource() {
+    {
+        Mutex::Autolock _l(mLock);
+        mExiting = true;
+        mWake.signal();
+    }
+    mThread.join();
+
+    if (mReplayFd >= 0) {
+        close(mReplayFd);
+    }
+
+    ALOGV("Synthetic frames stopped, %" PRIu64 " dropped", mFramesDropped);
+}
+
+status_t SyntheticFrameSource::lockNextBuffer(CpuConsumer::LockedBuffer* buffer) {
+    Mutex::Autolock _l(mLock);
+
+    if (!mHasPending) {
+        return NOT_ENOUGH_DATA;
+    }
+    std::swap(mPending, mFront);
+    mHasPending = false;
+
+    buffer->data = mBuffers[mFront].data();
+    buffer->width = mWidth;
+    buffer->height = mHeight;
+    buffer->stride = mWidth;
+    buffer->format = mFormat;
+    buffer->crop = Rect(mWidth, mHeight);
+    buffer->timestamp = mPendingTimestamp;
+    buffer->frameNumber = mPendingNumber;
+    return OK;
+}
+
+void SyntheticFrameSource::unlockBuffer(const CpuConsumer::LockedBuffer& buffer) {
+    // mFront belongs to the consumer until the next lockNextBuffer()
+}
+
+void SyntheticFrameSource::threadLoop() {
+    nsecs_t next = systemTime(SYSTEM_TIME_MONOTONIC);
+    uint64_t frame = 0;
+
+    while (true) {
+        uint8_t* dst = mBuffers[mBack].data();
+        if (mReplayFd < 0 || !replay(dst, frame)) {
+            draw(dst, frame);
+        }
+
+        BufferItem item;
+        {
+            Mutex::Autolock _l(mLock);
+
+            next += mInterval;
+            nsecs_t now = systemTime(SYSTEM_TIME_MONOTONIC);
+            while (!mExiting && now < next) {
+                mWake.waitRelative(mLock, next - now);
+                now = systemTime(SYSTEM_TIME_MONOTONIC);
+            }
+            if (mExiting) {
+                return;
+            }
+            // never try to catch up after a stall
+            if (now - next > mInterval) {
+                next = now;
+            }
+
+            stamp(dst, now);
+
+            if (mHasPending) {
+                mFramesDropped++;
+            }
+            std::swap(mBack, mPending);
+            mHasPending = true;
+            mPendingNumber = frame;
+            mPendingTimestamp = now;
+
+            item.mFrameNumber = frame;
+            item.mTimestamp = now;
+        }
+
+        mListener->onFrameAvailable(item);
+        frame++;
+    }
+}
+
+bool SyntheticFrameSource::replay(uint8_t* dst, uint64_t frame) {
+    off_t offset = (off_t)(frame % mReplayFrames) * mFrameSize;
+    ssize_t n = pread(mReplayFd, dst, mFrameSize, offset);
+    if (n != (ssize_t)mFrameSize) {
+        ALOGE("Failed to read frame %" PRIu64 ": %s", frame, n < 0 ? strerror(errno) : "short read");
+        close(mReplayFd);
+        mReplayFd = -1;
+        return false;
+    }
+    return true;
+}
+
+// the low 32 bits of the frame time in ms, white for 1 and black for 0,
+// so a viewer on the same machine can tell how old a frame it gets is
+void SyntheticFrameSource::stamp(uint8_t* dst, nsecs_t timestamp) {
+    if (mWidth < kStampBits) {
+        return;
+    }
+    const uint32_t ms = (uint32_t)ns2ms(timestamp);
+    for (uint32_t i = 0; i < kStampBits; i++) {
+        memset(dst + i * mBpp, (ms >> i) & 1 ? 0xff : 0, mBpp);
+    }
+}
+
+void SyntheticFrameSource::draw(uint8_t* dst, uint64_t frame) {
+    const int range = std::max(1, (int)mWidth - kSquareSize);
+    const int squareX = (frame * kSquareStep) % range;
+    const int squareY = ((int)mHeight - kSquareSize) / 2;
+
+    for (uint32_t y = 0; y < mHeight; y++) {
+        uint8_t* row = dst + (size_t)y * mWidth * mBpp;
+        const int sy = (int)y - squareY;
+
+        for (uint32_t x = 0; x < mWidth; x++) {
+            const int sx = (int)x - squareX;
+            uint8_t r, g, b;
+            if (sx >= 0 && sx < kSquareSize && sy >= 0 && sy < kSquareSize) {
+                r = sx + frame;
+                g = sy + frame * 2;
+                b = sx ^ sy;
+            } else {
+                r = g = b = ((x >> 5) + (y >> 5)) & 1 ? 0xe0 : 0xf8;
+            }
+
+            if (mBpp == 2) {
+                uint16_t v = ((r >> 3) << 11) | ((g >> 2) << 5) | (b >> 3);
+                memcpy(row + x * 2, &v, 2);
+            } else {
+                uint8_t* p = row + x * 4;
+                p[0] = r;
+                p[1] = g;
+                p[2] = b;
+                p[3] = 0xff;
+            }
+        }
+    }
+}
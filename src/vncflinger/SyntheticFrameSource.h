@@ -0,0 +1,98 @@
+//
+// vncflinger - Copyright (C) 2021 Stefanie Kondik
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+//
+
+
+#ifndef SYNTHETIC_FRAME_SOURCE_H_
+#define SYNTHETIC_FRAME_SOURCE_H_
+
+#include <stdint.h>
+
+#include <thread>
+#include <vector>
+
+#include <utils/Condition.h>
+#include <utils/Mutex.h>
+#include <utils/Timers.h>
+
+#include <ui/PixelFormat.h>
+
+#include "FrameSource.h"
+
+namespace vncflinger {
+
+// Produces frames at a fixed rate on its own thread, in place of the
+// virtual display. Frames are read in turn from a file of raw frames in
+// the capture format, looping at the end, or drawn: a static background
+// with a moving, constantly changing square, so every frame has some
+// damage but most of the screen stays the same. Either way the frame
+// time is stamped into the top row for vncbench to read back.
+//
+// Like the CpuConsumer it stands in for, a frame not picked up before
+// the next one is ready is dropped.
+class SyntheticFrameSource : public FrameSource {
+  public:
+    SyntheticFrameSource(uint32_t width, uint32_t height, int fps, PixelFormat format,
+                         const char* replayPath,
+                         sp<CpuConsumer::FrameAvailableListener> listener);
+
+    virtual ~SyntheticFrameSource();
+
+    virtual status_t lockNextBuffer(CpuConsumer::LockedBuffer* buffer);
+    virtual void unlockBuffer(const CpuConsumer::LockedBuffer& buffer);
+
+    virtual Rect getDisplayRect() {
+        return Rect(mWidth, mHeight);
+    }
+
+  private:
+    void threadLoop();
+
+    void draw(uint8_t* dst, uint64_t frame);
+    bool replay(uint8_t* dst, uint64_t frame);
+    void stamp(uint8_t* dst, nsecs_t timestamp);
+
+    uint32_t mWidth, mHeight;
+    nsecs_t mInterval;
+    PixelFormat mFormat;
+    int mBpp;
+    size_t mFrameSize;
+
+    int mReplayFd;
+    uint64_t mReplayFrames;
+
+    sp<CpuConsumer::FrameAvailableListener> mListener;
+
+    Mutex mLock;
+    Condition mWake;
+    bool mExiting;
+
+    // the thread draws into mBack, the newest complete frame waits in
+    // mPending and the consumer reads mFront
+    std::vector<uint8_t> mBuffers[3];
+    int mBack, mPending, mFront;
+    bool mHasPending;
+    uint64_t mPendingNumber;
+    nsecs_t mPendingTimestamp;
+
+    // statistics
+    uint64_t mFramesDropped;
+
+    std::thread mThread;
+};
+};
+
+#endif
@@ -0,0 +1,165 @@
+//
+// vncflinger - Copyright (C) 2021 Stefanie Kondik
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+//
+
+#define LOG_TAG "VNCFlinger:TileClassifier"
+#include <utils/Log.h>
+
+#include <inttypes.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "TileClassifier.h"
+
+using namespace vncflinger;
+
+// every 4th pixel of every 4th row, 256 samples for a full tile
+static const int kSampleStep = 4;
+
+// more distinct colours than this in the sample is photo-like
+static const int kMaxPaletteColours = 32;
+
+// summed RGB difference between neighbouring samples that counts as a
+// hard edge, and the share of edges above which content is not photo
+static const int kEdgeThreshold = 96;
+static const int kMaxEdgePercent = 25;
+
+// activity is a moving average of 1/8 weight, a tile changing every
+// frame settles at 248. video needs a sustained run of changes and
+// drops out again a few quiet frames later
+static const int kActivityStep = 31;
+static const int kVideoEnter = 160;
+static const int kVideoLeave = 96;
+
+TileClassifier::TileClassifier() : mTilesX(0), mTilesY(0), mTilesSampled(0), mTilesWithheld(0) {
+}
+
+void TileClassifier::reset(const DamageTracker& damage) {
+    mTilesX = damage.tilesX();
+    mTilesY = damage.tilesY();
+
+    const size_t tiles = mTilesX * mTilesY;
+    mActivity.assign(tiles, 0);
+    mPhotoLike.assign(tiles, 0);
+    mLabels.assign(tiles, kUI);
+    mVideoMask.assign(tiles, 0);
+}
+
+static inline uint32_t readPixel(const uint8_t* p, int bpp) {
+    uint32_t v = 0;
+    memcpy(&v, p, bpp);
+    return v;
+}
+
+bool TileClassifier::isPhotoLike(const uint8_t* data, int stride, int width, int height,
+                                 int bpp) {
+    uint32_t palette[kMaxPaletteColours];
+    int colours = 0;
+    int pairs = 0, edges = 0;
+
+    for (int y = 0; y < height; y += kSampleStep) {
+        const uint8_t* row = data + y * stride * bpp;
+        uint32_t prev = readPixel(row, bpp);
+
+        for (int x = 0; x < width; x += kSampleStep) {
+            uint32_t v = readPixel(row + x * bpp, bpp);
+
+            if (colours <= kMaxPaletteColours) {
+                int i = 0;
+                while (i < colours && palette[i] != v) {
+                    i++;
+                }
+                if (i == colours) {
+                    if (colours < kMaxPaletteColours) {
+                        palette[colours] = v;
+                    }
+                    colours++;
+                }
+            }
+
+            if (x > 0) {
+                int diff;
+                if (bpp == 4) {
+                    diff = abs((int)(v & 0xff) - (int)(prev & 0xff)) +
+                           abs((int)((v >> 8) & 0xff) - (int)((prev >> 8) & 0xff)) +
+                           abs((int)((v >> 16) & 0xff) - (int)((prev >> 16) & 0xff));
+                } else {
+                    // packed formats, any difference is an edge
+                    diff = v != prev ? kEdgeThreshold + 1 : 0;
+                }
+                pairs++;
+                edges += diff > kEdgeThreshold;
+            }
+            prev = v;
+        }
+    }
+
+    return colours > kMaxPaletteColours && edges * 100 < pairs * kMaxEdgePercent;
+}
+
+void TileClassifier::classifyTileRow(const rfb::PixelBuffer* pb, const DamageTracker& damage,
+                                     int tileRow) {
+    if (tileRow >= mTilesY) {
+        return;
+    }
+
+    const int bpp = pb->getPF().bpp / 8;
+
+    for (int tx = 0; tx < mTilesX; tx++) {
+        const int idx = tileRow * mTilesX + tx;
+        const bool changed = damage.isChanged(tx, tileRow);
+
+        int activity = mActivity[idx] - (mActivity[idx] >> 3);
+        if (changed) {
+            activity += kActivityStep;
+
+            rfb::Rect tile = damage.tileRect(tx, tileRow);
+            int stride;
+            const uint8_t* data = pb->getBuffer(tile, &stride);
+            mPhotoLike[idx] = isPhotoLike(data, stride, tile.width(), tile.height(), bpp);
+            mTilesSampled++;
+        }
+        mActivity[idx] = activity;
+
+        // hysteresis so a tile does not flip between rates
+        const int threshold = mLabels[idx] == kVideo ? kVideoLeave : kVideoEnter;
+        Label label;
+        if (mPhotoLike[idx] && activity >= threshold) {
+            label = kVideo;
+        } else if (mPhotoLike[idx]) {
+            label = kPhoto;
+        } else {
+            label = kUI;
+        }
+
+        mLabels[idx] = label;
+        mVideoMask[idx] = label == kVideo;
+    }
+}
+
+void TileClassifier::dumpStats() {
+    int counts[3] = {0, 0, 0};
+    for (uint8_t label : mLabels) {
+        counts[label]++;
+    }
+
+    ALOGI("Content: %d ui, %d photo, %d video tiles, %" PRIu64 " sampled, %" PRIu64
+          " video tiles withheld",
+          counts[kUI], counts[kPhoto], counts[kVideo], mTilesSampled.load(), mTilesWithheld);
+
+    mTilesSampled = 0;
+    mTilesWithheld = 0;
+}
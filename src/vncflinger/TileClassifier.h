@@ -0,0 +1,95 @@
+//
+// vncflinger - Copyright (C) 2021 Stefanie Kondik
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+//
+
+#ifndef TILE_CLASSIFIER_H_
+#define TILE_CLASSIFIER_H_
+
+#include <stdint.h>
+
+#include <atomic>
+#include <vector>
+
+#include <rfb/PixelBuffer.h>
+
+#include "DamageTracker.h"
+
+namespace vncflinger {
+
+// Labels every damage tile by what it shows, from a sample of its
+// pixels (colour count, edge density) and from how often it changes:
+//
+//   UI     few colours or hard edges, text and widgets
+//   PHOTO  many colours and smooth, a still image
+//   VIDEO  photo-like content that changes nearly every frame
+//
+// The encoder choice per rectangle is made by the server from the
+// pixels it is given, so the label is used to decide how often a tile
+// is worth sending: video tiles can be rate limited without anyone
+// noticing, UI tiles never are.
+class TileClassifier {
+  public:
+    enum Label : uint8_t {
+        kUI,
+        kPhoto,
+        kVideo,
+    };
+
+    TileClassifier();
+
+    // follow the tile grid of |damage|, all tiles start as UI
+    void reset(const DamageTracker& damage);
+
+    // Updates one row of tiles after damage.hashTileRow() ran for it.
+    // Only changed tiles are sampled. Rows may run in parallel.
+    void classifyTileRow(const rfb::PixelBuffer* pb, const DamageTracker& damage, int tileRow);
+
+    Label label(int tx, int ty) const {
+        return (Label)mLabels[ty * mTilesX + tx];
+    }
+
+    // one byte per tile, set for tiles currently labelled VIDEO
+    const std::vector<uint8_t>& videoMask() const {
+        return mVideoMask;
+    }
+
+    // label counts and withheld tiles since the last call, to the log
+    void dumpStats();
+
+    // video tiles held back from a frame, for the statistics
+    void countWithheld(uint64_t tiles) {
+        mTilesWithheld += tiles;
+    }
+
+  private:
+    static bool isPhotoLike(const uint8_t* data, int stride, int width, int height, int bpp);
+
+    int mTilesX, mTilesY;
+
+    // moving average of "changed this frame", 0..255
+    std::vector<uint8_t> mActivity;
+    // result of the last content sample
+    std::vector<uint8_t> mPhotoLike;
+    std::vector<uint8_t> mLabels;
+    std::vector<uint8_t> mVideoMask;
+
+    // statistics
+    std::atomic<uint64_t> mTilesSampled;
+    uint64_t mTilesWithheld;
+};
+};
+
+#endif
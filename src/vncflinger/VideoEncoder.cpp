@@ -0,0 +1,144 @@
+//
+// vncflinger - Copyright (C) 2021 Stefanie Kondik
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+//
+
+#define LOG_TAG "VNCFlinger:VideoEncoder"
+#include <utils/Log.h>
+
+#include <algorithm>
+
+#include <vpx/vp8cx.h>
+
+#include "ColorConvert.h"
+#include "VideoEncoder.h"
+
+using namespace vncflinger;
+using namespace android;
+
+// rows per conversion job, must be even
+static const int kConvertBandHeight = 64;
+
+// new viewers ask for a key frame, the interval only bounds recovery
+// from a lost frame on the decoder side
+static const unsigned int kKeyFrameInterval = 300;
+
+// fastest real time preset of libvpx
+static const int kCpuUsed = 16;
+
+VideoEncoder::VideoEncoder(sp<WorkerPool> workers, int bitrate)
+    : mWorkers(workers), mBitrate(bitrate), mStarted(false), mWidth(0), mHeight(0),
+      mLastPts(-1) {
+}
+
+VideoEncoder::~VideoEncoder() {
+    stop();
+}
+
+bool VideoEncoder::start(int width, int height) {
+    stop();
+
+    vpx_codec_enc_cfg_t cfg;
+    if (vpx_codec_enc_config_default(vpx_codec_vp8_cx(), &cfg, 0) != VPX_CODEC_OK) {
+        ALOGE("Failed to get the VP8 encoder defaults");
+        return false;
+    }
+
+    cfg.g_w = width;
+    cfg.g_h = height;
+    cfg.g_timebase.num = 1;
+    cfg.g_timebase.den = 1000;
+    cfg.g_threads = mWorkers->size();
+    cfg.g_lag_in_frames = 0;
+    cfg.g_error_resilient = VPX_ERROR_RESILIENT_DEFAULT;
+    cfg.rc_end_usage = VPX_CBR;
+    cfg.rc_target_bitrate = std::max(mBitrate / 1000, 1);
+    cfg.kf_mode = VPX_KF_AUTO;
+    cfg.kf_max_dist = kKeyFrameInterval;
+
+    if (vpx_codec_enc_init(&mCodec, vpx_codec_vp8_cx(), &cfg, 0) != VPX_CODEC_OK) {
+        ALOGE("Failed to start the VP8 encoder for %dx%d: %s", width, height,
+              vpx_codec_error(&mCodec));
+        return false;
+    }
+    vpx_codec_control(&mCodec, VP8E_SET_CPUUSED, kCpuUsed);
+    vpx_codec_control(&mCodec, VP8E_SET_SCREEN_CONTENT_MODE, 1);
+
+    mFrame.resize((size_t)width * height * 3 / 2);
+    mWidth = width;
+    mHeight = height;
+    mLastPts = -1;
+    mStarted = true;
+
+    ALOGI("Encoder started: %dx%d @ %d bps, %d threads", width, height, mBitrate,
+          cfg.g_threads);
+    return true;
+}
+
+void VideoEncoder::stop() {
+    if (!mStarted) {
+        return;
+    }
+    vpx_codec_destroy(&mCodec);
+    mStarted = false;
+    mWidth = mHeight = 0;
+    ALOGI("Encoder stopped");
+}
+
+void VideoEncoder::convert(const uint8_t* src, int stride) {
+    const int width = mWidth;
+    const int height = mHeight;
+    uint8_t* dstY = mFrame.data();
+    uint8_t* dstU = dstY + width * height;
+    uint8_t* dstV = dstU + (width / 2) * (height / 2);
+
+    const int bands = (height + kConvertBandHeight - 1) / kConvertBandHeight;
+    mWorkers->run(bands, [&](int i) {
+        rgbxToI420(src, stride * 4, width, i * kConvertBandHeight,
+                   std::min((i + 1) * kConvertBandHeight, height), dstY, width, dstU, dstV,
+                   width / 2);
+    });
+}
+
+bool VideoEncoder::encode(int64_t pts, bool keyFrame, const Output& output) {
+    if (!mStarted) {
+        return false;
+    }
+
+    // libvpx rejects timestamps that go backwards
+    pts = std::max(pts, mLastPts + 1);
+    unsigned long duration = mLastPts < 0 ? 1 : pts - mLastPts;
+    mLastPts = pts;
+
+    vpx_image_t img;
+    vpx_img_wrap(&img, VPX_IMG_FMT_I420, mWidth, mHeight, 1, mFrame.data());
+
+    if (vpx_codec_encode(&mCodec, &img, pts, duration, keyFrame ? VPX_EFLAG_FORCE_KF : 0,
+                         VPX_DL_REALTIME) != VPX_CODEC_OK) {
+        ALOGE("Failed to encode: %s", vpx_codec_error(&mCodec));
+        return false;
+    }
+
+    vpx_codec_iter_t iter = nullptr;
+    const vpx_codec_cx_pkt_t* pkt;
+    while ((pkt = vpx_codec_get_cx_data(&mCodec, &iter)) != nullptr) {
+        if (pkt->kind != VPX_CODEC_CX_FRAME_PKT) {
+            continue;
+        }
+        output((const uint8_t*)pkt->data.frame.buf, pkt->data.frame.sz,
+               pkt->data.frame.flags & VPX_FRAME_IS_KEY, pkt->data.frame.pts);
+    }
+    return true;
+}
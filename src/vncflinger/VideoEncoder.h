@@ -0,0 +1,81 @@
+//
+// vncflinger - Copyright (C) 2021 Stefanie Kondik
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+//
+
+#ifndef VIDEO_ENCODER_H_
+#define VIDEO_ENCODER_H_
+
+#include <stdint.h>
+
+#include <functional>
+#include <vector>
+
+#include <vpx/vpx_encoder.h>
+
+#include "WorkerPool.h"
+
+namespace vncflinger {
+
+// Real time VP8 encoder for RGBX_8888 frames. The frame is converted to
+// I420 in bands on the worker pool and handed to libvpx, which runs on
+// the CPU only. Needs nothing from the platform, so it is benchmarked on
+// the host as well (tests/VideoEncodeBenchmark.cpp).
+class VideoEncoder {
+  public:
+    // one compressed frame, |pts| in milliseconds
+    typedef std::function<void(const uint8_t* data, size_t size, bool keyFrame, int64_t pts)>
+            Output;
+
+    VideoEncoder(sp<WorkerPool> workers, int bitrate);
+
+    ~VideoEncoder();
+
+    // dimensions must be even
+    bool start(int width, int height);
+    void stop();
+
+    bool started() {
+        return mStarted;
+    }
+    int width() {
+        return mWidth;
+    }
+    int height() {
+        return mHeight;
+    }
+
+    // converts the top left width x height pixels of |src|, the stride
+    // is in pixels
+    void convert(const uint8_t* src, int stride);
+
+    // encodes the last converted frame, |pts| must increase
+    bool encode(int64_t pts, bool keyFrame, const Output& output);
+
+  private:
+    sp<WorkerPool> mWorkers;
+    int mBitrate;
+
+    bool mStarted;
+    vpx_codec_ctx_t mCodec;
+    int mWidth, mHeight;
+    int64_t mLastPts;
+
+    // I420, the planes back to back
+    std::vector<uint8_t> mFrame;
+};
+};
+
+#endif
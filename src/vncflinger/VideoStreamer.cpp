@@ -0,0 +1,248 @@
+//
+// vncflinger - Copyright (C) 2021 Stefanie Kondik
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+//
+
+#define LOG_TAG "VNCFlinger:VideoStreamer"
+#include <utils/Log.h>
+
+#include <endian.h>
+#include <errno.h>
+#include <inttypes.h>
+#include <string.h>
+#include <sys/socket.h>
+
+#include "AndroidPixelBuffer.h"
+#include "VideoStreamer.h"
+
+using namespace vncflinger;
+using namespace android;
+
+// a client further behind than this is disconnected
+static const size_t kMaxClientBacklog = 8 * 1024 * 1024;
+
+// how often a client that dropped frames may cost everyone a key frame,
+// so one slow client cannot turn the whole stream into key frames
+static const nsecs_t kMinRecoveryInterval = s2ns(1);
+
+// IVF container, timestamps in milliseconds
+static const size_t kIvfHeaderSize = 32;
+static const size_t kIvfFrameHeaderSize = 12;
+
+VideoStreamer::VideoStreamer(sp<WorkerPool> workers, int bitrate)
+    : mEncoder(workers, bitrate), mForceKeyFrame(false), mFirstTimestamp(0), mLastKeyFrame(0),
+      mFramesEncoded(0), mFramesSkipped(0), mFramesDropped(0), mBytesOut(0) {
+}
+
+VideoStreamer::~VideoStreamer() {
+    for (auto& client : mClients) {
+        delete client.sock;
+    }
+}
+
+void VideoStreamer::addClient(network::Socket* sock) {
+    ALOGI("Video client connected");
+    Client client;
+    client.sock = sock;
+    client.sentHeader = false;
+    client.waitingForKeyFrame = true;
+    mClients.push_back(client);
+    mForceKeyFrame = true;
+}
+
+void VideoStreamer::setFds(fd_set* rfds, fd_set* wfds) {
+    for (auto& client : mClients) {
+        FD_SET(client.sock->getFd(), rfds);
+        if (!client.pending.empty()) {
+            FD_SET(client.sock->getFd(), wfds);
+        }
+    }
+}
+
+void VideoStreamer::processSockets(fd_set* rfds, fd_set* wfds) {
+    for (auto it = mClients.begin(); it != mClients.end();) {
+        int fd = it->sock->getFd();
+        bool closed = it->sock->isShutdown();
+
+        if (!closed && FD_ISSET(fd, rfds)) {
+            // clients have nothing to say, readable means gone
+            char buf[64];
+            ssize_t n = recv(fd, buf, sizeof(buf), MSG_DONTWAIT);
+            closed = n == 0 || (n < 0 && errno != EAGAIN && errno != EINTR);
+        }
+        if (!closed && FD_ISSET(fd, wfds)) {
+            flush(*it);
+            closed = it->sock->isShutdown();
+        }
+
+        if (closed) {
+            ALOGI("Video client disconnected: %" PRIu64 " frames encoded, %" PRIu64
+                  " skipped, %" PRIu64 " dropped by slow clients, %" PRIu64 " bytes sent",
+                  mFramesEncoded, mFramesSkipped, mFramesDropped, mBytesOut);
+            delete it->sock;
+            it = mClients.erase(it);
+        } else {
+            it++;
+        }
+    }
+
+    if (mClients.empty()) {
+        mEncoder.stop();
+        mFirstTimestamp = 0;
+    }
+}
+
+void VideoStreamer::encodeFrame(const rfb::PixelBuffer* pb, nsecs_t timestamp) {
+    if (mClients.empty()) {
+        return;
+    }
+
+    if (!pb->getPF().equal(AndroidPixelBuffer::sRGBX)) {
+        ALOGW_IF(mFramesSkipped == 0, "Video needs an RGBX framebuffer");
+        mFramesSkipped++;
+        return;
+    }
+
+    // a client still sending an earlier frame drops this one, and then
+    // has to wait for a key frame
+    bool anyReady = false;
+    bool anyWaiting = false;
+    for (auto& client : mClients) {
+        if (!client.pending.empty()) {
+            client.waitingForKeyFrame = true;
+            mFramesDropped++;
+        } else if (client.waitingForKeyFrame) {
+            anyWaiting = true;
+        } else {
+            anyReady = true;
+        }
+    }
+
+    bool keyFrame = mForceKeyFrame ||
+            (anyWaiting && timestamp - mLastKeyFrame >= kMinRecoveryInterval);
+    if (!anyReady && !keyFrame) {
+        mFramesSkipped++;
+        return;
+    }
+
+    // 4:2:0 needs even dimensions, the odd edge is cropped
+    int width = pb->width() & ~1;
+    int height = pb->height() & ~1;
+    if (width != mEncoder.width() || height != mEncoder.height()) {
+        mEncoder.stop();
+        if (width == 0 || height == 0 || !mEncoder.start(width, height)) {
+            return;
+        }
+        // a new encoder starts with a key frame of the new size, which
+        // decoders follow without a new IVF header
+        if (mFirstTimestamp == 0) {
+            mFirstTimestamp = timestamp;
+        }
+    }
+
+    int stride;
+    const uint8_t* src = pb->getBuffer(pb->getRect(), &stride);
+    mEncoder.convert(src, stride);
+
+    mForceKeyFrame = false;
+    mEncoder.encode((timestamp - mFirstTimestamp) / 1000000, keyFrame,
+                    [&](const uint8_t* data, size_t size, bool isKey, int64_t pts) {
+        uint8_t header[kIvfFrameHeaderSize];
+        uint32_t frameSize = htole32(size);
+        uint64_t framePts = htole64(pts);
+        memcpy(header, &frameSize, 4);
+        memcpy(header + 4, &framePts, 8);
+        if (isKey) {
+            mLastKeyFrame = timestamp;
+        }
+
+        for (auto& client : mClients) {
+            if (client.waitingForKeyFrame) {
+                // clients still behind skip the key frame too
+                if (!isKey || !client.pending.empty()) {
+                    continue;
+                }
+                client.waitingForKeyFrame = false;
+                if (!client.sentHeader) {
+                    client.sentHeader = true;
+                    sendHeader(client);
+                }
+            }
+            send(client, header, sizeof(header));
+            send(client, data, size);
+        }
+    });
+    mFramesEncoded++;
+}
+
+void VideoStreamer::sendHeader(Client& client) {
+    uint8_t header[kIvfHeaderSize] = {'D', 'K', 'I', 'F'};
+    uint16_t version = htole16(0);
+    uint16_t headerSize = htole16(kIvfHeaderSize);
+    uint16_t width = htole16(mEncoder.width());
+    uint16_t height = htole16(mEncoder.height());
+    uint32_t rate = htole32(1000);
+    uint32_t scale = htole32(1);
+    memcpy(header + 4, &version, 2);
+    memcpy(header + 6, &headerSize, 2);
+    memcpy(header + 8, "VP80", 4);
+    memcpy(header + 12, &width, 2);
+    memcpy(header + 14, &height, 2);
+    memcpy(header + 16, &rate, 4);
+    memcpy(header + 20, &scale, 4);
+    // frame count unknown for a live stream, left 0
+    send(client, header, sizeof(header));
+}
+
+void VideoStreamer::send(Client& client, const uint8_t* data, size_t size) {
+    if (size == 0 || client.sock->isShutdown()) {
+        return;
+    }
+
+    if (client.pending.empty()) {
+        ssize_t n = ::send(client.sock->getFd(), data, size, MSG_DONTWAIT | MSG_NOSIGNAL);
+        if (n < 0) {
+            if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR) {
+                client.sock->shutdown();
+                return;
+            }
+            n = 0;
+        }
+        mBytesOut += n;
+        data += n;
+        size -= n;
+    }
+
+    client.pending.append((const char*)data, size);
+    if (client.pending.size() > kMaxClientBacklog) {
+        ALOGW("Video client too slow, disconnecting");
+        client.sock->shutdown();
+    }
+}
+
+void VideoStreamer::flush(Client& client) {
+    while (!client.pending.empty()) {
+        ssize_t n = ::send(client.sock->getFd(), client.pending.data(), client.pending.size(),
+                           MSG_DONTWAIT | MSG_NOSIGNAL);
+        if (n < 0) {
+            if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR) {
+                client.sock->shutdown();
+            }
+            return;
+        }
+        mBytesOut += n;
+        client.pending.erase(0, n);
+    }
+}
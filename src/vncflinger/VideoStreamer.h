@@ -0,0 +1,92 @@
+//
+// vncflinger - Copyright (C) 2021 Stefanie Kondik
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+//
+
+#ifndef VIDEO_STREAMER_H_
+#define VIDEO_STREAMER_H_
+
+#include <sys/select.h>
+
+#include <list>
+#include <string>
+
+#include <utils/RefBase.h>
+#include <utils/Timers.h>
+
+#include <network/Socket.h>
+#include <rfb/PixelBuffer.h>
+
+#include "VideoEncoder.h"
+#include "WorkerPool.h"
+
+using namespace android;
+
+namespace vncflinger {
+
+// Streams the framebuffer as VP8 in an IVF container to clients of a
+// separate socket, the same way audiostreamer serves audio. Every client
+// gets the IVF file header when it connects and starts with the next key
+// frame. All calls come from the service thread.
+class VideoStreamer : public RefBase {
+  public:
+    VideoStreamer(sp<WorkerPool> workers, int bitrate);
+
+    virtual ~VideoStreamer();
+
+    // takes ownership of the socket
+    void addClient(network::Socket* sock);
+
+    bool hasClients() {
+        return !mClients.empty();
+    }
+
+    // add client fds for select() and service them afterwards
+    void setFds(fd_set* rfds, fd_set* wfds);
+    void processSockets(fd_set* rfds, fd_set* wfds);
+
+    // encodes a captured frame and queues it to the clients. A client
+    // still sending an earlier frame drops this one and resumes at a key
+    // frame, the others are not held back
+    void encodeFrame(const rfb::PixelBuffer* pb, nsecs_t timestamp);
+
+  private:
+    struct Client {
+        network::Socket* sock;
+        std::string pending;
+        bool sentHeader;
+        // new, or dropped a frame: nothing but a key frame decodes next
+        bool waitingForKeyFrame;
+    };
+
+    void sendHeader(Client& client);
+    void send(Client& client, const uint8_t* data, size_t size);
+    void flush(Client& client);
+
+    VideoEncoder mEncoder;
+    bool mForceKeyFrame;
+    nsecs_t mFirstTimestamp;
+    nsecs_t mLastKeyFrame;
+
+    std::list<Client> mClients;
+
+    uint64_t mFramesEncoded;
+    uint64_t mFramesSkipped;
+    uint64_t mFramesDropped;
+    uint64_t mBytesOut;
+};
+};
+
+#endif
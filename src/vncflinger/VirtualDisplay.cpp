@@ -29,26 +29,26 @@ using namespace vncflinger;
 
 VirtualDisplay::VirtualDisplay(ui::Size* mode, ui::Rotation* state,
                                uint32_t width, uint32_t height, uint32_t layerId,
-                               sp<CpuConsumer::FrameAvailableListener> listener) {
+                               sp<CpuConsumer::FrameAvailableListener> listener,
+                               PixelFormat format, Rect crop) {
     mWidth = width;
     mHeight = height;
     mLayerId = layerId;
-
-    if (*state == ui::ROTATION_0 || *state == ui::ROTATION_180) {
-        mSourceRect = Rect(mode->width, mode->height);
-    } else {
-        mSourceRect = Rect(mode->height, mode->width);
-    }
+    mFormat = format;
+    mPaused = false;
+    setSource(mode, state, crop);
 
     Rect displayRect = getDisplayRect();
 
     sp<IGraphicBufferConsumer> consumer;
     BufferQueue::createBufferQueue(&mProducer, &consumer);
-    mCpuConsumer = new CpuConsumer(consumer, 1);
+    // two, so the newest of several queued frames can be locked
+    // before the one in hand is released
+    mCpuConsumer = new CpuConsumer(consumer, 2);
     mCpuConsumer->setName(String8("vds-to-cpu"));
     mCpuConsumer->setDefaultBufferSize(width, height);
     mProducer->setMaxDequeuedBufferCount(4);
-    consumer->setDefaultBufferFormat(PIXEL_FORMAT_RGBX_8888);
+    consumer->setDefaultBufferFormat(format);
 
     mCpuConsumer->setFrameAvailableListener(listener);
 
@@ -74,6 +74,79 @@ VirtualDisplay::~VirtualDisplay() {
     ALOGV("Virtual display destroyed");
 }
 
+void VirtualDisplay::setSource(ui::Size* mode, ui::Rotation* state, Rect crop) {
+    mMode = *mode;
+    mState = *state;
+    mCrop = crop;
+
+    // a crop composes only that part of the layer stack, in the
+    // orientation it is shown in
+    if (!crop.isEmpty()) {
+        mSourceRect = crop;
+    } else if (*state == ui::ROTATION_0 || *state == ui::ROTATION_180) {
+        mSourceRect = Rect(mode->width, mode->height);
+    } else {
+        mSourceRect = Rect(mode->height, mode->width);
+    }
+}
+
+void VirtualDisplay::resize(ui::Size* mode, ui::Rotation* state, uint32_t width,
+                            uint32_t height, Rect crop) {
+    mWidth = width;
+    mHeight = height;
+    setSource(mode, state, crop);
+
+    Rect displayRect = getDisplayRect();
+
+    // buffers dequeued from now on have the new size, the ones already
+    // queued are told apart by their dimensions
+    mCpuConsumer->setDefaultBufferSize(width, height);
+
+    SurfaceComposerClient::Transaction t;
+    t.setDisplaySize(mDisplayToken, width, height);
+    t.setDisplayProjection(mDisplayToken, *state, mSourceRect, displayRect);
+    t.apply();
+
+    ALOGV("Virtual display %d resized to %ux%u [viewport=%ux%u]", mLayerId, width, height,
+          displayRect.getWidth(), displayRect.getHeight());
+}
+
+void VirtualDisplay::pause() {
+    if (mPaused) {
+        return;
+    }
+    SurfaceComposerClient::Transaction t;
+    t.setDisplaySurface(mDisplayToken, nullptr);
+    t.apply();
+    mPaused = true;
+
+    ALOGV("Virtual display %d paused", mLayerId);
+}
+
+void VirtualDisplay::resume() {
+    if (!mPaused) {
+        return;
+    }
+
+    CpuConsumer::LockedBuffer buffer;
+    while (mCpuConsumer->lockNextBuffer(&buffer) == OK) {
+        mCpuConsumer->unlockBuffer(buffer);
+    }
+
+    SurfaceComposerClient::Transaction t;
+    t.setDisplaySurface(mDisplayToken, mProducer);
+    t.apply();
+    mPaused = false;
+
+    ALOGV("Virtual display %d resumed", mLayerId);
+}
+
+bool VirtualDisplay::matches(ui::Size* mode, ui::Rotation* state, uint32_t width,
+                             uint32_t height, uint32_t layerId, PixelFormat format, Rect crop) {
+    return *mode == mMode && *state == mState && width == mWidth && height == mHeight &&
+           layerId == mLayerId && format == mFormat && crop == mCrop;
+}
+
 Rect VirtualDisplay::getDisplayRect() {
     uint32_t outWidth, outHeight;
     if (mWidth <= (uint32_t)((float)mHeight * aspectRatio())) {
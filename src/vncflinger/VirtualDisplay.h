@@ -25,17 +25,21 @@
 
 #include <ui/DisplayMode.h>
 #include <ui/DisplayState.h>
+#include <ui/PixelFormat.h>
 #include <ui/Rect.h>
 
+#include "FrameSource.h"
+
 using namespace android;
 
 namespace vncflinger {
 
-class VirtualDisplay : public RefBase {
+class VirtualDisplay : public FrameSource {
   public:
     VirtualDisplay(ui::Size* mode, ui::Rotation* state,
                    uint32_t width, uint32_t height, uint32_t layerId,
-                   sp<CpuConsumer::FrameAvailableListener> listener);
+                   sp<CpuConsumer::FrameAvailableListener> listener,
+                   PixelFormat format = PIXEL_FORMAT_RGBX_8888, Rect crop = Rect());
 
     virtual ~VirtualDisplay();
 
@@ -53,7 +57,41 @@ class VirtualDisplay : public RefBase {
         return mCpuConsumer.get();
     }
 
+    virtual status_t lockNextBuffer(CpuConsumer::LockedBuffer* buffer) {
+        return mCpuConsumer->lockNextBuffer(buffer);
+    }
+
+    virtual void unlockBuffer(const CpuConsumer::LockedBuffer& buffer) {
+        mCpuConsumer->unlockBuffer(buffer);
+    }
+
+    // Changes size and projection of the display in place, keeping the
+    // display and its buffer queue
+    void resize(ui::Size* mode, ui::Rotation* state, uint32_t width, uint32_t height,
+                Rect crop);
+
+    // Detaches the surface so nothing is composed for the display while
+    // nobody watches, and attaches it again. Frames queued before the
+    // pause are dropped on resume.
+    void pause();
+    void resume();
+
+    bool isPaused() {
+        return mPaused;
+    }
+
+    // whether the display was set up with these arguments
+    bool matches(ui::Size* mode, ui::Rotation* state, uint32_t width, uint32_t height,
+                 uint32_t layerId, PixelFormat format, Rect crop);
+
+    // whether resize() can bring the display to these arguments
+    bool canResize(uint32_t layerId, PixelFormat format) {
+        return layerId == mLayerId && format == mFormat;
+    }
+
   private:
+    void setSource(ui::Size* mode, ui::Rotation* state, Rect crop);
+
     float aspectRatio() {
         return (float)mSourceRect.getWidth() / (float)mSourceRect.getHeight();
     }
@@ -72,6 +110,12 @@ class VirtualDisplay : public RefBase {
 
     uint32_t mWidth, mHeight;
     Rect mSourceRect;
+
+    ui::Size mMode;
+    ui::Rotation mState;
+    PixelFormat mFormat;
+    Rect mCrop;
+    bool mPaused;
 };
 };
 #endif
@@ -0,0 +1,118 @@
+//
+// vncflinger - Copyright (C) 2021 Stefanie Kondik
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+//
+
+#define LOG_TAG "VNCFlinger:WorkerPool"
+#include <utils/Log.h>
+
+#include "WorkerPool.h"
+
+using namespace vncflinger;
+using namespace android;
+
+WorkerPool::WorkerPool(int threads)
+    : mExiting(false), mBatch(0), mJob(nullptr), mCount(0), mNext(0), mFinished(0), mActive(0) {
+    if (threads <= 0) {
+        threads = std::thread::hardware_concurrency();
+    }
+    for (int i = 1; i < threads; i++) {
+        mThreads.emplace_back(&WorkerPool::threadLoop, this);
+    }
+    ALOGV("Worker pool started with %d threads", size());
+}
+
+WorkerPool::~WorkerPool() {
+    {
+        Mutex::Autolock _l(mLock);
+        mExiting = true;
+        mStart.broadcast();
+    }
+    for (auto& t : mThreads) {
+        t.join();
+    }
+}
+
+void WorkerPool::run(int count, const std::function<void(int)>& job) {
+    if (count <= 0) {
+        return;
+    }
+
+    if (mThreads.empty() || count == 1) {
+        for (int i = 0; i < count; i++) {
+            job(i);
+        }
+        return;
+    }
+
+    {
+        Mutex::Autolock _l(mLock);
+        mJob = &job;
+        mCount = count;
+        mNext = 0;
+        mFinished = 0;
+        mBatch++;
+        mStart.broadcast();
+    }
+
+    work();
+
+    // workers that joined late may still be looking at this batch
+    Mutex::Autolock _l(mLock);
+    while (mFinished < count || mActive > 0) {
+        mDone.wait(mLock);
+    }
+    mJob = nullptr;
+}
+
+void WorkerPool::work() {
+    int done = 0;
+    int i;
+    while ((i = mNext.fetch_add(1)) < mCount) {
+        (*mJob)(i);
+        done++;
+    }
+
+    Mutex::Autolock _l(mLock);
+    mFinished += done;
+    if (mFinished == mCount) {
+        mDone.signal();
+    }
+}
+
+void WorkerPool::threadLoop() {
+    uint64_t seen = 0;
+    while (true) {
+        {
+            Mutex::Autolock _l(mLock);
+            while (!mExiting && (mBatch == seen || mJob == nullptr)) {
+                mStart.wait(mLock);
+            }
+            if (mExiting) {
+                return;
+            }
+            seen = mBatch;
+            mActive++;
+        }
+        work();
+        {
+            Mutex::Autolock _l(mLock);
+            mActive--;
+            if (mActive == 0) {
+                mDone.signal();
+            }
+        }
+    }
+}
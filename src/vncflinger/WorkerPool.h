@@ -0,0 +1,74 @@
+//
+// vncflinger - Copyright (C) 2021 Stefanie Kondik
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+//
+
+#ifndef WORKER_POOL_H_
+#define WORKER_POOL_H_
+
+#include <atomic>
+#include <functional>
+#include <thread>
+#include <vector>
+
+#include <utils/Condition.h>
+#include <utils/Mutex.h>
+#include <utils/RefBase.h>
+
+using namespace android;
+
+namespace vncflinger {
+
+// Fixed set of threads that split a batch of independent jobs between
+// them. Jobs are claimed one at a time from a shared counter, so a slow
+// job never holds up the others, and the caller works on the batch too.
+class WorkerPool : public RefBase {
+  public:
+    WorkerPool(int threads);
+
+    virtual ~WorkerPool();
+
+    // number of threads working on a batch, including the caller
+    int size() {
+        return mThreads.size() + 1;
+    }
+
+    // runs job(0) .. job(count - 1) and returns once all have finished
+    void run(int count, const std::function<void(int)>& job);
+
+  private:
+    void threadLoop();
+
+    void work();
+
+    Mutex mLock;
+    Condition mStart;
+    Condition mDone;
+
+    std::vector<std::thread> mThreads;
+    bool mExiting;
+
+    // current batch
+    uint64_t mBatch;
+    const std::function<void(int)>* mJob;
+    int mCount;
+    std::atomic<int> mNext;
+    int mFinished;
+    // workers currently inside the batch
+    int mActive;
+};
+};
+
+#endif
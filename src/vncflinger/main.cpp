@@ -6,7 +6,12 @@
 #include <android_view_PointerIcon.h>
 
 #include <fcntl.h>
+#include <deque>
 #include <fstream>
+#include <functional>
+#include <list>
+#include <sstream>
+#include <thread>
 #include <signal.h>
 #include <stdio.h>
 #include <sys/types.h>
@@ -15,6 +20,10 @@
 
 #include "AndroidDesktop.h"
 #include "AndroidSocket.h"
+#include "ConnectionMonitor.h"
+#include "SharedFramebuffer.h"
+#include "VideoStreamer.h"
+#include "WorkerPool.h"
 
 #include <binder/IPCThreadState.h>
 #include <binder/IServiceManager.h>
@@ -40,19 +49,51 @@ static std::string mPidFile;
 static char gSerialNo[PROPERTY_VALUE_MAX];
 
 static rfb::IntParameter rfbport("rfbport", "TCP port to listen for RFB protocol", 5900);
+static rfb::IntParameter websocketport("websocketport", "TCP port to accept WebSocket viewers (noVNC) on, 0 to disable", 0);
+static rfb::BoolParameter websocketzerocopy("websocketzerocopy", "Send large WebSocket batches with MSG_ZEROCOPY", true);
+static rfb::StringParameter websocketorigins("websocketorigins", "Comma separated page origins (like https://host:port) allowed to open WebSocket connections besides the host connected to, * for any", "");
 static rfb::BoolParameter localhostOnly("localhost", "Only allow connections from localhost", false);
 static rfb::BoolParameter rfbunixandroid("rfbunixandroid", "Use android control socket to create UNIX socket", true);
 static rfb::StringParameter rfbunixpath("rfbunixpath", "Unix socket to listen for RFB protocol", "");
 static rfb::IntParameter rfbunixmode("rfbunixmode", "Unix socket access mode", 0600);
-
+static rfb::IntParameter capturedepth("capturedepth", "Pixel depth requested from the display, 16 for RGB565 or 32 for RGBX8888", 32);
+static rfb::StringParameter serverformat("serverformat", "Format captured pixels are converted to while copying: rgbx, bgrx, rgb565 or rgb332. Ignored with capturedepth 16", "rgbx");
+static rfb::IntParameter capturethreads("capturethreads", "Threads used to copy captured frames, 0 for one per CPU", 1);
+static rfb::IntParameter tcpnotsentlowat("tcpnotsentlowat", "Unsent bytes a viewer's TCP socket may hold before new updates wait, 0 for the kernel default", 131072);
+static rfb::StringParameter rfbvideopath("rfbvideopath", "Unix socket to stream the display as VP8 in IVF on, empty to disable", "");
+static rfb::StringParameter rfbshmpath("rfbshmpath", "Unix socket to serve the framebuffer as shared memory on, empty to disable", "");
+static rfb::IntParameter videobitrate("videobitrate", "Bit rate of the VP8 stream", 8000000);
+static rfb::IntParameter videotileinterval("videotileinterval", "Minimum time in ms between updates of screen areas playing video, 0 to send every frame", 50);
+static rfb::StringParameter syntheticsize("syntheticsize", "Serve frames of this size (WxH) made up by the server instead of capturing the display, empty to capture", "");
+static rfb::IntParameter syntheticfps("syntheticfps", "Rate of synthetic frames", 60);
+static rfb::StringParameter syntheticreplay("syntheticreplay", "File of raw frames in the capture format to replay as synthetic frames, empty to draw them", "");
+static rfb::StringParameter inputrecord("inputrecord", "File to record viewer input to instead of injecting it, empty to inject", "");
+static rfb::StringParameter displays("displays", "Further displays to serve, comma separated <layer stack>:<width>x<height>:<port or unix socket>. The layer stack may be \"synthetic\"", "");
+static rfb::StringParameter capturerect("capturerect", "Part of the unrotated display to capture as <width>x<height>+<x>+<y>, empty for all of it", "");
+static rfb::BoolParameter pullcapture("pullcapture", "Only copy a new frame when a viewer has sent everything it was given", true);
+static rfb::BoolParameter surfacedamage("surfacedamage", "Copy only the parts of a frame the compositor says it redrew", true);
+
+// Set and cleared by the service thread, which uses it as is. Calls
+// from Java threads take a reference under gDesktopLock, see getDesktop()
 static sp<AndroidDesktop> desktop = NULL;
-static JNIEnv* gEnv;
-static jobject gThiz;
+static Mutex gDesktopLock;
+static sp<WorkerPool> gWorkers = NULL;
 static jmethodID gMethodNewSurfaceAvailable;
 static jmethodID gMethodResizeDisplay;
 static jmethodID gMethodSetClipboard;
 static jmethodID gMethodGetClipboard;
 
+// Calls into the Java service run in order on a thread of their own,
+// attached to the VM, so the service loop never waits on Java. Results
+// come back to the desktop, which wakes the loop.
+static JavaVM* gVm = NULL;
+static jobject gService = NULL;
+static Mutex gCallbackLock;
+static Condition gCallbackCond;
+static std::deque<std::function<void(JNIEnv*)>> gCallbacks;
+static bool gCallbacksExiting = false;
+static std::thread gCallbackThread;
+
 static void printVersion(FILE* fp) {
     fprintf(fp, "VNCFlinger 1.0");
 }
@@ -67,27 +108,118 @@ static void CleanupSignalHandler(int)
     exit(1);
 }
 
+static sp<AndroidDesktop> getDesktop() {
+    Mutex::Autolock _l(gDesktopLock);
+    return desktop;
+}
+
+static void setDesktop(const sp<AndroidDesktop>& d) {
+    Mutex::Autolock _l(gDesktopLock);
+    desktop = d;
+}
+
+static void callbackLoop() {
+    JNIEnv* env;
+    if (gVm->AttachCurrentThread(&env, NULL) != JNI_OK) {
+        ALOGE("Failed to attach the callback thread");
+        return;
+    }
+
+    while (true) {
+        std::function<void(JNIEnv*)> callback;
+        {
+            Mutex::Autolock _l(gCallbackLock);
+            while (gCallbacks.empty() && !gCallbacksExiting) {
+                gCallbackCond.wait(gCallbackLock);
+            }
+            // what was queued before the exit still runs
+            if (gCallbacks.empty()) {
+                break;
+            }
+            callback = std::move(gCallbacks.front());
+            gCallbacks.pop_front();
+        }
+
+        callback(env);
+        if (env->ExceptionCheck()) {
+            env->ExceptionDescribe();
+            env->ExceptionClear();
+        }
+    }
+
+    gVm->DetachCurrentThread();
+}
+
+static void postCallback(std::function<void(JNIEnv*)> callback) {
+    Mutex::Autolock _l(gCallbackLock);
+    if (gService == NULL) {
+        ALOGW("Java callback without a service");
+        return;
+    }
+    gCallbacks.push_back(std::move(callback));
+    gCallbackCond.signal();
+}
+
+static void stopCallbacks(JNIEnv* env) {
+    if (gCallbackThread.joinable()) {
+        {
+            Mutex::Autolock _l(gCallbackLock);
+            gCallbacksExiting = true;
+            gCallbackCond.signal();
+        }
+        gCallbackThread.join();
+    }
+
+    Mutex::Autolock _l(gCallbackLock);
+    if (gService != NULL) {
+        env->DeleteGlobalRef(gService);
+        gService = NULL;
+    }
+    gCallbacks.clear();
+}
+
+static void startCallbacks(JNIEnv* env, jobject thiz) {
+    stopCallbacks(env);
+
+    env->GetJavaVM(&gVm);
+    gService = env->NewGlobalRef(thiz);
+    gCallbacksExiting = false;
+    gCallbackThread = std::thread(callbackLoop);
+}
+
 void runJniCallbackNewSurfaceAvailable() {
-    gEnv->CallVoidMethod(gThiz, gMethodNewSurfaceAvailable);
+    postCallback([](JNIEnv* env) {
+        env->CallVoidMethod(gService, gMethodNewSurfaceAvailable);
+    });
 }
 
 void runJniCallbackResizeDisplay(int32_t width, int32_t height) {
-    gEnv->CallVoidMethod(gThiz, gMethodResizeDisplay, width, height);
+    postCallback([width, height](JNIEnv* env) {
+        env->CallVoidMethod(gService, gMethodResizeDisplay, width, height);
+    });
 }
 
 void runJniCallbackSetClipboard(const char* text) {
-    jstring jtext = gEnv->NewStringUTF(text);
-    gEnv->CallVoidMethod(gThiz, gMethodSetClipboard, jtext);
-    gEnv->DeleteLocalRef(jtext);
+    std::string copy(text);
+    postCallback([copy](JNIEnv* env) {
+        jstring jtext = env->NewStringUTF(copy.c_str());
+        env->CallVoidMethod(gService, gMethodSetClipboard, jtext);
+        env->DeleteLocalRef(jtext);
+    });
 }
 
-const char* runJniCallbackGetClipboard() {
-    jstring jtext = (jstring)gEnv->CallObjectMethod(gThiz, gMethodGetClipboard);
-    const char* text = gEnv->GetStringUTFChars(jtext, NULL);
-    char* result = strdup(text);
-    gEnv->ReleaseStringUTFChars(jtext, text);
-    gEnv->DeleteLocalRef(jtext);
-    return result;
+void runJniCallbackGetClipboard(AndroidDesktop* target) {
+    sp<AndroidDesktop> d = target;
+    postCallback([d](JNIEnv* env) {
+        jstring jtext = (jstring)env->CallObjectMethod(gService, gMethodGetClipboard);
+        if (jtext == NULL) {
+            return;
+        }
+        const char* text = env->GetStringUTFChars(jtext, NULL);
+        d->onClipboardReply(text);
+        env->ReleaseStringUTFChars(jtext, text);
+        env->DeleteLocalRef(jtext);
+    });
 }
 
 int desktopSetup(int argc, char** argv);
@@ -97,7 +229,8 @@ extern "C" void Java_com_libremobileos_vncflinger_VncFlinger_notifyServerCursorC
     JNIEnv* env, jobject thiz, jobject pointerIconObj) {
     PointerIcon pointerIcon;
 
-    if (desktop != NULL) {
+    sp<AndroidDesktop> d = getDesktop();
+    if (d != NULL) {
         status_t result = android_view_PointerIcon_getLoadedIcon(env, pointerIconObj, &pointerIcon);
         if (result) {
             ALOGE("Failed to load pointer icon.");
@@ -109,8 +242,8 @@ extern "C" void Java_com_libremobileos_vncflinger_VncFlinger_notifyServerCursorC
         }
         AndroidBitmapInfo bitmapInfo = pointerIcon.bitmap.getInfo();
 
-	    desktop->setCursor(bitmapInfo.width, bitmapInfo.height, pointerIcon.hotSpotX,
-                           pointerIcon.hotSpotY, (rdr::U8*)pointerIcon.bitmap.getPixels());
+	    d->setCursor(bitmapInfo.width, bitmapInfo.height, pointerIcon.hotSpotX,
+                     pointerIcon.hotSpotY, (rdr::U8*)pointerIcon.bitmap.getPixels());
     }
     return;
 }
@@ -128,31 +261,29 @@ extern "C" jint Java_com_libremobileos_vncflinger_VncFlinger_initializeVncFlinge
 		env->DeleteLocalRef(o);
 	}
 	env->DeleteLocalRef(command_line_args);
-	gThiz = thiz; gEnv = env;
     gMethodNewSurfaceAvailable =
         env->GetMethodID(env->GetObjectClass(thiz), "onNewSurfaceAvailable", "()V");
     gMethodResizeDisplay = env->GetMethodID(env->GetObjectClass(thiz), "onResizeDisplay", "(II)V");
     gMethodSetClipboard = env->GetMethodID(env->GetObjectClass(thiz), "setServerClipboard", "(Ljava/lang/String;)V");
     gMethodGetClipboard = env->GetMethodID(env->GetObjectClass(thiz), "getServerClipboard", "()Ljava/lang/String;");
+	startCallbacks(env, thiz);
 	return desktopSetup(argc, argv);
 }
 
 extern "C" jobject Java_com_libremobileos_vncflinger_VncFlinger_getSurface(JNIEnv * env,
 																			jobject thiz
 ) {
-	if (desktop == NULL) {
+	sp<AndroidDesktop> d = getDesktop();
+	if (d == NULL) {
 		ALOGV("getSurface: desktop == NULL");
 		return NULL;
 	}
-	if (desktop->mVirtualDisplay == NULL){
-		ALOGW("getSurface: mVirtualDisplay == NULL");
+	sp<IGraphicBufferProducer> producer = d->getSurfaceProducer();
+	if (producer == NULL){
+		ALOGW("getSurface: no virtual display");
 		return NULL;
 	}
-	if (desktop->mVirtualDisplay->getProducer() == NULL){
-		ALOGW("getSurface: getProducer() == NULL");
-		return NULL;
-	}
-	ANativeWindow* w = new Surface(desktop->mVirtualDisplay->getProducer(), true);
+	ANativeWindow* w = new Surface(producer, true);
 	//Rect dr = desktop->mVirtualDisplay->getDisplayRect();
 	//if we want to bring back window resizing without display resize, we need to scale buffer to dr
 	if (w == NULL) {
@@ -167,8 +298,9 @@ extern "C" jobject Java_com_libremobileos_vncflinger_VncFlinger_getSurface(JNIEn
 }
 
 extern "C" jint Java_com_libremobileos_vncflinger_VncFlinger_startService(JNIEnv* env, jobject thiz) {
-	gThiz = thiz; gEnv = env;
-    return startService();
+    int ret = startService();
+    stopCallbacks(env);
+    return ret;
 }
 
 extern "C" void Java_com_libremobileos_vncflinger_VncFlinger_quit(JNIEnv *env, jobject thiz) {
@@ -179,20 +311,40 @@ extern "C" void Java_com_libremobileos_vncflinger_VncFlinger_setDisplayProps(JNI
                                                                               jobject thiz, jint w,
                                                                               jint h, jint rotation, jint layerId, jboolean touch,
                                                                               jboolean relative) {
-	if (desktop == NULL) {
+	sp<AndroidDesktop> d = getDesktop();
+	if (d == NULL) {
 		ALOGW("setDisplayProps: desktop == NULL");
 		return;
 	}
-	desktop->_width = w; desktop->_height = h; desktop->_rotation = rotation; desktop->mLayerId = layerId; desktop->touch = touch; desktop->relative = relative;
+	d->setDisplayProps(w, h, rotation, layerId, touch, relative);
 }
 
 extern "C" void Java_com_libremobileos_vncflinger_VncFlinger_notifyServerClipboardChanged(
     JNIEnv* env, jobject thiz) {
-    if (desktop == NULL) {
+    sp<AndroidDesktop> d = getDesktop();
+    if (d == NULL) {
         ALOGW("notifyClipboardChanged: desktop == NULL");
         return;
     }
-    desktop->notifyClipboardChanged();
+    d->notifyClipboardChanged();
+}
+
+// settings shared by every desktop of the process
+static void configureDesktop(const sp<AndroidDesktop>& d) {
+	d->setCaptureDepth(capturedepth);
+	d->setServerFormat(serverformat);
+	d->setVideoTileInterval(videotileinterval);
+	d->setSurfaceDamage(surfacedamage);
+	d->setInputRecording(inputrecord);
+
+	if (capturerect.getValueStr()[0] != '\0') {
+		int w, h, x, y;
+		if (sscanf(capturerect, "%dx%d+%d+%d", &w, &h, &x, &y) == 4 && w > 0 && h > 0) {
+			d->setCaptureRect(Rect(x, y, x + w, y + h));
+		} else {
+			ALOGE("Invalid capture rect %s", (const char*)capturerect);
+		}
+	}
 }
 
 int desktopSetup(int argc, char** argv) {
@@ -239,11 +391,101 @@ int desktopSetup(int argc, char** argv) {
 		return 5;
 	}
 
-	desktop = new AndroidDesktop();
+	gWorkers = new WorkerPool(capturethreads);
+	setDesktop(new AndroidDesktop(gWorkers));
+	configureDesktop(desktop);
+
+	if (syntheticsize.getValueStr()[0] != '\0') {
+		int w, h;
+		if (sscanf(syntheticsize, "%dx%d", &w, &h) != 2 || w <= 0 || h <= 0) {
+			ALOGE("Invalid synthetic size %s", (const char*)syntheticsize);
+			return 5;
+		}
+		desktop->setSyntheticFrames(w, h, syntheticfps, syntheticreplay);
+	}
 
 	return 0;
 }
 
+// One desktop with the RFB server and listeners in front of it. All
+// sessions share the service loop, the binder threads and the capture
+// workers; the first one is the display the Java service manages.
+struct Session {
+    sp<AndroidDesktop> desktop;
+    rfb::VNCServerST* server = NULL;
+    ConnectionMonitor* monitor = NULL;
+    std::list<network::SocketListener*> listeners;
+
+    Session() {}
+    Session(const Session&) = delete;
+
+    ~Session() {
+        delete monitor;
+        delete server;
+        for (std::list<network::SocketListener*>::iterator i = listeners.begin();
+             i != listeners.end(); i++)
+            delete (*i);
+    }
+};
+
+static void startSession(Session& session, const sp<AndroidDesktop>& d, const std::string& name) {
+    session.desktop = d;
+    session.server = new rfb::VNCServerST(name.c_str(), d.get());
+    session.monitor = new ConnectionMonitor(tcpnotsentlowat);
+    session.monitor->setLinkListener(d.get());
+
+    int eventFd = d->getEventFd();
+    fcntl(eventFd, F_SETFL, O_NONBLOCK);
+}
+
+static void listenOn(Session& session, const std::string& endpoint) {
+    if (endpoint[0] == '@') {
+        session.listeners.push_back(new AbsUnixListener(endpoint.c_str()));
+    } else if (endpoint[0] == '/') {
+        session.listeners.push_back(new network::UnixListener(endpoint.c_str(), rfbunixmode));
+    } else if (localhostOnly) {
+        network::createLocalTcpListeners(&session.listeners, atoi(endpoint.c_str()));
+    } else {
+        network::createTcpListeners(&session.listeners, 0, atoi(endpoint.c_str()));
+    }
+}
+
+// sets up the sessions of the displays parameter, after the main one
+static bool addDisplaySessions(std::list<Session>& sessions, const std::string& desktopName) {
+    std::stringstream specs(displays.getValueStr());
+    std::string spec;
+    int index = 1;
+
+    while (std::getline(specs, spec, ',')) {
+        if (spec.empty())
+            continue;
+
+        char layerStack[32], endpoint[108];
+        int w, h;
+        if (sscanf(spec.c_str(), "%31[^:]:%dx%d:%107s", layerStack, &w, &h, endpoint) != 4 ||
+            w <= 0 || h <= 0) {
+            ALOGE("Invalid display %s", spec.c_str());
+            return false;
+        }
+
+        sp<AndroidDesktop> d = new AndroidDesktop(gWorkers, false);
+        configureDesktop(d);
+        if (strcmp(layerStack, "synthetic") == 0) {
+            d->setSyntheticFrames(w, h, syntheticfps, "");
+        } else {
+            d->setDisplayProps(w, h, 0, atoi(layerStack), false, false);
+        }
+
+        sessions.emplace_back();
+        std::stringstream name;
+        name << desktopName << " #" << index++;
+        startSession(sessions.back(), d, name.str());
+        listenOn(sessions.back(), endpoint);
+        ALOGI("Display %s (%dx%d) on %s", layerStack, w, h, endpoint);
+    }
+    return true;
+}
+
 int startService() {
 	property_get("ro.build.product", gSerialNo, "");
 	std::string desktopName = "VNCFlinger";
@@ -253,10 +495,19 @@ int startService() {
     sp<ProcessState> self = ProcessState::self();
     self->startThreadPool();
 
-    std::list<network::SocketListener*> listeners;
+    network::SocketListener* videoListener = NULL;
+    WebSocketListener* wsListener = NULL;
+    network::SocketListener* shmListener = NULL;
+    sp<SharedFramebuffer> shared = NULL;
+    sp<VideoStreamer> video = NULL;
     int ret = 0;
     try {
-        rfb::VNCServerST server(desktopName.c_str(), desktop.get());
+        std::list<Session> sessions;
+        sessions.emplace_back();
+        Session& primary = sessions.front();
+        startSession(primary, desktop, desktopName);
+        rfb::VNCServerST& server = *primary.server;
+        std::list<network::SocketListener*>& listeners = primary.listeners;
 
         if (rfbunixpath.getValueStr()[0] != '\0') {
 			if (rfbunixandroid) {
@@ -278,8 +529,38 @@ int startService() {
             }
         }
 
-        int eventFd = desktop->getEventFd();
-        fcntl(eventFd, F_SETFL, O_NONBLOCK);
+        if (websocketport > 0) {
+            wsListener = new WebSocketListener(websocketport, localhostOnly, websocketzerocopy,
+                                               websocketorigins);
+            listeners.push_back(wsListener);
+            ALOGI("Listening for WebSocket viewers on port %d", (int)websocketport);
+        }
+
+        if (rfbvideopath.getValueStr()[0] != '\0') {
+            if (rfbvideopath.getValueStr()[0] != '@') {
+                videoListener = new network::UnixListener(rfbvideopath, rfbunixmode);
+            } else {
+                videoListener = new AbsUnixListener(rfbvideopath);
+            }
+            video = new VideoStreamer(gWorkers, videobitrate);
+            desktop->setVideoStreamer(video);
+            ALOGI("Streaming video on %s", (const char*)rfbvideopath);
+        }
+
+        if (rfbshmpath.getValueStr()[0] != '\0') {
+            if (rfbshmpath.getValueStr()[0] != '@') {
+                shmListener = new network::UnixListener(rfbshmpath, rfbunixmode);
+            } else {
+                shmListener = new AbsUnixListener(rfbshmpath);
+            }
+            shared = new SharedFramebuffer();
+            desktop->setSharedFramebuffer(shared);
+            ALOGI("Sharing the framebuffer on %s", (const char*)rfbshmpath);
+        }
+
+        if (!addDisplaySessions(sessions, desktopName)) {
+            throw rdr::Exception("invalid displays parameter");
+        }
 
         if (mPidFile.length() != 0) {
             // write a pid file
@@ -300,26 +581,40 @@ int startService() {
             FD_ZERO(&rfds);
             FD_ZERO(&wfds);
 
-            FD_SET(eventFd, &rfds);
-            for (std::list<network::SocketListener*>::iterator i = listeners.begin();
-                 i != listeners.end(); i++)
-                FD_SET((*i)->getFd(), &rfds);
-
-            server.getSockets(&sockets);
-            int clients_connected = 0;
-            for (i = sockets.begin(); i != sockets.end(); i++) {
-                if ((*i)->isShutdown()) {
-                    server.removeSocket(*i);
-                    delete (*i);
-                } else {
+            for (Session& s : sessions) {
+                FD_SET(s.desktop->getEventFd(), &rfds);
+                for (std::list<network::SocketListener*>::iterator i = s.listeners.begin();
+                     i != s.listeners.end(); i++)
                     FD_SET((*i)->getFd(), &rfds);
-                    if ((*i)->outStream().hasBufferedData()) {
-                        FD_SET((*i)->getFd(), &wfds);
+
+                s.server->getSockets(&sockets);
+                for (i = sockets.begin(); i != sockets.end(); i++) {
+                    if ((*i)->isShutdown()) {
+                        s.server->removeSocket(*i);
+                        s.monitor->removeSocket(*i);
+                        delete (*i);
+                    } else {
+                        FD_SET((*i)->getFd(), &rfds);
+                        if ((*i)->outStream().hasBufferedData()) {
+                            FD_SET((*i)->getFd(), &wfds);
+                        }
                     }
-                    clients_connected++;
                 }
             }
 
+            if (videoListener != NULL) {
+                FD_SET(videoListener->getFd(), &rfds);
+                video->setFds(&rfds, &wfds);
+            }
+
+            if (wsListener != NULL)
+                wsListener->setFds(&rfds, &wfds);
+
+            if (shmListener != NULL) {
+                FD_SET(shmListener->getFd(), &rfds);
+                shared->setFds(&rfds);
+            }
+
             wait_ms = 0;
 
             rfb::soonestTimeout(&wait_ms, rfb::Timer::checkTimeouts());
@@ -339,56 +634,121 @@ int startService() {
             }
 
             // Accept new VNC connections
-            for (std::list<network::SocketListener*>::iterator i = listeners.begin();
-                 i != listeners.end(); i++) {
-                if (FD_ISSET((*i)->getFd(), &rfds)) {
-                    network::Socket* sock = (*i)->accept();
+            for (Session& s : sessions) {
+                for (std::list<network::SocketListener*>::iterator i = s.listeners.begin();
+                     i != s.listeners.end(); i++) {
+                    if (FD_ISSET((*i)->getFd(), &rfds)) {
+                        network::Socket* sock = (*i)->accept();
+                        if (sock) {
+                            // WebSocket viewers reach the server through
+                            // a socket pair, the monitor looks past it
+                            s.monitor->addSocket(sock, *i == wsListener ? wsListener : NULL);
+                            s.server->addSocket(sock);
+                        } else {
+                            ALOGW("Client connection rejected");
+                        }
+                    }
+                }
+            }
+
+            if (videoListener != NULL) {
+                bool wasStreaming = video->hasClients();
+                if (FD_ISSET(videoListener->getFd(), &rfds)) {
+                    network::Socket* sock = videoListener->accept();
                     if (sock) {
-                        server.addSocket(sock);
-                    } else {
-                        ALOGW("Client connection rejected");
+                        video->addClient(sock);
                     }
                 }
+                video->processSockets(&rfds, &wfds);
+
+                // same for video clients
+                if (!wasStreaming && video->hasClients())
+                    desktop->start(&server);
+                else if (wasStreaming && !video->hasClients())
+                    desktop->stop();
+            }
+
+            if (wsListener != NULL)
+                wsListener->processSockets(&rfds, &wfds);
+
+            if (shmListener != NULL) {
+                bool wasSharing = shared->hasClients();
+                if (FD_ISSET(shmListener->getFd(), &rfds)) {
+                    network::Socket* sock = shmListener->accept();
+                    if (sock) {
+                        shared->addClient(sock);
+                    }
+                }
+                shared->processSockets(&rfds);
+
+                // shared memory clients keep the capture running on
+                // their own, without any RFB viewer
+                if (!wasSharing && shared->hasClients())
+                    desktop->start(&server);
+                else if (wasSharing && !shared->hasClients())
+                    desktop->stop();
             }
 
             rfb::Timer::checkTimeouts();
 
-            // Client list could have been changed.
-            server.getSockets(&sockets);
+            for (Session& s : sessions) {
+                // Events from the display are read even when nobody is
+                // connected, a pending one would wake select() right
+                // away again and spin the loop
+                uint64_t eventVal = 0;
+                bool displayEvent = false;
+                if (FD_ISSET(s.desktop->getEventFd(), &rfds)) {
+                    int status = read(s.desktop->getEventFd(), &eventVal, sizeof(eventVal));
+                    displayEvent = status > 0 && eventVal > 0;
+                }
 
-            // Nothing more to do if there are no client connections.
-            if (sockets.empty()) continue;
+                // Client list could have been changed.
+                s.server->getSockets(&sockets);
 
-            // Process events on existing VNC connections
-            for (i = sockets.begin(); i != sockets.end(); i++) {
-                if (FD_ISSET((*i)->getFd(), &rfds)) server.processSocketReadEvent(*i);
-                if (FD_ISSET((*i)->getFd(), &wfds)) server.processSocketWriteEvent(*i);
-            }
+                // Nothing more to do if there are no client connections.
+                bool sharing = &s == &primary && ((shared != NULL && shared->hasClients()) ||
+                                                  (video != NULL && video->hasClients()));
+                if (sockets.empty() && !sharing) continue;
 
-	        // Process events from the display
-            uint64_t eventVal;
-            int status = read(eventFd, &eventVal, sizeof(eventVal));
-            if (status > 0 && eventVal > 0) {
-                //ALOGV("status=%d eventval=%" PRIu64, status, eventVal);
-	            desktop->processCursor();
-                desktop->processFrames();
-	            desktop->processClipboard();
-            }
+                // Process events on existing VNC connections
+                for (i = sockets.begin(); i != sockets.end(); i++) {
+                    if (FD_ISSET((*i)->getFd(), &rfds)) s.server->processSocketReadEvent(*i);
+                    if (FD_ISSET((*i)->getFd(), &wfds)) s.server->processSocketWriteEvent(*i);
+                }
+
+	            // Process events from the display
+                if (displayEvent) {
+                    //ALOGV("eventval=%" PRIu64, eventVal);
+	                s.desktop->processCursor();
+	                s.desktop->processClipboard();
+	                s.desktop->processDisplayProps();
+                }
 
+                // In pull mode a frame waits while every viewer still has
+                // output queued, it would only be overwritten by the next
+                // one before it is sent. The viewer's socket becoming
+                // writable brings us back here. Side channels take every
+                // frame.
+                bool ready = !pullcapture || sharing;
+                for (i = sockets.begin(); !ready && i != sockets.end(); i++) {
+                    ready = !(*i)->outStream().hasBufferedData();
+                }
+                if (ready && s.desktop->hasPendingFrame())
+                    s.desktop->processFrames();
+            }
         }
         ret = 0;
     } catch (rdr::Exception& e) {
         ALOGE("%s", e.str());
         ret = 3;
     }
-	desktop = NULL;
+	setDesktop(NULL);
+	video = NULL;
+	shared = NULL;
+	delete videoListener;
+	delete shmListener;
     ALOGI("Bye - cleaning up");
-	gEnv = NULL;
-	gThiz = NULL;
 	gSerialNo[0] = '\0';
-	for (std::list<network::SocketListener*>::iterator i = listeners.begin();
-	     i != listeners.end(); i++)
-		delete (*i);
     if (mPidFile.length() != 0) {
         remove(mPidFile.c_str());
     }
@@ -0,0 +1,64 @@
+//
+// vncflinger - Copyright (C) 2021 Stefanie Kondik
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+//
+
+#include <gtest/gtest.h>
+
+#include "CaptureArea.h"
+
+using namespace vncflinger;
+
+static const ui::Size kMode(1080, 2400);
+
+TEST(CaptureAreaTest, ClipsToTheDisplay) {
+    EXPECT_EQ(Rect(100, 200, 600, 900),
+              captureArea(Rect(100, 200, 600, 900), kMode, ui::ROTATION_0));
+    EXPECT_EQ(Rect(0, 2000, 1080, 2400),
+              captureArea(Rect(-50, 2000, 1500, 3000), kMode, ui::ROTATION_0));
+    EXPECT_TRUE(captureArea(Rect(1200, 0, 1400, 100), kMode, ui::ROTATION_0).isEmpty());
+}
+
+TEST(CaptureAreaTest, CapturesAllOfARotatedDisplay) {
+    // a crop in displayed coordinates would put the pointer in the
+    // wrong place on the natural orientation input device
+    const Rect crop(100, 200, 600, 900);
+    EXPECT_TRUE(captureArea(crop, kMode, ui::ROTATION_90).isEmpty());
+    EXPECT_TRUE(captureArea(crop, kMode, ui::ROTATION_180).isEmpty());
+    EXPECT_TRUE(captureArea(crop, kMode, ui::ROTATION_270).isEmpty());
+}
+
+TEST(CaptureAreaTest, MapsThePointerIntoTheArea) {
+    const Rect area = captureArea(Rect(100, 200, 600, 900), kMode, ui::ROTATION_0);
+    uint32_t x, y;
+
+    // the viewport shows the area at twice its size
+    mapPointer(area, kMode, 1000, 1400, 0, 0, &x, &y);
+    EXPECT_EQ(100u, x);
+    EXPECT_EQ(200u, y);
+    mapPointer(area, kMode, 1000, 1400, 500, 700, &x, &y);
+    EXPECT_EQ(350u, x);
+    EXPECT_EQ(550u, y);
+    mapPointer(area, kMode, 1000, 1400, 1000, 1400, &x, &y);
+    EXPECT_EQ(600u, x);
+    EXPECT_EQ(900u, y);
+}
+
+TEST(CaptureAreaTest, MapsThePointerOntoAllOfTheDisplay) {
+    uint32_t x, y;
+    mapPointer(Rect(), kMode, 540, 1200, 270, 600, &x, &y);
+    EXPECT_EQ(540u, x);
+    EXPECT_EQ(1200u, y);
+}
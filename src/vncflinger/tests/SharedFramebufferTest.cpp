@@ -0,0 +1,451 @@
+//
+// vncflinger - Copyright (C) 2021 Stefanie Kondik
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+//
+
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <unistd.h>
+
+#include <atomic>
+#include <thread>
+#include <vector>
+
+#include <gtest/gtest.h>
+
+#include <network/UnixSocket.h>
+#include <rfb/PixelBuffer.h>
+
+#include "SharedFramebuffer.h"
+
+using namespace vncflinger;
+
+// the other end of the transport, what a local client does with it
+class SharedFrameReader {
+  public:
+    explicit SharedFrameReader(int sock) : mSock(sock), mFd(-1), mMap(nullptr), mSize(0) {
+        struct timeval tv = {2, 0};
+        setsockopt(mSock, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+    }
+
+    ~SharedFrameReader() {
+        unmap();
+        close(mSock);
+    }
+
+    // reads one message, a config's memfd replaces the current mapping
+    bool readMessage(SharedFrameMessage* msg, std::vector<SharedFrameRect>* rects) {
+        char control[CMSG_SPACE(sizeof(int))];
+        struct iovec iov = {msg, sizeof(*msg)};
+        struct msghdr hdr = {};
+        hdr.msg_iov = &iov;
+        hdr.msg_iovlen = 1;
+        hdr.msg_control = control;
+        hdr.msg_controllen = sizeof(control);
+        if (recvmsg(mSock, &hdr, MSG_WAITALL) != (ssize_t)sizeof(*msg)) {
+            return false;
+        }
+
+        int fd = -1;
+        for (struct cmsghdr* cmsg = CMSG_FIRSTHDR(&hdr); cmsg != nullptr;
+             cmsg = CMSG_NXTHDR(&hdr, cmsg)) {
+            if (cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SCM_RIGHTS) {
+                memcpy(&fd, CMSG_DATA(cmsg), sizeof(fd));
+            }
+        }
+        if (fd >= 0 && !map(fd, *msg)) {
+            return false;
+        }
+
+        rects->resize(msg->count);
+        if (msg->count > 0) {
+            const size_t size = msg->count * sizeof(SharedFrameRect);
+            if (recv(mSock, rects->data(), size, MSG_WAITALL) != (ssize_t)size) {
+                return false;
+            }
+        }
+        return true;
+    }
+
+    bool skip(size_t bytes) {
+        std::vector<char> buf(bytes);
+        return recv(mSock, buf.data(), bytes, MSG_WAITALL) == (ssize_t)bytes;
+    }
+
+    bool hasData() {
+        struct pollfd pfd = {mSock, POLLIN, 0};
+        return poll(&pfd, 1, 0) > 0;
+    }
+
+    // seqlock: a copy made between begin() and a successful validate()
+    // is a whole frame
+    uint32_t begin() {
+        uint32_t seq;
+        while ((seq = header()->sequence.load(std::memory_order_acquire)) & 1) {
+            std::this_thread::yield();
+        }
+        return seq;
+    }
+
+    bool validate(uint32_t seq) {
+        std::atomic_thread_fence(std::memory_order_acquire);
+        return header()->sequence.load(std::memory_order_relaxed) == seq;
+    }
+
+    // copies the frame, returns the number of retries
+    int readFrame(std::vector<uint8_t>* pixels) {
+        int retries = 0;
+        while (true) {
+            uint32_t seq = begin();
+            const size_t size = (size_t)header()->stride * header()->height;
+            pixels->resize(size);
+            memcpy(pixels->data(), mMap + kShmPixelOffset, size);
+            if (validate(seq)) {
+                return retries;
+            }
+            retries++;
+        }
+    }
+
+    const SharedFrameHeader* header() {
+        return (const SharedFrameHeader*)mMap;
+    }
+
+    const uint8_t* pixel(int x, int y) {
+        return mMap + kShmPixelOffset + y * header()->stride + x * header()->bpp / 8;
+    }
+
+    int fd() {
+        return mFd;
+    }
+
+    size_t size() {
+        return mSize;
+    }
+
+  private:
+    bool map(int fd, const SharedFrameMessage& msg) {
+        unmap();
+        mFd = fd;
+        mSize = kShmPixelOffset + (size_t)msg.stride * msg.height;
+        void* map = mmap(nullptr, mSize, PROT_READ, MAP_SHARED, fd, 0);
+        if (map == MAP_FAILED) {
+            return false;
+        }
+        mMap = (const uint8_t*)map;
+        return true;
+    }
+
+    void unmap() {
+        if (mMap != nullptr) {
+            munmap((void*)mMap, mSize);
+        }
+        if (mFd >= 0) {
+            close(mFd);
+        }
+        mMap = nullptr;
+        mFd = -1;
+    }
+
+    int mSock;
+    int mFd;
+    const uint8_t* mMap;
+    size_t mSize;
+};
+
+static const rfb::PixelFormat kRGBX(32, 24, false, true, 255, 255, 255, 0, 8, 16);
+
+class SharedFramebufferTest : public ::testing::Test {
+  protected:
+    void SetUp() override {
+        int sv[2];
+        ASSERT_EQ(0, socketpair(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0, sv));
+        mServerFd = sv[0];
+        mShared = new SharedFramebuffer();
+        mShared->addClient(new network::UnixSocket(sv[0]));
+        mReader = new SharedFrameReader(sv[1]);
+        resize(320, 200);
+    }
+
+    void TearDown() override {
+        delete mReader;
+        mShared = nullptr;
+    }
+
+    void resize(int width, int height) {
+        mPixels.setPF(kRGBX);
+        mPixels.setSize(width, height);
+        fill(mPixels.getRect(), 0);
+    }
+
+    // every pixel of |r| set to |value|
+    void fill(const rfb::Rect& r, uint32_t value) {
+        int stride;
+        uint8_t* p = mPixels.getBufferRW(r, &stride);
+        for (int y = 0; y < r.height(); y++) {
+            uint32_t* row = (uint32_t*)(p + y * stride * 4);
+            for (int x = 0; x < r.width(); x++) {
+                row[x] = value;
+            }
+        }
+        mPixels.commitBufferRW(r);
+    }
+
+    void update(const rfb::Region& changed) {
+        mShared->update(&mPixels, changed);
+    }
+
+    static rfb::Region regionOf(const std::vector<SharedFrameRect>& rects) {
+        rfb::Region region;
+        for (const SharedFrameRect& r : rects) {
+            region.assign_union(rfb::Region(rfb::Rect(r.x, r.y, r.x + r.w, r.y + r.h)));
+        }
+        return region;
+    }
+
+    // config and full damage of the first frame
+    void readFirstFrame() {
+        SharedFrameMessage msg;
+        std::vector<SharedFrameRect> rects;
+        ASSERT_TRUE(mReader->readMessage(&msg, &rects));
+        ASSERT_EQ(kShmConfig, msg.type);
+        ASSERT_TRUE(mReader->readMessage(&msg, &rects));
+        ASSERT_EQ(kShmDamage, msg.type);
+    }
+
+    int mServerFd;
+    sp<SharedFramebuffer> mShared;
+    SharedFrameReader* mReader;
+    rfb::ManagedPixelBuffer mPixels;
+};
+
+TEST_F(SharedFramebufferTest, NothingBeforeTheFirstFrame) {
+    EXPECT_TRUE(mShared->hasClients());
+    EXPECT_FALSE(mReader->hasData());
+}
+
+TEST_F(SharedFramebufferTest, ConfigCarriesTheMemfd) {
+    fill(rfb::Rect(10, 20, 30, 40), 0x00332211);
+    update(mPixels.getRect());
+
+    SharedFrameMessage msg;
+    std::vector<SharedFrameRect> rects;
+    ASSERT_TRUE(mReader->readMessage(&msg, &rects));
+    EXPECT_EQ(kShmConfig, msg.type);
+    EXPECT_EQ(320u, msg.width);
+    EXPECT_EQ(200u, msg.height);
+    EXPECT_EQ(320u * 4, msg.stride);
+    EXPECT_EQ(32u, msg.bpp);
+    EXPECT_EQ(0u, msg.redShift);
+    EXPECT_EQ(8u, msg.greenShift);
+    EXPECT_EQ(16u, msg.blueShift);
+    EXPECT_EQ(0u, msg.count);
+    EXPECT_EQ(0u, msg.sequence & 1);
+    ASSERT_GE(mReader->fd(), 0);
+
+    const SharedFrameHeader* header = mReader->header();
+    EXPECT_EQ(kShmMagic, header->magic);
+    EXPECT_EQ(kShmVersion, header->version);
+    EXPECT_EQ(320u, header->width);
+    EXPECT_EQ(200u, header->height);
+    EXPECT_EQ(1u, header->frames);
+
+    // the first frame is damaged in full
+    ASSERT_TRUE(mReader->readMessage(&msg, &rects));
+    EXPECT_EQ(kShmDamage, msg.type);
+    EXPECT_TRUE(regionOf(rects).equals(rfb::Region(mPixels.getRect())));
+
+    uint32_t v;
+    memcpy(&v, mReader->pixel(15, 25), sizeof(v));
+    EXPECT_EQ(0x00332211u, v);
+    memcpy(&v, mReader->pixel(0, 0), sizeof(v));
+    EXPECT_EQ(0u, v);
+}
+
+TEST_F(SharedFramebufferTest, MappingIsReadOnly) {
+    update(mPixels.getRect());
+    readFirstFrame();
+
+    // the size is sealed
+    EXPECT_NE(0, ftruncate(mReader->fd(), mReader->size() * 2));
+    EXPECT_NE(0, ftruncate(mReader->fd(), kShmPixelOffset));
+
+#ifdef F_SEAL_FUTURE_WRITE
+    int seals = fcntl(mReader->fd(), F_GET_SEALS);
+    if (seals >= 0 && (seals & F_SEAL_FUTURE_WRITE)) {
+        void* map = mmap(nullptr, mReader->size(), PROT_READ | PROT_WRITE, MAP_SHARED,
+                         mReader->fd(), 0);
+        EXPECT_EQ(MAP_FAILED, map);
+        if (map != MAP_FAILED) {
+            munmap(map, mReader->size());
+        }
+        const char byte = 0;
+        EXPECT_GT(0, pwrite(mReader->fd(), &byte, 1, kShmPixelOffset));
+    }
+#endif
+}
+
+TEST_F(SharedFramebufferTest, DamageNamesChangedRects) {
+    update(mPixels.getRect());
+    readFirstFrame();
+
+    rfb::Region changed(rfb::Rect(0, 0, 64, 32));
+    changed.assign_union(rfb::Region(rfb::Rect(200, 100, 264, 164)));
+    fill(rfb::Rect(0, 0, 64, 32), 0x00ff0000);
+    fill(rfb::Rect(200, 100, 264, 164), 0x0000ff00);
+    update(changed);
+
+    SharedFrameMessage msg;
+    std::vector<SharedFrameRect> rects;
+    ASSERT_TRUE(mReader->readMessage(&msg, &rects));
+    EXPECT_EQ(kShmDamage, msg.type);
+    EXPECT_EQ(rects.size(), msg.count);
+    EXPECT_TRUE(regionOf(rects).equals(changed));
+    EXPECT_EQ(2u, mReader->header()->frames);
+
+    uint32_t v;
+    memcpy(&v, mReader->pixel(63, 31), sizeof(v));
+    EXPECT_EQ(0x00ff0000u, v);
+    memcpy(&v, mReader->pixel(200, 163), sizeof(v));
+    EXPECT_EQ(0x0000ff00u, v);
+}
+
+TEST_F(SharedFramebufferTest, BlockedDamageMerges) {
+    update(mPixels.getRect());
+    readFirstFrame();
+
+    // fill the client's receive queue so damage cannot be sent
+    std::vector<char> filler(4096, 0);
+    size_t queued = 0;
+    while (true) {
+        ssize_t n = send(mServerFd, filler.data(), filler.size(), MSG_DONTWAIT);
+        if (n <= 0) {
+            break;
+        }
+        queued += n;
+    }
+    ASSERT_GT(queued, 0u);
+
+    const rfb::Rect a(0, 0, 16, 16), b(100, 100, 116, 116), c(300, 180, 320, 200);
+    update(rfb::Region(a));
+    update(rfb::Region(b));
+    ASSERT_TRUE(mShared->hasClients());
+
+    ASSERT_TRUE(mReader->skip(queued));
+    update(rfb::Region(c));
+
+    SharedFrameMessage msg;
+    std::vector<SharedFrameRect> rects;
+    ASSERT_TRUE(mReader->readMessage(&msg, &rects));
+    EXPECT_EQ(kShmDamage, msg.type);
+    rfb::Region expected(a);
+    expected.assign_union(rfb::Region(b));
+    expected.assign_union(rfb::Region(c));
+    EXPECT_TRUE(regionOf(rects).equals(expected));
+    EXPECT_FALSE(mReader->hasData());
+}
+
+TEST_F(SharedFramebufferTest, ReaderRetriesAcrossAnUpdate) {
+    update(mPixels.getRect());
+    readFirstFrame();
+
+    uint32_t seq = mReader->begin();
+    EXPECT_TRUE(mReader->validate(seq));
+
+    // a frame written while the reader copies invalidates its copy
+    update(rfb::Region(rfb::Rect(0, 0, 8, 8)));
+    EXPECT_FALSE(mReader->validate(seq));
+
+    seq = mReader->begin();
+    EXPECT_EQ(0u, seq & 1);
+    EXPECT_TRUE(mReader->validate(seq));
+}
+
+TEST_F(SharedFramebufferTest, ConcurrentReadsNeverTear) {
+    update(mPixels.getRect());
+    readFirstFrame();
+
+    std::atomic<bool> done(false);
+    std::thread writer([&] {
+        for (uint32_t i = 1; i <= 300; i++) {
+            fill(mPixels.getRect(), i);
+            update(mPixels.getRect());
+        }
+        done = true;
+    });
+
+    int frames = 0, retries = 0;
+    std::vector<uint8_t> pixels;
+    while (!done) {
+        retries += mReader->readFrame(&pixels);
+        frames++;
+
+        // every frame is one value all over
+        const uint32_t* p = (const uint32_t*)pixels.data();
+        const size_t count = pixels.size() / 4;
+        size_t torn = 0;
+        for (size_t i = 1; i < count; i++) {
+            torn += p[i] != p[0];
+        }
+        ASSERT_EQ(0u, torn) << "frame " << frames << " starting with " << p[0];
+    }
+    writer.join();
+
+    RecordProperty("frames", frames);
+    RecordProperty("retries", retries);
+}
+
+TEST_F(SharedFramebufferTest, ResizeSendsNewConfig) {
+    update(mPixels.getRect());
+    readFirstFrame();
+    const int firstFd = mReader->fd();
+
+    resize(640, 360);
+    update(mPixels.getRect());
+
+    SharedFrameMessage msg;
+    std::vector<SharedFrameRect> rects;
+    ASSERT_TRUE(mReader->readMessage(&msg, &rects));
+    EXPECT_EQ(kShmConfig, msg.type);
+    EXPECT_EQ(640u, msg.width);
+    EXPECT_EQ(360u, msg.height);
+    EXPECT_EQ(640u * 4, mReader->header()->stride);
+    // received before the old one was closed, so never the same number
+    EXPECT_NE(firstFd, mReader->fd());
+
+    ASSERT_TRUE(mReader->readMessage(&msg, &rects));
+    EXPECT_EQ(kShmDamage, msg.type);
+    EXPECT_TRUE(regionOf(rects).equals(rfb::Region(mPixels.getRect())));
+}
+
+TEST_F(SharedFramebufferTest, ClosedClientIsDropped) {
+    update(mPixels.getRect());
+    readFirstFrame();
+
+    delete mReader;
+    mReader = nullptr;
+
+    fd_set rfds;
+    FD_ZERO(&rfds);
+    mShared->setFds(&rfds);
+    ASSERT_TRUE(FD_ISSET(mServerFd, &rfds));
+    mShared->processSockets(&rfds);
+    EXPECT_FALSE(mShared->hasClients());
+}
@@ -0,0 +1,261 @@
+//
+// vncflinger - Copyright (C) 2021 Stefanie Kondik
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+//
+
+#include <math.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+
+#include <vector>
+
+#include <benchmark/benchmark.h>
+#include <jpeglib.h>
+#include <zlib.h>
+
+#include <rfb/PixelBuffer.h>
+
+#include "DamageTracker.h"
+#include "TileClassifier.h"
+
+using namespace vncflinger;
+
+// Replays a clip through the classification processFrames() does and
+// sends tiles the way it would with the given videotileinterval: video
+// tiles are collected and flushed together once the interval is up,
+// everything else goes out with its frame. What gets sent is encoded
+// by a stand-in for Tight, libjpeg for many-colour content and zlib
+// otherwise, to compare bytes and encode time of the two settings.
+// libtigervnc's own encoders are not used, so the figures are relative.
+//
+// The clip is a 720p screen of text-like UI with a 640x360 video
+// playing in the middle and a clock that changes once a second, at
+// 60 fps.
+static const int kWidth = 1280;
+static const int kHeight = 720;
+static const rfb::Rect kVideoRect(320, 180, 960, 540);
+static const rfb::Rect kClockRect(1120, 16, 1248, 48);
+static const int kFps = 60;
+static const int kClipFrames = 4 * kFps;
+static const int kVideoFrames = kFps;
+static const int kJpegQuality = 80;
+static const int kZlibLevel = 1;
+
+static const rfb::PixelFormat kRGBX(32, 24, false, true, 255, 255, 255, 0, 8, 16);
+
+static inline void putPixel(uint8_t* p, int r, int g, int b) {
+    p[0] = r;
+    p[1] = g;
+    p[2] = b;
+    p[3] = 0xff;
+}
+
+// light background with rows of dark bars standing in for text
+static void drawUi(uint8_t* dst, int stride, const rfb::Rect& r, int seed) {
+    for (int y = r.tl.y; y < r.br.y; y++) {
+        uint8_t* p = dst + (y * stride + r.tl.x) * 4;
+        for (int x = r.tl.x; x < r.br.x; x++, p += 4) {
+            bool text = (y % 20) < 12 && ((x / 7 + y / 20 + seed) * 2654435761u >> 29) < 5 &&
+                        (x % 7) < 5;
+            if (text) {
+                putPixel(p, 0x20, 0x20, 0x28);
+            } else {
+                putPixel(p, 0xf4, 0xf4, 0xf8);
+            }
+        }
+    }
+}
+
+// smooth moving colours with a little noise, like decoded video
+static std::vector<uint8_t> drawVideo(int frame) {
+    const int w = kVideoRect.width(), h = kVideoRect.height();
+    std::vector<uint8_t> pixels(w * h * 4);
+    uint32_t noise = frame * 7919 + 1;
+    for (int y = 0; y < h; y++) {
+        for (int x = 0; x < w; x++) {
+            noise = noise * 1103515245 + 12345;
+            int n = (noise >> 28) - 8;
+            double t = frame * 0.08;
+            int r = 128 + 90 * sin(x / 37.0 + t) + n;
+            int g = 128 + 90 * sin(y / 29.0 - t * 1.3) + n;
+            int b = 128 + 90 * sin((x + y) / 53.0 + t * 0.7) + n;
+            putPixel(&pixels[(y * w + x) * 4], r, g, b);
+        }
+    }
+    return pixels;
+}
+
+static size_t encodeJpeg(const uint8_t* data, int stride, const rfb::Rect& r,
+                         std::vector<uint8_t>* row) {
+    jpeg_compress_struct cinfo;
+    jpeg_error_mgr jerr;
+    cinfo.err = jpeg_std_error(&jerr);
+    jpeg_create_compress(&cinfo);
+
+    unsigned char* out = nullptr;
+    unsigned long outSize = 0;
+    jpeg_mem_dest(&cinfo, &out, &outSize);
+    cinfo.image_width = r.width();
+    cinfo.image_height = r.height();
+    cinfo.input_components = 3;
+    cinfo.in_color_space = JCS_RGB;
+    jpeg_set_defaults(&cinfo);
+    jpeg_set_quality(&cinfo, kJpegQuality, TRUE);
+    jpeg_start_compress(&cinfo, TRUE);
+
+    row->resize(r.width() * 3);
+    while (cinfo.next_scanline < cinfo.image_height) {
+        const uint8_t* src = data + cinfo.next_scanline * stride * 4;
+        for (int x = 0; x < r.width(); x++) {
+            memcpy(&(*row)[x * 3], src + x * 4, 3);
+        }
+        JSAMPROW rows[1] = {row->data()};
+        jpeg_write_scanlines(&cinfo, rows, 1);
+    }
+    jpeg_finish_compress(&cinfo);
+    jpeg_destroy_compress(&cinfo);
+    free(out);
+    return outSize;
+}
+
+static size_t encodeZlib(const uint8_t* data, int stride, const rfb::Rect& r,
+                         std::vector<uint8_t>* raw, std::vector<uint8_t>* out) {
+    // Tight sends 24 bit pixels as three bytes
+    raw->resize(r.area() * 3);
+    for (int y = 0; y < r.height(); y++) {
+        const uint8_t* src = data + y * stride * 4;
+        uint8_t* dst = raw->data() + y * r.width() * 3;
+        for (int x = 0; x < r.width(); x++) {
+            memcpy(dst + x * 3, src + x * 4, 3);
+        }
+    }
+    uLongf size = compressBound(raw->size());
+    out->resize(size);
+    compress2(out->data(), &size, raw->data(), raw->size(), kZlibLevel);
+    return size;
+}
+
+static double now() {
+    timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+static void BM_ReplayVideoTileInterval(benchmark::State& state) {
+    const int interval = state.range(0);
+
+    std::vector<std::vector<uint8_t>> video;
+    for (int i = 0; i < kVideoFrames; i++) {
+        video.push_back(drawVideo(i));
+    }
+
+    rfb::ManagedPixelBuffer pb;
+    pb.setPF(kRGBX);
+    pb.setSize(kWidth, kHeight);
+
+    std::vector<uint8_t> row, raw, out;
+    size_t bytes = 0;
+    uint64_t tilesSent = 0;
+    double encodeTime = 0;
+
+    for (auto _ : state) {
+        int stride;
+        uint8_t* fb = pb.getBufferRW(pb.getRect(), &stride);
+        drawUi(fb, stride, pb.getRect(), 0);
+
+        DamageTracker damage;
+        TileClassifier classifier;
+        damage.reset(kWidth, kHeight);
+        classifier.reset(damage);
+
+        const int tiles = damage.tilesX() * damage.tilesY();
+        std::vector<uint8_t> deferred(tiles, 0);
+        int64_t flushAt = -1;
+
+        auto send = [&](int tx, int ty) {
+            rfb::Rect r = damage.tileRect(tx, ty);
+            int s;
+            const uint8_t* data = pb.getBuffer(r, &s);
+            double start = now();
+            if (classifier.label(tx, ty) == TileClassifier::kUI) {
+                bytes += encodeZlib(data, s, r, &raw, &out);
+            } else {
+                bytes += encodeJpeg(data, s, r, &row);
+            }
+            encodeTime += now() - start;
+            tilesSent++;
+        };
+
+        for (int frame = 0; frame < kClipFrames; frame++) {
+            const int64_t timeMs = frame * 1000 / kFps;
+
+            // the timer fires between frames and sends what the buffer
+            // holds then
+            if (flushAt >= 0 && timeMs >= flushAt) {
+                for (int i = 0; i < tiles; i++) {
+                    if (deferred[i]) {
+                        send(i % damage.tilesX(), i / damage.tilesX());
+                        deferred[i] = 0;
+                    }
+                }
+                flushAt = -1;
+            }
+
+            const std::vector<uint8_t>& v = video[frame % kVideoFrames];
+            for (int y = 0; y < kVideoRect.height(); y++) {
+                memcpy(fb + ((kVideoRect.tl.y + y) * stride + kVideoRect.tl.x) * 4,
+                       &v[y * kVideoRect.width() * 4], kVideoRect.width() * 4);
+            }
+            if (frame % kFps == 0) {
+                drawUi(fb, stride, kClockRect, frame / kFps + 1);
+            }
+            pb.commitBufferRW(pb.getRect());
+
+            for (int ty = 0; ty < damage.tilesY(); ty++) {
+                damage.hashTileRow(&pb, pb.getRect(), ty);
+                classifier.classifyTileRow(&pb, damage, ty);
+            }
+            damage.frameDone();
+
+            for (int ty = 0; ty < damage.tilesY(); ty++) {
+                for (int tx = 0; tx < damage.tilesX(); tx++) {
+                    if (!damage.isChanged(tx, ty)) {
+                        continue;
+                    }
+                    if (interval > 0 && classifier.label(tx, ty) == TileClassifier::kVideo) {
+                        deferred[ty * damage.tilesX() + tx] = 1;
+                        if (flushAt < 0) {
+                            flushAt = timeMs + interval;
+                        }
+                    } else {
+                        send(tx, ty);
+                    }
+                }
+            }
+        }
+    }
+
+    // per second of the clip
+    const double seconds = state.iterations() * (double)kClipFrames / kFps;
+    state.counters["kbit/s"] = bytes * 8 / 1000.0 / seconds;
+    state.counters["encode_ms/s"] = encodeTime * 1000 / seconds;
+    state.counters["tiles/s"] = tilesSent / seconds;
+    state.SetLabel("stand-in encoder, not libtigervnc Tight");
+}
+BENCHMARK(BM_ReplayVideoTileInterval)->Arg(0)->Arg(50)->Unit(benchmark::kMillisecond);
+
+BENCHMARK_MAIN();
@@ -0,0 +1,111 @@
+//
+// vncflinger - Copyright (C) 2021 Stefanie Kondik
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+//
+
+#include <stdint.h>
+
+#include <algorithm>
+#include <vector>
+
+#include <benchmark/benchmark.h>
+
+#include "ColorConvert.h"
+#include "VideoEncoder.h"
+#include "WorkerPool.h"
+
+using namespace vncflinger;
+
+// what VideoStreamer does per frame at 1080p: the RGBX to I420
+// conversion on its own, then conversion and VP8 encoding together.
+// Frames are a static gradient with a moving block, so the encoder
+// sees both unchanged and changed macroblocks like on a real screen.
+static const int kWidth = 1920;
+static const int kHeight = 1080;
+static const int kStride = 1984;
+static const int kBandHeight = 64;
+static const int kFrames = 16;
+static const int kBlockSize = 256;
+static const int kBitrate = 8000000;
+
+static std::vector<uint8_t> makeFrame(int index) {
+    std::vector<uint8_t> frame(kStride * kHeight * 4);
+    const int bx = index * 97 % (kWidth - kBlockSize);
+    const int by = index * 53 % (kHeight - kBlockSize);
+    for (int y = 0; y < kHeight; y++) {
+        uint8_t* p = frame.data() + y * kStride * 4;
+        for (int x = 0; x < kWidth; x++, p += 4) {
+            bool block = x >= bx && x < bx + kBlockSize && y >= by && y < by + kBlockSize;
+            p[0] = block ? (x * y + index * 31) & 0xff : x & 0xff;
+            p[1] = block ? (x ^ y) & 0xff : y & 0xff;
+            p[2] = block ? (x + index * 7) & 0xff : (x + y) & 0xff;
+            p[3] = 0xff;
+        }
+    }
+    return frame;
+}
+
+static void BM_RgbxToI420(benchmark::State& state) {
+    sp<WorkerPool> pool = new WorkerPool(state.range(0));
+    std::vector<uint8_t> src = makeFrame(0);
+    std::vector<uint8_t> dst(kWidth * kHeight * 3 / 2);
+    uint8_t* dstY = dst.data();
+    uint8_t* dstU = dstY + kWidth * kHeight;
+    uint8_t* dstV = dstU + (kWidth / 2) * (kHeight / 2);
+    const int bands = (kHeight + kBandHeight - 1) / kBandHeight;
+
+    for (auto _ : state) {
+        pool->run(bands, [&](int i) {
+            rgbxToI420(src.data(), kStride * 4, kWidth, i * kBandHeight,
+                       std::min((i + 1) * kBandHeight, kHeight), dstY, kWidth, dstU, dstV,
+                       kWidth / 2);
+        });
+        benchmark::ClobberMemory();
+    }
+    state.SetBytesProcessed(state.iterations() * kWidth * kHeight * 4);
+    state.counters["threads"] = pool->size();
+}
+BENCHMARK(BM_RgbxToI420)->Arg(1)->Arg(2)->Arg(4)->Arg(0)->UseRealTime();
+
+static void BM_EncodeVp8(benchmark::State& state) {
+    sp<WorkerPool> pool = new WorkerPool(state.range(0));
+    VideoEncoder encoder(pool, kBitrate);
+    if (!encoder.start(kWidth, kHeight)) {
+        state.SkipWithError("encoder failed to start");
+        return;
+    }
+
+    std::vector<std::vector<uint8_t>> frames;
+    for (int i = 0; i < kFrames; i++) {
+        frames.push_back(makeFrame(i));
+    }
+
+    int frame = 0;
+    size_t bytes = 0;
+    for (auto _ : state) {
+        encoder.convert(frames[frame % kFrames].data(), kStride);
+        // 60 fps, in milliseconds
+        encoder.encode(frame * 16, false, [&](const uint8_t*, size_t size, bool, int64_t) {
+            bytes += size;
+        });
+        frame++;
+    }
+    state.SetItemsProcessed(state.iterations());
+    state.counters["bytes/frame"] = state.iterations() ? bytes / state.iterations() : 0;
+    state.counters["threads"] = pool->size();
+}
+BENCHMARK(BM_EncodeVp8)->Arg(1)->Arg(2)->Arg(4)->Arg(0)->UseRealTime();
+
+BENCHMARK_MAIN();
@@ -0,0 +1,86 @@
+//
+// vncflinger - Copyright (C) 2021 Stefanie Kondik
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+//
+
+#include <stdint.h>
+#include <string.h>
+
+#include <algorithm>
+#include <vector>
+
+#include <benchmark/benchmark.h>
+
+#include "ColorConvert.h"
+#include "WorkerPool.h"
+
+using namespace vncflinger;
+
+// the copy processFrames() does, band by band: a 1080p RGBX frame with
+// a padded stride into a tightly packed pixel buffer. Host memory is
+// cached, unlike the gralloc buffers on a device, so this shows the
+// scaling of the pool rather than the absolute device rate.
+static const int kWidth = 1920;
+static const int kHeight = 1080;
+static const int kStride = 1984;
+static const int kBandHeight = 64;
+
+static void copyFrame(benchmark::State& state, RowConverter convert, int dstBpp) {
+    sp<WorkerPool> pool = new WorkerPool(state.range(0));
+    std::vector<uint8_t> src(kStride * kHeight * 4, 0x5a);
+    std::vector<uint8_t> dst(kWidth * kHeight * dstBpp);
+    const int bands = (kHeight + kBandHeight - 1) / kBandHeight;
+
+    for (auto _ : state) {
+        pool->run(bands, [&](int i) {
+            const int y1 = std::min((i + 1) * kBandHeight, kHeight);
+            for (int y = i * kBandHeight; y < y1; y++) {
+                const uint8_t* s = src.data() + y * kStride * 4;
+                uint8_t* d = dst.data() + y * kWidth * dstBpp;
+                if (convert == nullptr) {
+                    memcpy(d, s, kWidth * 4);
+                } else {
+                    convert(s, d, kWidth);
+                }
+            }
+        });
+        benchmark::ClobberMemory();
+    }
+    state.SetBytesProcessed(state.iterations() * kWidth * kHeight * 4);
+    state.counters["threads"] = pool->size();
+}
+
+static void BM_CopyFrame(benchmark::State& state) {
+    copyFrame(state, nullptr, 4);
+}
+BENCHMARK(BM_CopyFrame)->Arg(1)->Arg(2)->Arg(4)->Arg(8)->Arg(0)->UseRealTime();
+
+static void BM_CopyFrameRgb565(benchmark::State& state) {
+    copyFrame(state, rgbxToRgb565Row, 2);
+}
+BENCHMARK(BM_CopyFrameRgb565)->Arg(1)->Arg(2)->Arg(4)->Arg(8)->Arg(0)->UseRealTime();
+
+// what a batch costs apart from the jobs
+static void BM_EmptyBatch(benchmark::State& state) {
+    sp<WorkerPool> pool = new WorkerPool(state.range(0));
+    const int bands = (kHeight + kBandHeight - 1) / kBandHeight;
+    for (auto _ : state) {
+        pool->run(bands, [](int) {});
+    }
+    state.counters["threads"] = pool->size();
+}
+BENCHMARK(BM_EmptyBatch)->Arg(1)->Arg(2)->Arg(4)->Arg(8)->UseRealTime();
+
+BENCHMARK_MAIN();
@@ -0,0 +1,225 @@
+//
+// vncflinger - Copyright (C) 2021 Stefanie Kondik
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+//
+
+#include <errno.h>
+#include <netinet/in.h>
+#include <poll.h>
+#include <stdint.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include <linux/errqueue.h>
+
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <benchmark/benchmark.h>
+
+// CPU the WebSocket listener spends per MiB sent to a browser on
+// loopback, with plain send() and with MSG_ZEROCOPY. The CPU column is
+// the sending thread only, the peers run on their own threads.
+//
+// BM_LoopbackSend is the send alone. BM_LoopbackRelay is the whole path
+// of a batch: read from the server's socket pair, framed into toWs (the
+// two copies in userspace) and sent. On loopback the kernel copies
+// zerocopy sends anyway, the "copied" counter shows how many.
+static const size_t kBatch = 1024 * 1024;
+static const size_t kReadSize = 64 * 1024;
+
+static void tcpPair(int* client, int* server) {
+    int listener = socket(AF_INET, SOCK_STREAM, 0);
+    struct sockaddr_in addr = {};
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    socklen_t len = sizeof(addr);
+    bind(listener, (struct sockaddr*)&addr, sizeof(addr));
+    listen(listener, 1);
+    getsockname(listener, (struct sockaddr*)&addr, &len);
+
+    *client = socket(AF_INET, SOCK_STREAM, 0);
+    connect(*client, (struct sockaddr*)&addr, sizeof(addr));
+    *server = accept(listener, NULL, NULL);
+    close(listener);
+}
+
+struct ZeroCopyState {
+    uint64_t completions = 0;
+    uint64_t copied = 0;
+    uint64_t pending = 0;
+};
+
+static void reap(int fd, ZeroCopyState* zc, bool wait) {
+    while (zc->pending > 0) {
+        if (wait) {
+            struct pollfd pfd = {fd, 0, 0};
+            poll(&pfd, 1, -1);
+        }
+        char control[CMSG_SPACE(sizeof(struct sock_extended_err)) + 64];
+        struct msghdr msg = {};
+        msg.msg_control = control;
+        msg.msg_controllen = sizeof(control);
+        if (recvmsg(fd, &msg, MSG_ERRQUEUE | MSG_DONTWAIT) < 0) {
+            if (wait) {
+                continue;
+            }
+            return;
+        }
+        for (struct cmsghdr* cmsg = CMSG_FIRSTHDR(&msg); cmsg != NULL;
+             cmsg = CMSG_NXTHDR(&msg, cmsg)) {
+            struct sock_extended_err err;
+            memcpy(&err, CMSG_DATA(cmsg), sizeof(err));
+            if (err.ee_origin != SO_EE_ORIGIN_ZEROCOPY) {
+                continue;
+            }
+            const uint32_t count = err.ee_data - err.ee_info + 1;
+            zc->completions += count;
+            zc->pending -= count;
+            if (err.ee_code & SO_EE_CODE_ZEROCOPY_COPIED) {
+                zc->copied += count;
+            }
+        }
+        wait = false;
+    }
+}
+
+static void sendAll(int fd, const char* data, size_t size, bool zeroCopy, ZeroCopyState* zc) {
+    while (size > 0) {
+        ssize_t n = send(fd, data, size, MSG_NOSIGNAL | (zeroCopy ? MSG_ZEROCOPY : 0));
+        if (n < 0) {
+            if (errno == ENOBUFS) {
+                reap(fd, zc, true);
+            }
+            continue;
+        }
+        if (zeroCopy) {
+            zc->pending++;
+        }
+        data += n;
+        size -= n;
+    }
+    if (zeroCopy) {
+        reap(fd, zc, false);
+    }
+}
+
+// the browser, drains the TCP connection
+static std::thread startSink(int fd) {
+    return std::thread([fd] {
+        std::vector<char> buf(256 * 1024);
+        while (recv(fd, buf.data(), buf.size(), 0) > 0) {
+        }
+    });
+}
+
+static void BM_LoopbackSend(benchmark::State& state) {
+    const bool zeroCopy = state.range(0);
+    int tx, rx;
+    tcpPair(&tx, &rx);
+    int one = 1;
+    if (zeroCopy && setsockopt(tx, SOL_SOCKET, SO_ZEROCOPY, &one, sizeof(one)) < 0) {
+        state.SkipWithError("SO_ZEROCOPY not supported");
+    }
+    std::thread sink = startSink(rx);
+
+    // zerocopy pages must not change before completion, this one never
+    // does
+    std::string batch(kBatch, 'x');
+    ZeroCopyState zc;
+    for (auto _ : state) {
+        sendAll(tx, batch.data(), batch.size(), zeroCopy, &zc);
+    }
+    reap(tx, &zc, true);
+
+    shutdown(tx, SHUT_WR);
+    sink.join();
+    close(tx);
+    close(rx);
+
+    state.SetBytesProcessed(state.iterations() * kBatch);
+    state.counters["completions"] = zc.completions;
+    state.counters["copied"] = zc.copied;
+}
+BENCHMARK(BM_LoopbackSend)->Arg(0)->Arg(1);
+
+static void BM_LoopbackRelay(benchmark::State& state) {
+    const bool zeroCopy = state.range(0);
+    int tx, rx;
+    tcpPair(&tx, &rx);
+    int one = 1;
+    if (zeroCopy && setsockopt(tx, SOL_SOCKET, SO_ZEROCOPY, &one, sizeof(one)) < 0) {
+        state.SkipWithError("SO_ZEROCOPY not supported");
+    }
+    std::thread sink = startSink(rx);
+
+    // the server writes RFB data into its end of the pair
+    int pair[2];
+    socketpair(AF_UNIX, SOCK_STREAM, 0, pair);
+    std::thread server([fd = pair[0]] {
+        std::vector<char> buf(kReadSize, 'x');
+        while (send(fd, buf.data(), buf.size(), MSG_NOSIGNAL) > 0) {
+        }
+    });
+
+    std::vector<char> buf(kReadSize);
+    ZeroCopyState zc;
+    for (auto _ : state) {
+        // a fresh buffer per batch, like the listener hands its batch
+        // over and starts a new one
+        std::string toWs;
+        while (toWs.size() < kBatch) {
+            ssize_t n = recv(pair[1], buf.data(), buf.size(), 0);
+            if (n <= 0) {
+                state.SkipWithError("server socket closed");
+                break;
+            }
+            // framed as queueFrame() does
+            uint8_t header[10] = {0x82};
+            size_t headerLen = 4;
+            if (n <= 0xffff) {
+                header[1] = 126;
+                header[2] = n >> 8;
+                header[3] = n;
+            } else {
+                header[1] = 127;
+                for (int i = 0; i < 8; i++) {
+                    header[2 + i] = (uint64_t)n >> (56 - 8 * i);
+                }
+                headerLen = 10;
+            }
+            toWs.append((const char*)header, headerLen);
+            toWs.append(buf.data(), n);
+        }
+        sendAll(tx, toWs.data(), toWs.size(), zeroCopy, &zc);
+        // zerocopy pages stay pinned until completion
+        reap(tx, &zc, true);
+    }
+
+    close(pair[1]);
+    server.join();
+    close(pair[0]);
+    shutdown(tx, SHUT_WR);
+    sink.join();
+    close(tx);
+    close(rx);
+
+    state.SetBytesProcessed(state.iterations() * kBatch);
+    state.counters["completions"] = zc.completions;
+    state.counters["copied"] = zc.copied;
+}
+BENCHMARK(BM_LoopbackRelay)->Arg(0)->Arg(1);